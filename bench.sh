@@ -0,0 +1,129 @@
+#!/bin/bash
+# Замеры производительности kubsh (make bench)
+# Без root и useradd: kubsh получает сгенерированный passwd и корень VFS
+# во временном каталоге через ~/.kubshrc (passwd_file, vfs_root).
+#
+# Переменные окружения:
+#   BENCH_SIZES   — число пользователей в прогонах (по умолчанию "100 1000 10000 100000")
+#   BENCH_RUNS    — повторов для медианы (по умолчанию 5)
+#   BENCH_OUTPUT  — файл результатов, JSON Lines (по умолчанию bench_output.txt)
+#   KUBSH         — проверяемый бинарник (по умолчанию ./kubsh)
+
+set -euo pipefail
+
+SIZES=${BENCH_SIZES:-"100 1000 10000 100000"}
+RUNS=${BENCH_RUNS:-5}
+OUTPUT=${BENCH_OUTPUT:-bench_output.txt}
+KUBSH=$(realpath "${KUBSH:-./kubsh}")
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+BATCH_LINES=20000
+SYNC_LINES=2000
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/kubsh-bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+# Изолируем kubsh: свой HOME с конфигом и историей, демон не используется
+export HOME="$WORK/home"
+export KUBSH_SOCKET="$WORK/no-daemon.sock"
+unset XDG_RUNTIME_DIR
+mkdir -p "$HOME"
+
+# Время в микросекундах
+now_us() {
+    local t=$EPOCHREALTIME
+    echo $(( ${t%.*} * 1000000 + 10#${t#*.} ))
+}
+
+# Время выполнения команды в микросекундах, вывод отбрасывается
+time_us() {
+    local start end
+    start=$(now_us)
+    "$@" >/dev/null 2>&1 || true
+    end=$(now_us)
+    echo $(( end - start ))
+}
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print (NR % 2) ? v[(NR + 1) / 2] : int((v[NR / 2] + v[NR / 2 + 1]) / 2) }'
+}
+
+# Одна строка результата: {"users":N,"metric":"...","value":V,"unit":"...","commit":"..."}
+record() {
+    printf '{"users":%d,"metric":"%s","value":%s,"unit":"%s","commit":"%s"}\n' \
+        "$1" "$2" "$3" "$4" "$COMMIT" | tee -a "$OUTPUT"
+}
+
+# Сценарий на stdin: интерактивный путь (история, без отложенной синхронизации) — для замеров старта
+run_stdin() {
+    "$KUBSH" < "$1"
+}
+
+# Сценарий аргументом: пакетный режим, как kubsh script.sh
+run_batch() {
+    "$KUBSH" "$1"
+}
+
+# Медиана RUNS прогонов kubsh над скриптом: median_script run_stdin|run_batch script
+median_script() {
+    local run=$1 script=$2 i
+    for ((i = 0; i < RUNS; i++)); do
+        time_us "$run" "$script"
+    done | median
+}
+
+: > "$OUTPUT"
+
+for n in $SIZES; do
+    dir="$WORK/n$n"
+    mkdir -p "$dir"
+
+    # Сгенерированный passwd: n пользователей с домашним каталогом и shell
+    awk -v n="$n" 'BEGIN {
+        print "root:x:0:0:root:/root:/bin/bash"
+        for (i = 1; i <= n; i++)
+            printf "bench%06d:x:%d:%d::/home/bench%06d:/bin/sh\n", i, 10000 + i, 10000 + i, i
+    }' > "$dir/passwd"
+
+    printf 'vfs_root = %s\npasswd_file = %s\nhistory_size = 16\n' "$dir/users" "$dir/passwd" \
+        > "$HOME/.kubshrc"
+
+    # Полная сверка дорогая: на больших n повторов меньше
+    refresh_lines=$(( 200000 / n ))
+    (( refresh_lines > 200 )) && refresh_lines=200
+    (( refresh_lines < 1 )) && refresh_lines=1
+
+    : > "$dir/empty.sh"
+    for ((i = 0; i < SYNC_LINES; i++)); do echo '\sync'; done > "$dir/sync.sh"
+    for ((i = 0; i < refresh_lines; i++)); do echo '\refresh'; done > "$dir/refresh.sh"
+    for ((i = 0; i < BATCH_LINES; i++)); do echo 'echo x'; done > "$dir/batch.sh"
+
+    # Холодный старт: пустой корень VFS, kubsh создаёт его с нуля
+    record "$n" startup_cold_us "$(time_us run_stdin "$dir/empty.sh")" us
+
+    # Тёплый старт: манифест уже есть, проверяется только актуальность
+    record "$n" startup_warm_us "$(median_script run_stdin "$dir/empty.sh")" us
+
+    # Остальные сценарии — в пакетном режиме; из них вычитается его пустой прогон
+    empty_us=$(median_script run_batch "$dir/empty.sh")
+
+    # Синхронизация без изменений (после каждой команды без inotify) и полная сверка
+    sync_us=$(median_script run_batch "$dir/sync.sh")
+    record "$n" sync_noop_us "$(awk -v a="$sync_us" -v b="$empty_us" -v k="$SYNC_LINES" \
+        'BEGIN { v = (a - b) / k; if (v < 0) v = 0; printf "%.2f", v }')" us
+    refresh_us=$(median_script run_batch "$dir/refresh.sh")
+    record "$n" refresh_full_us "$(awk -v a="$refresh_us" -v b="$empty_us" -v k="$refresh_lines" \
+        'BEGIN { v = (a - b) / k; if (v < 0) v = 0; printf "%.2f", v }')" us
+
+    # listusers: запуск kubsh -c целиком, как его видит пользователь
+    for ((i = 0; i < RUNS; i++)); do
+        time_us "$KUBSH" -c listusers
+    done | median > "$dir/listusers"
+    record "$n" listusers_us "$(cat "$dir/listusers")" us
+
+    # Пакетный режим: встроенные команды в секунду, без запуска процессов
+    batch_us=$(median_script run_batch "$dir/batch.sh")
+    record "$n" batch_cmds_per_sec "$(awk -v t="$batch_us" -v b="$empty_us" -v k="$BATCH_LINES" \
+        'BEGIN { d = t - b; v = (d > 0) ? k * 1000000 / d : 0; printf "%.0f", v }')" "cmd/s"
+done
+
+echo "Результаты: $OUTPUT"
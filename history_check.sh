@@ -0,0 +1,93 @@
+#!/bin/bash
+# Проверка общего журнала истории при параллельных сессиях (make check-history)
+# Несколько kubsh одновременно дописывают команды в один ~/.kubsh_history:
+#   без сжатия      — в журнале остаются все записи, без повторов и обрывков
+#   со сжатием      — малый KUBSH_HISTSIZE заставляет сессии переписывать журнал
+#                     (новый inode); у каждой сессии остаётся непрерывный хвост
+#                     её команд до последней, записи в старый файл не теряются
+#
+# Переменные окружения:
+#   HISTORY_SESSIONS — число параллельных сессий (по умолчанию 4)
+#   HISTORY_COMMANDS — команд в каждой сессии (по умолчанию 500)
+#   KUBSH            — проверяемый бинарник (по умолчанию ./kubsh)
+
+set -euo pipefail
+
+SESSIONS=${HISTORY_SESSIONS:-4}
+COMMANDS=${HISTORY_COMMANDS:-500}
+KUBSH=$(realpath "${KUBSH:-./kubsh}")
+COMPACT_SIZE=50
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/kubsh-history.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+# kubsh без чужого конфига и демона; история — в $WORK/home
+export HOME="$WORK/home"
+export KUBSH_SOCKET="$WORK/no-daemon.sock"
+mkdir -p "$HOME"
+
+# Параллельные сессии с ёмкостью истории $1; команды сессии s — "echo s<s>-<i>"
+run_sessions() {
+    local size=$1 s pids=()
+    rm -f "$HOME/.kubsh_history"
+    for ((s = 1; s <= SESSIONS; s++)); do
+        seq -f "echo s$s-%g" 1 "$COMMANDS" | KUBSH_HISTSIZE=$size "$KUBSH" > /dev/null &
+        pids+=($!)
+    done
+    for pid in "${pids[@]}"; do
+        wait "$pid"
+    done
+}
+
+# Команды журнала по порядку: читаем его целиком новой сессией
+history_records() {
+    echo '\history' | KUBSH_HISTSIZE=$(( SESSIONS * COMMANDS * 2 )) "$KUBSH" |
+        sed -n 's/^ *[0-9]*: //p' | grep -v '^\\history$' || true
+}
+
+failed=0
+
+report() {
+    local name=$1 problems=$2
+    if [[ -z "$problems" ]]; then
+        echo "OK   $name"
+    else
+        echo "FAIL $name"
+        echo "$problems" | head -20
+        failed=1
+    fi
+}
+
+# Посторонние строки и повторы: обрывки записей или дважды прочитанные участки
+malformed() {
+    grep -Ev '^echo s[0-9]+-[0-9]+$' "$1" | sed 's/^/лишняя запись: /'
+    sort "$1" | uniq -d | sed 's/^/повтор: /'
+}
+
+run_sessions $(( SESSIONS * COMMANDS * 2 ))
+history_records > "$WORK/full"
+report "$SESSIONS сессий по $COMMANDS команд: все $(( SESSIONS * COMMANDS )) записей" "$(
+    malformed "$WORK/full"
+    for ((s = 1; s <= SESSIONS; s++)); do
+        seq -f "echo s$s-%g" 1 "$COMMANDS" | grep -Fxvf "$WORK/full" | sed 's/^/потеряна: /'
+    done
+)"
+
+run_sessions $COMPACT_SIZE
+history_records > "$WORK/compact"
+report "$SESSIONS сессий со сжатием до $COMPACT_SIZE записей" "$(
+    malformed "$WORK/compact"
+    total=$(wc -l < "$WORK/compact")
+    (( total >= COMPACT_SIZE )) || echo "осталось $total записей из $COMPACT_SIZE"
+    for ((s = 1; s <= SESSIONS; s++)); do
+        # Сжатие отрезает начало журнала: у сессии должен остаться хвост first..COMMANDS без дыр
+        mapfile -t ids < <(sed -n "s/^echo s$s-//p" "$WORK/compact")
+        first=${ids[0]:-$(( COMMANDS + 1 ))}
+        expected=$(seq "$first" "$COMMANDS")
+        actual=$(printf '%s\n' "${ids[@]}")
+        [[ "$actual" == "$expected" ]] ||
+            echo "сессия $s: записи $(echo $actual | cut -c1-200) вместо непрерывного $first..$COMMANDS"
+    done
+)"
+
+exit $failed
@@ -1,3 +1,7 @@
+#ifdef KUBSH_FUSE
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,19 +15,214 @@
 #include <errno.h>
 #include <limits.h>
 #include <time.h>
+#include <sys/inotify.h>
+#include <sys/select.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <spawn.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <shadow.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <stdatomic.h>
+#include <termios.h>
+#include <sys/signalfd.h>
 
-#define MAX_INPUT_SIZE 1024
-#define MAX_HISTORY_SIZE 100
+// Ёмкость истории по умолчанию (history_size в конфигурации, KUBSH_HISTSIZE)
+#define DEFAULT_HISTORY_SIZE 100000
 #define MAX_USERNAME_SIZE 32
 #define HISTORY_FILE ".kubsh_history"
+#define PASSWD_FILE "/etc/passwd"
+// Интервал опроса, если inotify недоступен (sync_interval в конфигурации)
+#define SYNC_POLL_INTERVAL_MS 200
+// Как часто выгружать статистику в stats_file, секунды (stats_interval)
+#define STATS_EXPORT_INTERVAL 10
+#define SYSTEM_CONFIG_FILE "/etc/kubsh.conf"
+#define USER_CONFIG_FILE ".kubshrc"
 
 // Для тестов kubsh в Docker VFS должен быть в /opt/users (запуск под root),
-// но для обычного пользователя на хосте создаём VFS в $HOME/users.
+// но для обычного пользователя на хосте создаём VFS в $HOME/users (или vfs_root).
 #define USERS_DIR_ROOT "/opt/users"
 #define USERS_DIR_HOME "users"
+// Манифест сгенерированных каталогов пользователей в корне VFS
+#define VFS_INDEX_FILE ".kubsh_index"
 
-char *history[MAX_HISTORY_SIZE];
-int history_count = 0;
+int interactive = 1;         // stdin — терминал: баннер, приглашение, сообщения VFS
+int batch_mode = 0;          // kubsh -c / сценарий
+int vfs_sync_pending = 0;    // в пакетном режиме синхронизация откладывается до конца
+int fuse_mode = 0;           // VFS отдаётся через FUSE (kubsh --fuse), на диск не пишется
+
+// Настройки из /etc/kubsh.conf и ~/.kubshrc; по SIGHUP перечитываются
+typedef struct {
+    char vfs_root[PATH_MAX];  // пусто — /opt/users под root, ~/users иначе
+    int sync_poll;            // sync = poll: без inotify, опрос раз в sync_interval
+    int sync_interval_ms;
+    long history_size;
+    int format;               // формат вывода по умолчанию (FMT_*)
+    char passwd_file[PATH_MAX];   // откуда VFS берёт пользователей (тесты, замеры)
+    char stats_file[PATH_MAX];    // куда выгружать \stats для сборщиков; пусто — никуда
+    int stats_interval;           // секунды между выгрузками
+} Config;
+
+Config config = { "", 0, SYNC_POLL_INTERVAL_MS, DEFAULT_HISTORY_SIZE, 0, PASSWD_FILE, "", STATS_EXPORT_INTERVAL };
+int reload_pipe[2] = { -1, -1 };   // SIGHUP → байт в канал, разбор в основном цикле
+
+// Учётные записи меняются только когда VFS показывает настоящий /etc/passwd:
+// с passwd_file-фикстурой проверки имён и UID шли бы по одному файлу, а запись —
+// в системные, и каталоги из фикстуры создавали бы и удаляли реальных пользователей
+int accounts_writable() {
+    return strcmp(config.passwd_file, PASSWD_FILE) == 0;
+}
+
+// Сообщение команде, если учётные записи менять нельзя; 0 — можно
+static int accounts_locked(const char *cmd) {
+    if (accounts_writable()) return 0;
+    printf("%s: passwd_file = %s — системные учётные записи не меняются\n", cmd, config.passwd_file);
+    return 1;
+}
+
+// --- Статистика ---
+// Включена всегда: на горячем пути — clock_gettime() (vDSO, без системного вызова)
+// и несколько атомарных сложений без барьеров; читает их только \stats и выгрузка.
+// Фаза — интервал по монотонным часам с гистограммой по степеням двойки микросекунд.
+// Вложенные фазы входят во внешние: sync включает useradd, userdel — spawn.
+
+enum { PH_SYNC, PH_REFRESH, PH_USERADD, PH_USERDEL, PH_SPAWN, PH_EXEC, PH_HISTORY, PH_COUNT };
+static const char *const phase_names[PH_COUNT] = {
+    "sync", "refresh", "useradd", "userdel", "spawn", "exec", "history_save"
+};
+
+enum { CNT_OPEN, CNT_STAT, CNT_CHILD, CNT_INOTIFY, CNT_COMMAND, CNT_COUNT };
+static const char *const counter_names[CNT_COUNT] = {
+    "open", "stat", "child", "inotify_event", "command"
+};
+
+// Корзина 0 — меньше 1 мкс, корзина i — [2^(i-1), 2^i) мкс, последняя — всё, что дольше
+#define STATS_BUCKETS 28
+
+typedef struct {
+    _Atomic uint64_t count, total_ns, max_ns;
+    _Atomic uint64_t opens, stats;     // open/stat, сделанные за время фазы
+    _Atomic uint64_t hist[STATS_BUCKETS];
+} PhaseStats;
+
+PhaseStats phase_stats[PH_COUNT];
+_Atomic uint64_t counters[CNT_COUNT];
+// Для фаз open/stat считаются по потоку: в фазу не попадают вызовы фоновых заданий
+static _Thread_local uint64_t thread_opens, thread_stats;
+
+typedef struct {
+    struct timespec start;
+    uint64_t opens, stats;
+} PhaseTimer;
+
+static inline void count_event(int c) {
+    atomic_fetch_add_explicit(&counters[c], 1, memory_order_relaxed);
+}
+
+static inline void count_syscall(int c) {
+    count_event(c);
+    if (c == CNT_OPEN) thread_opens++;
+    else thread_stats++;
+}
+
+// Все открытия и stat в kubsh идут через эти обёртки; считаются успешные вызовы
+static int k_open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    int fd = open(path, flags, mode);
+    if (fd != -1) count_syscall(CNT_OPEN);
+    return fd;
+}
+
+static int k_openat(int dfd, const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    int fd = openat(dfd, path, flags, mode);
+    if (fd != -1) count_syscall(CNT_OPEN);
+    return fd;
+}
+
+static FILE *k_fopen(const char *path, const char *mode) {
+    FILE *f = fopen(path, mode);
+    if (f) count_syscall(CNT_OPEN);
+    return f;
+}
+
+static DIR *k_opendir(const char *path) {
+    DIR *d = opendir(path);
+    if (d) count_syscall(CNT_OPEN);
+    return d;
+}
+
+static int k_stat(const char *path, struct stat *st) {
+    int rc = stat(path, st);
+    if (rc == 0) count_syscall(CNT_STAT);
+    return rc;
+}
+
+static int k_lstat(const char *path, struct stat *st) {
+    int rc = lstat(path, st);
+    if (rc == 0) count_syscall(CNT_STAT);
+    return rc;
+}
+
+static int k_fstat(int fd, struct stat *st) {
+    int rc = fstat(fd, st);
+    if (rc == 0) count_syscall(CNT_STAT);
+    return rc;
+}
+
+static int k_fstatat(int dfd, const char *path, struct stat *st, int flags) {
+    int rc = fstatat(dfd, path, st, flags);
+    if (rc == 0) count_syscall(CNT_STAT);
+    return rc;
+}
+
+static inline void phase_begin(PhaseTimer *t) {
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+    t->opens = thread_opens;
+    t->stats = thread_stats;
+}
+
+void phase_end(int phase, const PhaseTimer *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (uint64_t)((now.tv_sec - t->start.tv_sec) * 1000000000LL + (now.tv_nsec - t->start.tv_nsec));
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+
+    PhaseStats *p = &phase_stats[phase];
+    atomic_fetch_add_explicit(&p->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->hist[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->opens, thread_opens - t->opens, memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->stats, thread_stats - t->stats, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&p->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&p->max_ns, &max, ns,
+                                                               memory_order_relaxed, memory_order_relaxed)) {}
+}
 
 // Структура для хранения информации о пользователе
 typedef struct {
@@ -33,11 +232,16 @@ typedef struct {
     char shell[256];
 } UserInfo;
 
-// Обработчик сигнала SIGHUP
+// Обработчик сигнала SIGHUP: только write() в канал — printf и перечитывание
+// конфигурации в обработчике сигнала небезопасны
 void sighup_handler(int sig) {
-    printf("\nConfiguration reloaded (SIGHUP received)\n");
-    printf("kubsh> ");
-    fflush(stdout);
+    (void)sig;
+    int saved = errno;
+    if (reload_pipe[1] != -1) {
+        ssize_t n = write(reload_pipe[1], "", 1);
+        (void)n;
+    }
+    errno = saved;
 }
 
 // Получение домашней директории
@@ -57,7 +261,7 @@ char* get_home_path() {
 
 // Путь к файлу истории
 char* get_history_path() {
-    static char path[1024];
+    static char path[PATH_MAX];
     char *home = get_home_path();
     snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
     return path;
@@ -67,9 +271,11 @@ char* get_history_path() {
 //  - если запущено от root (как в тестовом Docker-образе) → /opt/users
 //  - если обычный пользователь на хосте → $HOME/users
 char* get_users_dir_path() {
-    static char path[1024];
+    static char path[PATH_MAX];
 
-    if (geteuid() == 0) {
+    if (config.vfs_root[0]) {
+        snprintf(path, sizeof(path), "%s", config.vfs_root);
+    } else if (geteuid() == 0) {
         snprintf(path, sizeof(path), "%s", USERS_DIR_ROOT);
     } else {
         char *home = get_home_path();
@@ -79,513 +285,6941 @@ char* get_users_dir_path() {
     return path;
 }
 
-// Создание файлов пользователя в VFS
-void create_user_vfs_entry(struct passwd *pw) {
-    char *users_dir = get_users_dir_path();
-    char user_dir_path[512];
-    snprintf(user_dir_path, sizeof(user_dir_path), "%s/%s", users_dir, pw->pw_name);
+// --- Снимки состояния для синхронизации ---
+// Хеш-множество имён пользователей (открытая адресация, размер — степень двойки).
 
-    if (mkdir(user_dir_path, 0755) == -1 && errno != EEXIST) {
-        perror("Ошибка создания директории пользователя");
-        return;
-    }
+typedef struct {
+    char *name;          // NULL — свободно, TOMBSTONE — удалено
+    unsigned long hash;  // для манифеста VFS: хеш строки с полями пользователя
+} UserSetEntry;
 
-    // id
-    char id_file_path[512];
-    snprintf(id_file_path, sizeof(id_file_path), "%s/id", user_dir_path);
-    FILE *f = fopen(id_file_path, "w");
-    if (f) { fprintf(f, "%d", pw->pw_uid); fclose(f); }
+typedef struct {
+    UserSetEntry *slots;
+    size_t cap;
+    size_t count;        // живые записи
+    size_t used;         // живые + удалённые
+} UserSet;
 
-    // home
-    char home_file_path[512];
-    snprintf(home_file_path, sizeof(home_file_path), "%s/home", user_dir_path);
-    f = fopen(home_file_path, "w");
-    if (f) { fprintf(f, "%s", pw->pw_dir); fclose(f); }
+static char user_set_tombstone;
+#define TOMBSTONE (&user_set_tombstone)
 
-    // shell
-    char shell_file_path[512];
-    snprintf(shell_file_path, sizeof(shell_file_path), "%s/shell", user_dir_path);
-    f = fopen(shell_file_path, "w");
-    if (f) { fprintf(f, "%s", pw->pw_shell); fclose(f); }
+unsigned long hash_str(const char *s) {
+    unsigned long h = 1469598103934665603UL; // FNV-1a
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211UL; }
+    return h;
+}
 
-    // info
-    char info_file_path[512];
-    snprintf(info_file_path, sizeof(info_file_path), "%s/info", user_dir_path);
-    f = fopen(info_file_path, "w");
-    if (f) {
-        fprintf(f, "Username: %s\n", pw->pw_name);
-        fprintf(f, "UID: %d\n", pw->pw_uid);
-        fprintf(f, "GID: %d\n", pw->pw_gid);
-        fprintf(f, "Home: %s\n", pw->pw_dir);
-        fprintf(f, "Shell: %s\n", pw->pw_shell);
-        if (pw->pw_gecos) fprintf(f, "GECOS: %s\n", pw->pw_gecos);
-        fclose(f);
+UserSetEntry *user_set_find(const UserSet *set, const char *name) {
+    if (set->cap == 0) return NULL;
+    size_t mask = set->cap - 1;
+    for (size_t i = hash_str(name) & mask; set->slots[i].name; i = (i + 1) & mask) {
+        if (set->slots[i].name != TOMBSTONE && strcmp(set->slots[i].name, name) == 0)
+            return &set->slots[i];
     }
+    return NULL;
+}
 
-    // symlink
-    char link_path[512];
-    snprintf(link_path, sizeof(link_path), "%s/home_link", user_dir_path);
-    if (access(link_path, F_OK) != 0) {
-        symlink(pw->pw_dir, link_path);
+void user_set_free(UserSet *set) {
+    for (size_t i = 0; i < set->cap; i++) {
+        if (set->slots[i].name && set->slots[i].name != TOMBSTONE) free(set->slots[i].name);
     }
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
 }
 
-// Создание VFS
-void create_users_vfs() {
-    char *users_dir = get_users_dir_path();
-    struct stat st = {0};
+static void user_set_grow(UserSet *set) {
+    UserSet bigger = {0};
+    bigger.cap = set->cap ? set->cap * 2 : 64;
+    bigger.slots = calloc(bigger.cap, sizeof(UserSetEntry));
+    if (!bigger.slots) { perror("calloc"); exit(1); }
+    for (size_t i = 0; i < set->cap; i++) {
+        UserSetEntry *e = &set->slots[i];
+        if (!e->name || e->name == TOMBSTONE) continue;
+        size_t j = hash_str(e->name) & (bigger.cap - 1);
+        while (bigger.slots[j].name) j = (j + 1) & (bigger.cap - 1);
+        bigger.slots[j] = *e;
+        bigger.count++;
+        bigger.used++;
+    }
+    free(set->slots);
+    *set = bigger;
+}
 
-    if (stat(users_dir, &st) == -1) {
-        if (mkdir(users_dir, 0755) == -1) {
-            perror("Ошибка создания директории пользователей");
-            return;
-        }
+// Добавление (или поиск существующей) записи
+UserSetEntry *user_set_add(UserSet *set, const char *name) {
+    UserSetEntry *e = user_set_find(set, name);
+    if (e) return e;
+    if ((set->used + 1) * 4 >= set->cap * 3) user_set_grow(set);
+
+    size_t mask = set->cap - 1;
+    size_t i = hash_str(name) & mask;
+    while (set->slots[i].name && set->slots[i].name != TOMBSTONE) i = (i + 1) & mask;
+    if (!set->slots[i].name) set->used++;
+    e = &set->slots[i];
+    e->name = strdup(name);
+    e->hash = 0;
+    set->count++;
+    return e;
+}
+
+void user_set_remove(UserSet *set, const char *name) {
+    UserSetEntry *e = user_set_find(set, name);
+    if (!e) return;
+    free(e->name);
+    e->name = TOMBSTONE;
+    set->count--;
+}
+
+#define user_set_foreach(set, e) \
+    for (UserSetEntry *e = (set)->slots; e < (set)->slots + (set)->cap; e++) \
+        if (e->name && e->name != TOMBSTONE)
+
+// Список имён, накопленных для применения изменений
+typedef struct {
+    char **items;
+    size_t count;
+    size_t cap;
+} NameList;
+
+void name_list_push(NameList *list, const char *name) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, list->cap * sizeof(char *));
+        if (!list->items) { perror("realloc"); exit(1); }
     }
+    list->items[list->count++] = strdup(name);
+}
 
-    struct passwd *pw;
-    setpwent();
-    while ((pw = getpwent()) != NULL) {
-        // Создаём VFS только для пользователей с shell, заканчивающимся на 'sh'
-        if (pw->pw_shell && strlen(pw->pw_shell) >= 2 && 
-            pw->pw_shell[strlen(pw->pw_shell)-2] == 's' && 
-            pw->pw_shell[strlen(pw->pw_shell)-1] == 'h') {
-        create_user_vfs_entry(pw);
-        }
+void name_list_free(NameList *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->items[i]);
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+UserSet vfs_snapshot;       // каталоги пользователей в VFS
+struct timespec vfs_stamp;  // mtime корня VFS на момент снимка
+int vfs_snapshot_valid = 0;
+
+// --- Индекс пользователей ---
+// /etc/passwd отображается в память (MAP_PRIVATE) и разбирается один раз:
+// разделители ':' и '\n' заменяются на '\0', записи ссылаются прямо в отображение.
+// Поиск по имени и UID — через хеш-таблицы. Файл перечитывается только при
+// смене inode, mtime или размера; разница со старым индексом копится в
+// pending_users_*, её применяет sync_vfs_with_system().
+
+typedef struct {
+    const char *name;
+    const char *gecos;
+    const char *dir;
+    const char *shell;
+    uid_t uid;
+    gid_t gid;
+    int sh;              // shell заканчивается на "sh"
+} UserRecord;
+
+typedef struct {
+    char *map;
+    size_t map_len;
+    char *heap;          // копия файла, если отображение не подошло
+    UserRecord *users;
+    size_t count;
+    uint32_t *by_name;   // номер записи + 1, 0 — пусто
+    uint32_t *by_uid;
+    size_t buckets;      // степень двойки
+} UserIndex;
+
+UserIndex user_index;
+struct stat user_index_stamp;
+int user_index_valid = 0;
+unsigned user_index_generation = 0;   // растёт при каждом перечитывании индекса
+
+NameList pending_users_added;
+NameList pending_users_removed;
+NameList pending_users_changed;
+
+static size_t uid_bucket(uid_t uid, size_t mask) {
+    return ((size_t)uid * 2654435761u) & mask;
+}
+
+const UserRecord *user_index_find(const UserIndex *idx, const char *name) {
+    if (!idx->buckets) return NULL;
+    size_t mask = idx->buckets - 1;
+    for (size_t i = hash_str(name) & mask; idx->by_name[i]; i = (i + 1) & mask) {
+        const UserRecord *u = &idx->users[idx->by_name[i] - 1];
+        if (strcmp(u->name, name) == 0) return u;
     }
-    endpwent();
+    return NULL;
+}
+
+const UserRecord *user_index_by_name(const char *name) {
+    return user_index_find(&user_index, name);
+}
 
-    // system_stats
-    char stats_path[512];
-    snprintf(stats_path, sizeof(stats_path), "%s/system_stats", users_dir);
-    FILE *f = fopen(stats_path, "w");
-    if (f) {
-        fprintf(f, "VFS создан: %s\n", users_dir);
-        fprintf(f, "Владелец: %s\n", getenv("USER") ?: "unknown");
-        time_t t = time(NULL);
-        fprintf(f, "Время создания: %s", ctime(&t));
-        fclose(f);
+// Если у UID несколько записей, возвращается первая в файле
+const UserRecord *user_index_by_uid(uid_t uid) {
+    if (!user_index.buckets) return NULL;
+    size_t mask = user_index.buckets - 1;
+    for (size_t i = uid_bucket(uid, mask); user_index.by_uid[i]; i = (i + 1) & mask) {
+        const UserRecord *u = &user_index.users[user_index.by_uid[i] - 1];
+        if (u->uid == uid) return u;
     }
+    return NULL;
+}
 
-    printf("VFS создан в %s\n", users_dir);
+void user_index_free(UserIndex *idx) {
+    if (idx->map) munmap(idx->map, idx->map_len);
+    free(idx->heap);
+    free(idx->users);
+    free(idx->by_name);
+    free(idx->by_uid);
+    memset(idx, 0, sizeof(*idx));
 }
 
-// 🔁 Синхронизация VFS с системой
-void sync_vfs_with_system() {
-    char *users_dir = get_users_dir_path();
-    DIR *dir = opendir(users_dir);
-    if (!dir) {
-        create_users_vfs();
-        return;
+static int shell_is_sh(const char *shell, size_t len) {
+    return len >= 2 && shell[len-2] == 's' && shell[len-1] == 'h';
+}
+
+// Разбор строк вида name:passwd:uid:gid:gecos:dir:shell
+int user_index_parse(UserIndex *idx, int fd, size_t size) {
+    if (size == 0) return 0;
+    idx->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (idx->map == MAP_FAILED) { idx->map = NULL; return -1; }
+    idx->map_len = size;
+
+    // Хвост последней страницы за концом файла заполнен нулями, так что последняя
+    // строка без '\n' всё равно оканчивается '\0'. Если файл занимает страницы
+    // ровно, такого хвоста нет — читаем его в обычный буфер.
+    if (idx->map[size - 1] != '\n' && size % (size_t)sysconf(_SC_PAGESIZE) == 0) {
+        munmap(idx->map, size);
+        idx->map = NULL;
+        idx->heap = malloc(size + 1);
+        if (!idx->heap || pread(fd, idx->heap, size, 0) != (ssize_t)size) return -1;
+        idx->heap[size] = '\0';
     }
+    char *data = idx->map ? idx->map : idx->heap;
 
-    // Сбор имён подкаталогов в VFS
-    char vfs_dirs[200][MAX_USERNAME_SIZE];
-    int vfs_count = 0;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        char full_path[1024];
-        struct stat st;
-        snprintf(full_path, sizeof(full_path), "%s/%s", users_dir, entry->d_name);
-        if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode)) {
-            if (strcmp(entry->d_name, ".") != 0 &&
-                strcmp(entry->d_name, "..") != 0) {
-                strncpy(vfs_dirs[vfs_count], entry->d_name, MAX_USERNAME_SIZE - 1);
-                vfs_dirs[vfs_count][MAX_USERNAME_SIZE - 1] = '\0';
-                vfs_count++;
-            }
+    size_t lines = 1;
+    for (char *p = data; (p = memchr(p, '\n', size - (p - data))) != NULL; p++) lines++;
+    idx->users = malloc(lines * sizeof(UserRecord));
+    if (!idx->users) return -1;
+
+    char *p = data, *end = data + size;
+    while (p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        char *field[7];
+        size_t nfields = 0;
+        char *f = p;
+        while (nfields < 7) {
+            char *sep = nfields < 6 ? memchr(f, ':', eol - f) : NULL;
+            field[nfields++] = f;
+            if (!sep) break;
+            *sep = '\0';
+            f = sep + 1;
         }
-    }
-    closedir(dir);
+        size_t shell_len = eol - field[nfields - 1];
+        *eol = '\0';
 
-    // 1. Если каталог есть, но пользователя нет — создаём (ТОЛЬКО под root)
-    if (geteuid() == 0) {
-        for (int i = 0; i < vfs_count; i++) {
-            if (getpwnam(vfs_dirs[i]) == NULL) {
-                char cmd[512];
-                snprintf(cmd, sizeof(cmd), "useradd -m -s /bin/bash %s", vfs_dirs[i]);
-                int res = system(cmd);
-                if (res == 0 || (WIFEXITED(res) && WEXITSTATUS(res) == 0)) {
-                    setpwent();
-                    struct passwd *pw = getpwnam(vfs_dirs[i]);
-                    endpwent();
-                    if (pw) {
-                        create_user_vfs_entry(pw);
-                    }
-                }
-            }
+        if (nfields == 7 && *p && *p != '#' && *p != '+' && *p != '-') {
+            UserRecord *u = &idx->users[idx->count++];
+            u->name = field[0];
+            u->uid = (uid_t)strtoul(field[2], NULL, 10);
+            u->gid = (gid_t)strtoul(field[3], NULL, 10);
+            u->gecos = field[4];
+            u->dir = field[5];
+            u->shell = field[6];
+            u->sh = shell_is_sh(field[6], shell_len);
         }
+        p = eol + 1;
+    }
 
-        // 2. Если пользователь есть (UID>=1000), но каталога нет — удаляем пользователя
-        // Удаляем только обычных пользователей с shell на *sh, root и системные аккаунты не трогаем.
-        struct passwd *pw;
-        char *vfs_root = get_users_dir_path();
-        setpwent();
-        while ((pw = getpwent()) != NULL) {
-            if (pw->pw_uid < 1000) continue; // не трогаем root и системных
-            if (!(pw->pw_shell && strlen(pw->pw_shell) >= 2 &&
-                  pw->pw_shell[strlen(pw->pw_shell)-2] == 's' &&
-                  pw->pw_shell[strlen(pw->pw_shell)-1] == 'h')) {
-                continue;
-            }
+    idx->buckets = 16;
+    while (idx->buckets < idx->count * 2) idx->buckets *= 2;
+    idx->by_name = calloc(idx->buckets, sizeof(uint32_t));
+    idx->by_uid = calloc(idx->buckets, sizeof(uint32_t));
+    if (!idx->by_name || !idx->by_uid) return -1;
 
-            char user_dir[512];
-            snprintf(user_dir, sizeof(user_dir), "%s/%s", vfs_root, pw->pw_name);
-            if (access(user_dir, F_OK) != 0) {
-                char cmd[512];
-                snprintf(cmd, sizeof(cmd), "userdel -r %s", pw->pw_name);
-                system(cmd);
-            }
+    size_t mask = idx->buckets - 1;
+    for (size_t n = 0; n < idx->count; n++) {
+        const UserRecord *u = &idx->users[n];
+        size_t i = hash_str(u->name) & mask;
+        while (idx->by_name[i]) {
+            // Дубликат имени: как и getpwnam(), оставляем первую запись
+            if (strcmp(idx->users[idx->by_name[i] - 1].name, u->name) == 0) break;
+            i = (i + 1) & mask;
         }
-        endpwent();
+        if (!idx->by_name[i]) idx->by_name[i] = n + 1;
+
+        i = uid_bucket(u->uid, mask);
+        while (idx->by_uid[i]) i = (i + 1) & mask;
+        idx->by_uid[i] = n + 1;
     }
+    return 0;
 }
 
-// Команда: обновить VFS (с синхронизацией)
-void cmd_refresh_vfs() {
-    printf("Синхронизация VFS с системой...\n");
-    sync_vfs_with_system();
-    printf("VFS обновлён\n");
+static int user_record_differs(const UserRecord *a, const UserRecord *b) {
+    return a->uid != b->uid || a->gid != b->gid ||
+           strcmp(a->gecos, b->gecos) != 0 || strcmp(a->dir, b->dir) != 0 ||
+           strcmp(a->shell, b->shell) != 0;
 }
 
-// Команда: показать VFS
-void cmd_show_vfs() {
-    char *users_dir = get_users_dir_path();
-    printf("Структура VFS в %s:\n", users_dir);
-    printf("==========================================\n");
-
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "which tree >/dev/null 2>&1 && tree -L 2 %s || (echo 'Дерево:' && find %s -type f | sort | head -30)", users_dir, users_dir);
-    system(cmd);
+// Не изменился ли файл: inode, размер и mtime совпадают
+int passwd_stamp_equal(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
 }
 
-// Команда: разделы диска
-void cmd_list_partitions(const char *device) {
-    if (!device) {
-        device = "";
+// Перечитывание /etc/passwd (passwd_file), только если файл изменился.
+// Возвращает 1, если индекс обновлён.
+int user_index_refresh() {
+    struct stat st;
+    int fd = k_open(config.passwd_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || k_fstat(fd, &st) == -1) {
+        if (fd != -1) close(fd);
+        return 0;
+    }
+    if (user_index_valid && passwd_stamp_equal(&st, &user_index_stamp)) {
+        close(fd);
+        return 0;
     }
 
-    // Пропускаем начальные пробелы
-    while (*device == ' ') device++;
+    UserIndex fresh = {0};
+    int rc = user_index_parse(&fresh, fd, (size_t)st.st_size);
+    close(fd);
+    if (rc == -1) {
+        fprintf(stderr, "Ошибка чтения %s: %s\n", config.passwd_file, strerror(errno));
+        user_index_free(&fresh);
+        return 0;
+    }
 
-    if (strlen(device) == 0) {
-        printf("Использование: \\l <устройство> (например, \\l /dev/sda)\n");
-        printf("Доступные устройства:\n");
-        system("lsblk -o NAME,SIZE,TYPE,MOUNTPOINT 2>/dev/null | grep -E '^(sd|hd|vd|nvme|mmcblk)' | head -10");
-        return;
+    for (size_t n = 0; n < fresh.count; n++) {
+        const UserRecord *u = &fresh.users[n];
+        if (user_index_find(&fresh, u->name) != u) continue;
+        const UserRecord *old = user_index_find(&user_index, u->name);
+        if (!old) name_list_push(&pending_users_added, u->name);
+        else if (user_record_differs(old, u)) name_list_push(&pending_users_changed, u->name);
+    }
+    for (size_t n = 0; n < user_index.count; n++) {
+        const UserRecord *old = &user_index.users[n];
+        if (user_index_find(&user_index, old->name) != old) continue;
+        if (!user_index_find(&fresh, old->name)) name_list_push(&pending_users_removed, old->name);
     }
 
-    // Разрешаем ввод без /dev/, например: \l sda
-    char dev_path[256];
-    if (strchr(device, '/')) {
-        snprintf(dev_path, sizeof(dev_path), "%s", device);
-    } else {
-        snprintf(dev_path, sizeof(dev_path), "/dev/%s", device);
+    user_index_free(&user_index);
+    user_index = fresh;
+    user_index_stamp = st;
+    user_index_valid = 1;
+    user_index_generation++;
+    return 1;
+}
+
+
+// --- Выполнение внешних команд ---
+// Строка разбирается на слова без /bin/sh и запускается через posix_spawn()
+// (в glibc это clone с CLONE_VFORK). Пути из $PATH кэшируются, как `hash` в bash:
+// кэш сбрасывается, когда меняется значение PATH.
+
+extern char **environ;
+
+int last_status = 0;     // код завершения последней команды, как $? в sh
+int command_mutated_users = 0;   // последняя команда могла изменить пользователей
+
+typedef struct {
+    char **argv;         // завершается NULL
+    int argc;
+    int cap;
+} Argv;
+
+void argv_push(Argv *a, const char *word, size_t len) {
+    if (a->argc + 2 > a->cap) {
+        a->cap = a->cap ? a->cap * 2 : 8;
+        a->argv = realloc(a->argv, a->cap * sizeof(char *));
+        if (!a->argv) { perror("realloc"); exit(1); }
     }
+    a->argv[a->argc] = strndup(word, len);
+    a->argv[++a->argc] = NULL;
+}
 
-    struct stat st;
-    if (stat(dev_path, &st) == -1) {
-        printf("Ошибка: устройство %s не найдено\n", dev_path);
-        return;
+void argv_free(Argv *a) {
+    for (int i = 0; i < a->argc; i++) free(a->argv[i]);
+    free(a->argv);
+    memset(a, 0, sizeof(*a));
+}
+
+// Слова через пробел одной строкой (free() на стороне вызывающего)
+char *argv_join(int argc, char **argv) {
+    size_t len = 1;
+    for (int i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+    char *line = malloc(len);
+    if (!line) { perror("malloc"); exit(1); }
+    char *p = line;
+    for (int i = 0; i < argc; i++) {
+        if (i) *p++ = ' ';
+        p = stpcpy(p, argv[i]);
     }
+    *p = '\0';
+    return line;
+}
 
-    printf("Информация о %s:\n", dev_path);
-    printf("==========================================\n");
+// Перенаправления стадии конвейера
+#define REDIR_IN 0           // [n]< файл
+#define REDIR_OUT 1          // [n]> файл
+#define REDIR_APPEND 2       // [n]>> файл
+#define REDIR_DUP 3          // [n]>&m, [n]<&m, [n]>&-
+#define REDIR_HERESTRING 4   // [n]<<< слово
+
+typedef struct {
+    int kind;
+    int fd;              // перенаправляемый дескриптор
+    char *target;        // файл, текст here-string или номер дескриптора
+} Redirect;
+
+typedef struct {
+    Argv args;
+    Redirect *redirs;
+    int nredirs;
+} Stage;
+
+typedef struct {
+    Stage *stages;
+    int nstages;
+} Pipeline;
 
-    char cmd[512];
-    // Информация без sudo
-    snprintf(cmd, sizeof(cmd), "fdisk -l %s 2>/dev/null | head -20", dev_path);
-    system(cmd);
-    printf("\n--- lsblk ---\n");
-    snprintf(cmd, sizeof(cmd), "lsblk %s -o NAME,SIZE,TYPE,MOUNTPOINT,FSTYPE 2>/dev/null", dev_path);
-    system(cmd);
-    printf("\n--- df ---\n");
-    snprintf(cmd, sizeof(cmd), "df -h | grep '%s' 2>/dev/null || echo 'Нет примонтированных разделов'", dev_path);
-    system(cmd);
+static Stage *pipeline_add_stage(Pipeline *pl) {
+    Stage *stages = realloc(pl->stages, (pl->nstages + 1) * sizeof(Stage));
+    if (!stages) { perror("realloc"); exit(1); }
+    pl->stages = stages;
+    Stage *st = &pl->stages[pl->nstages++];
+    memset(st, 0, sizeof(*st));
+    return st;
 }
 
-// История
-void load_history() {
-    char *path = get_history_path();
-    FILE *f = fopen(path, "r");
-    if (!f) return;
+static Redirect *stage_add_redirect(Stage *st, int kind, int fd) {
+    Redirect *redirs = realloc(st->redirs, (st->nredirs + 1) * sizeof(Redirect));
+    if (!redirs) { perror("realloc"); exit(1); }
+    st->redirs = redirs;
+    Redirect *r = &st->redirs[st->nredirs++];
+    r->kind = kind;
+    r->fd = fd;
+    r->target = NULL;
+    return r;
+}
 
-    char line[MAX_INPUT_SIZE];
-    while (history_count < MAX_HISTORY_SIZE && fgets(line, sizeof(line), f)) {
-        line[strcspn(line, "\n")] = 0;
-        if (strlen(line) == 0) continue;
-        history[history_count] = strdup(line);
-        history_count++;
+void pipeline_free(Pipeline *pl) {
+    for (int i = 0; i < pl->nstages; i++) {
+        argv_free(&pl->stages[i].args);
+        for (int j = 0; j < pl->stages[i].nredirs; j++) free(pl->stages[i].redirs[j].target);
+        free(pl->stages[i].redirs);
     }
-    fclose(f);
+    free(pl->stages);
+    memset(pl, 0, sizeof(*pl));
 }
 
-void save_history() {
-    char *path = get_history_path();
-    FILE *f = fopen(path, "w");
-    if (!f) return;
-    for (int i = 0; i < history_count; i++) {
-        fprintf(f, "%s\n", history[i]);
+// Есть ли в строке что-то кроме одной простой команды
+int pipeline_is_compound(const Pipeline *pl) {
+    return pl->nstages > 1 || (pl->nstages == 1 && pl->stages[0].nredirs > 0);
+}
+
+// Первое слово вида NAME= — присваивание переменной
+static int is_assignment_name(const char *word, size_t len) {
+    if (len == 0 || (word[0] >= '0' && word[0] <= '9')) return 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = word[i];
+        if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+            return 0;
     }
-    fclose(f);
+    return 1;
 }
 
-void add_to_history(const char *cmd) {
-    if (strlen(cmd) == 0 || strcmp(cmd, "\\q") == 0) return;
-    if (history_count >= MAX_HISTORY_SIZE) {
-        free(history[0]);
-        for (int i = 1; i < history_count; i++) history[i-1] = history[i];
-        history_count--;
+#define TOK_OK 0
+#define TOK_UNTERMINATED -1
+#define TOK_SYNTAX -2
+#define TOK_NEEDS_SHELL 1
+
+// Разбор строки в конвейер: слова с кавычками '...' и "...", экранированием '\'
+// и ~ в начале, стадии через |, перенаправления <, >, >>, n>&m, <<<.
+// Возвращает TOK_NEEDS_SHELL, если строке нужен настоящий shell:
+// подстановки $ и `, шаблоны, ;, &, ||, here-doc, присваивания VAR=...
+int parse_pipeline(const char *line, Pipeline *pl) {
+    size_t cap = strlen(line) + 1;
+    char *word = malloc(cap + PATH_MAX);
+    if (!word) { perror("malloc"); exit(1); }
+    const char *p = line;
+    int rc = TOK_OK;
+    Stage *cur = pipeline_add_stage(pl);
+    Redirect *pending = NULL;    // перенаправление, ждущее имя файла
+
+    while (rc == TOK_OK) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p || *p == '#') break;
+
+        // Номер дескриптора перед < или >
+        const char *q = p;
+        while (*q >= '0' && *q <= '9') q++;
+        int fd = -1;
+        if (q > p && q - p < 4 && (*q == '<' || *q == '>')) {
+            fd = atoi(p);
+            p = q;
+        }
+
+        if (*p == '|') {
+            if (p[1] == '|') { rc = TOK_NEEDS_SHELL; break; }
+            if (pending || (cur->args.argc == 0 && cur->nredirs == 0)) { rc = TOK_SYNTAX; break; }
+            cur = pipeline_add_stage(pl);
+            p++;
+            continue;
+        }
+        if (*p == '<' || *p == '>') {
+            if (pending) { rc = TOK_SYNTAX; break; }
+            int kind, def_fd = *p == '<' ? 0 : 1;
+            if (strncmp(p, "<<<", 3) == 0) { kind = REDIR_HERESTRING; p += 3; }
+            else if (strncmp(p, "<<", 2) == 0 || strncmp(p, "<>", 2) == 0) { rc = TOK_NEEDS_SHELL; break; }
+            else if (strncmp(p, "<&", 2) == 0 || strncmp(p, ">&", 2) == 0) { kind = REDIR_DUP; p += 2; }
+            else if (strncmp(p, ">>", 2) == 0) { kind = REDIR_APPEND; p += 2; }
+            else if (strncmp(p, ">|", 2) == 0) { kind = REDIR_OUT; p += 2; }
+            else { kind = *p == '<' ? REDIR_IN : REDIR_OUT; p++; }
+            pending = stage_add_redirect(cur, kind, fd == -1 ? def_fd : fd);
+            continue;
+        }
+
+        size_t len = 0;
+        int quoted = 0;
+        if (*p == '~' && (p[1] == '/' || p[1] == ' ' || p[1] == '\t' || p[1] == '|' || !p[1])) {
+            const char *home = get_home_path();
+            len = strlen(home) < PATH_MAX ? strlen(home) : 0;
+            memcpy(word, home, len);
+            p++;
+        }
+        while (*p && *p != ' ' && *p != '\t' && *p != '|' && *p != '<' && *p != '>' && rc == TOK_OK) {
+            char c = *p++;
+            if (c == '\'') {
+                const char *end = strchr(p, '\'');
+                if (!end) { rc = TOK_UNTERMINATED; break; }
+                memcpy(word + len, p, end - p);
+                len += end - p;
+                p = end + 1;
+                quoted = 1;
+            } else if (c == '"') {
+                while (*p && *p != '"') {
+                    if (*p == '$' || *p == '`') { rc = TOK_NEEDS_SHELL; break; }
+                    if (*p == '\\' && p[1] && strchr("\"\\$`", p[1])) p++;
+                    word[len++] = *p++;
+                }
+                if (rc != TOK_OK) break;
+                if (*p != '"') { rc = TOK_UNTERMINATED; break; }
+                p++;
+                quoted = 1;
+            } else if (c == '\\' && len == 0 && cur->args.argc == 0 && !pending &&
+                       ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))) {
+                // \e, \l, \history — имена встроенных команд kubsh, а не экранирование
+                word[len++] = c;
+            } else if (c == '\\') {
+                if (*p) word[len++] = *p++;
+                quoted = 1;
+            } else if (strchr("$`*?[;&(){}", c)) {
+                rc = TOK_NEEDS_SHELL;
+            } else if (c == '=' && cur->args.argc == 0 && !pending && !quoted &&
+                       is_assignment_name(word, len)) {
+                rc = TOK_NEEDS_SHELL;
+            } else {
+                word[len++] = c;
+            }
+        }
+        if (rc != TOK_OK) break;
+
+        if (pending) {
+            pending->target = strndup(word, len);
+            if (pending->kind == REDIR_DUP && strcmp(pending->target, "-") != 0 &&
+                (len == 0 || strspn(pending->target, "0123456789") != len)) {
+                rc = TOK_SYNTAX;
+            }
+            pending = NULL;
+        } else {
+            argv_push(&cur->args, word, len);
+        }
     }
-    history[history_count++] = strdup(cmd);
+    if (rc == TOK_OK && (pending || (pl->nstages > 1 && cur->args.argc == 0 && cur->nredirs == 0))) {
+        rc = TOK_SYNTAX;
+    }
+    free(word);
+    return rc;
 }
 
-void print_history() {
-    for (int i = 0; i < history_count; i++) {
-        printf("%3d: %s\n", i+1, history[i]);
+typedef struct {
+    char *name;
+    char *path;
+    unsigned hits;
+} PathCacheEntry;
+
+PathCacheEntry *path_cache;
+size_t path_cache_cap;
+size_t path_cache_count;
+char *path_cache_env;    // значение PATH, для которого заполнен кэш
+
+void path_cache_clear() {
+    for (size_t i = 0; i < path_cache_cap; i++) {
+        free(path_cache[i].name);
+        free(path_cache[i].path);
     }
+    free(path_cache);
+    path_cache = NULL;
+    path_cache_cap = path_cache_count = 0;
 }
 
-void free_history() {
-    for (int i = 0; i < history_count; i++) free(history[i]);
-    history_count = 0;
+static PathCacheEntry *path_cache_slot(const char *name) {
+    size_t mask = path_cache_cap - 1;
+    size_t i = hash_str(name) & mask;
+    while (path_cache[i].name && strcmp(path_cache[i].name, name) != 0) i = (i + 1) & mask;
+    return &path_cache[i];
 }
 
-// echo
-void cmd_echo(const char *args) {
-    if (!args || !*args) { printf("\n"); return; }
-    while (*args == ' ') args++;
-    if ((*args == '"' && args[strlen(args)-1] == '"') ||
-        (*args == '\'' && args[strlen(args)-1] == '\'')) {
-        printf("%.*s\n", (int)strlen(args)-2, args+1);
-    } else {
-        printf("%s\n", args);
+static void path_cache_put(const char *name, const char *path) {
+    if ((path_cache_count + 1) * 2 > path_cache_cap) {
+        PathCacheEntry *old = path_cache;
+        size_t old_cap = path_cache_cap;
+        path_cache_cap = old_cap ? old_cap * 2 : 64;
+        path_cache = calloc(path_cache_cap, sizeof(PathCacheEntry));
+        if (!path_cache) { perror("calloc"); exit(1); }
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].name) *path_cache_slot(old[i].name) = old[i];
+        }
+        free(old);
     }
+    PathCacheEntry *e = path_cache_slot(name);
+    if (!e->name) {
+        e->name = strdup(name);
+        path_cache_count++;
+    }
+    free(e->path);
+    e->path = strdup(path);
 }
 
-// \e — переменные окружения
-void cmd_environment(const char *args) {
-    if (!args || !*args) {
-        printf("Использование: \\e <переменная> (например, \\e PATH)\n");
-        return;
+// Забыть закэшированный путь (например, бинарник удалили или перенесли)
+void path_cache_forget(const char *name) {
+    if (!path_cache_cap) return;
+    PathCacheEntry *e = path_cache_slot(name);
+    if (!e->name) return;
+    // Перестраиваем таблицу без записи, чтобы не ломать цепочки открытой адресации
+    PathCacheEntry *old = path_cache;
+    size_t old_cap = path_cache_cap;
+    path_cache = calloc(old_cap, sizeof(PathCacheEntry));
+    if (!path_cache) { perror("calloc"); exit(1); }
+    path_cache_count = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!old[i].name) continue;
+        if (&old[i] == e) { free(old[i].name); free(old[i].path); continue; }
+        *path_cache_slot(old[i].name) = old[i];
+        path_cache_count++;
     }
-    while (*args == ' ') args++;
-    if (*args == '$') args++;
+    free(old);
+}
 
-    char var[256];
-    sscanf(args, "%255s", var);
-    char *val = getenv(var);
-    if (!val) {
-        printf("Переменная '%s' не найдена\n", var);
-        return;
+// Поиск исполняемого файла в $PATH с кэшированием. NULL — не найден.
+const char *lookup_command(const char *name) {
+    if (strchr(name, '/')) return name;
+
+    const char *env = getenv("PATH");
+    if (!env) env = "/usr/local/bin:/usr/bin:/bin";
+    if (!path_cache_env || strcmp(path_cache_env, env) != 0) {
+        path_cache_clear();
+        free(path_cache_env);
+        path_cache_env = strdup(env);
     }
 
-    printf("Переменная: %s\nЗначение: %s\n", var, val);
-    // Для совместимости с тестами — выводим сырое значение отдельной строкой
-    printf("%s\n", val);
-    if (strchr(val, ':')) {
-        char *copy = strdup(val);
-        char *tok = strtok(copy, ":");
-        while (tok) {
-            printf("%s\n", tok);
-            tok = strtok(NULL, ":");
-        }
-        free(copy);
+    if (path_cache_cap) {
+        PathCacheEntry *e = path_cache_slot(name);
+        if (e->name) { e->hits++; return e->path; }
     }
-}
 
-// adduser (через команду)
-void cmd_adduser(const char *user) {
-    if (!user || !*user) { printf("Использование: adduser <username>\n"); return; }
-    if (getpwnam(user)) { printf("Пользователь %s уже существует\n", user); return; }
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "sudo useradd -m -s /bin/bash %s", user);
-    if (system(cmd) == 0) {
-        printf("Пользователь %s создан. Обновляем VFS...\n", user);
-        cmd_refresh_vfs();
-    } else {
-        printf("Ошибка создания %s\n", user);
+    char candidate[PATH_MAX];
+    for (const char *dir = env; ; ) {
+        const char *colon = strchr(dir, ':');
+        size_t dlen = colon ? (size_t)(colon - dir) : strlen(dir);
+        // Пустой элемент PATH означает текущий каталог
+        int n = dlen ? snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)dlen, dir, name)
+                     : snprintf(candidate, sizeof(candidate), "./%s", name);
+        struct stat st;
+        if (n > 0 && (size_t)n < sizeof(candidate) &&
+            k_stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            path_cache_put(name, candidate);
+            PathCacheEntry *e = path_cache_slot(name);
+            e->hits = 1;
+            return e->path;
+        }
+        if (!colon) break;
+        dir = colon + 1;
     }
+    return NULL;
 }
 
-// userdel
-void cmd_userdel(const char *user) {
-    if (!user || !*user) { printf("Использование: userdel <username>\n"); return; }
-    if (!getpwnam(user)) { printf("Пользователь %s не существует\n", user); return; }
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "sudo userdel -r %s", user);
-    if (system(cmd) == 0) {
-        printf("Пользователь %s удалён. Обновляем VFS...\n", user);
-        cmd_refresh_vfs();
-    } else {
-        printf("Ошибка удаления %s\n", user);
+// Группа процессов для spawn_command(): -1 — группа kubsh, 0 — новая группа
+// с pid процесса в качестве номера, иначе — существующая группа конвейера
+pid_t spawn_pgid = -1;
+
+// Запуск argv без ожидания; fa — перестановки дескрипторов для конвейера (или NULL).
+// Возвращает pid или -1; errno — код ошибки запуска.
+pid_t spawn_command(char *const argv[], const posix_spawn_file_actions_t *fa) {
+    const char *path = lookup_command(argv[0]);
+    if (!path) { errno = ENOENT; return -1; }
+
+    PhaseTimer t;
+    phase_begin(&t);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    // SIGCHLD у kubsh заблокирован ради signalfd — потомкам маска нужна пустая
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (spawn_pgid != -1) {
+        posix_spawnattr_setpgroup(&attr, spawn_pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
     }
-}
+    posix_spawnattr_setflags(&attr, flags);
 
-// listusers — из VFS
-void cmd_listusers() {
-    char *users_dir = get_users_dir_path();
-    DIR *dir = opendir(users_dir);
-    if (!dir) {
-        printf("VFS не найден. Создаём...\n");
-        create_users_vfs();
-        dir = opendir(users_dir);
-        if (!dir) { printf("Ошибка VFS\n"); return; }
+    pid_t pid;
+    int err = posix_spawn(&pid, path, fa, &attr, argv, environ);
+    if (err == ENOENT && path != argv[0]) {
+        // Закэшированный путь устарел — ищем заново
+        path_cache_forget(argv[0]);
+        path = lookup_command(argv[0]);
+        err = path ? posix_spawn(&pid, path, fa, &attr, argv, environ) : ENOENT;
+    }
+    if (err == ENOEXEC) {
+        // Скрипт без #! — как и execvp(), отдаём его /bin/sh
+        int argc = 0;
+        while (argv[argc]) argc++;
+        char **sh_argv = malloc((argc + 2) * sizeof(char *));
+        if (!sh_argv) { perror("malloc"); exit(1); }
+        sh_argv[0] = "sh";
+        sh_argv[1] = (char *)path;
+        for (int i = 1; i <= argc; i++) sh_argv[i + 1] = argv[i];
+        err = posix_spawn(&pid, "/bin/sh", fa, &attr, sh_argv, environ);
+        free(sh_argv);
     }
+    posix_spawnattr_destroy(&attr);
+    phase_end(PH_SPAWN, &t);
+    if (err) { errno = err; return -1; }
+    count_event(CNT_CHILD);
+    return pid;
+}
 
-    printf("%-15s %-8s %-20s %s\n", "Username", "UID", "Home", "Shell");
-    printf("------------------------------------------------------------\n");
+// --- Управление заданиями ---
+// "команда &" запускается в собственной группе процессов и получает номер [N] из
+// того же ряда, что и задания пула потоков. SIGCHLD заблокирован и читается через
+// signalfd: главный цикл ждёт его в select() вместе с вводом и inotify и сразу
+// сообщает о завершении. На терминале (job_control) и обычные команды идут в своей
+// группе, которой передаётся терминал: Ctrl-Z останавливает только их, а kubsh
+// превращает их в остановленное задание для fg и bg.
 
-    struct dirent *entry;
-    while ((entry = readdir(dir))) {
-        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
-            char path[512];
-            snprintf(path, sizeof(path), "%s/%s", users_dir, entry->d_name);
+typedef struct ShellJob {
+    int id;
+    pid_t pgid;
+    int npids;
+    pid_t *pids;              // -1 — стадия завершилась или не запускалась
+    int *statuses;
+    int signal;               // сигнал, завершивший последнюю стадию
+    int stopped;
+    int has_tmodes;
+    struct termios tmodes;    // режим терминала, в котором задание остановилось
+    char *cmd;
+    struct ShellJob *next;
+} ShellJob;
 
-            char id[64] = "??", home[256] = "??", shell[256] = "??";
+ShellJob *shell_jobs;         // по возрастанию номера
+int job_control = 0;
+pid_t shell_pgid = 0;
+struct termios shell_tmodes;
+int sigchld_fd = -1;
+int job_next_id = 1;          // общий ряд номеров с пулом потоков (главный поток)
+int daemon_client_fd = -1;    // сокет клиента, чей сценарий выполняет сервер (kubsh --daemon)
+int daemon_client_gone = 0;   // клиент отключился: его конвейер убит, остаток сценария бросаем
 
-            char id_path[512]; snprintf(id_path, sizeof(id_path), "%s/id", path);
-            FILE *f = fopen(id_path, "r");
-            if (f) { fgets(id, sizeof(id), f); fclose(f); }
+static ShellJob *shell_job_new(const pid_t *pids, const int *statuses, int n, pid_t pgid, const char *cmd) {
+    ShellJob *j = calloc(1, sizeof(ShellJob));
+    if (!j) { perror("calloc"); exit(1); }
+    j->pgid = pgid;
+    j->npids = n;
+    j->pids = malloc(n * sizeof(pid_t));
+    j->statuses = malloc(n * sizeof(int));
+    j->cmd = strdup(cmd);
+    if (!j->pids || !j->statuses || !j->cmd) { perror("malloc"); exit(1); }
+    memcpy(j->pids, pids, n * sizeof(pid_t));
+    memcpy(j->statuses, statuses, n * sizeof(int));
+    return j;
+}
 
-            char home_path[512]; snprintf(home_path, sizeof(home_path), "%s/home", path);
-            f = fopen(home_path, "r");
-            if (f) { fgets(home, sizeof(home), f); fclose(f); }
-            home[strcspn(home, "\n")] = 0;
+static void shell_job_free(ShellJob *j) {
+    free(j->pids);
+    free(j->statuses);
+    free(j->cmd);
+    free(j);
+}
 
-            char shell_path[512]; snprintf(shell_path, sizeof(shell_path), "%s/shell", path);
-            f = fopen(shell_path, "r");
-            if (f) { fgets(shell, sizeof(shell), f); fclose(f); }
-            shell[strcspn(shell, "\n")] = 0;
+static void shell_job_add(ShellJob *j) {
+    j->id = job_next_id++;
+    ShellJob **p = &shell_jobs;
+    while (*p) p = &(*p)->next;
+    *p = j;
+}
 
-            printf("%-15s %-8s %-20s %s\n", entry->d_name, id, home, shell);
+static void shell_job_remove(ShellJob *j) {
+    for (ShellJob **p = &shell_jobs; *p; p = &(*p)->next) {
+        if (*p == j) {
+            *p = j->next;
+            break;
         }
     }
-    closedir(dir);
 }
 
-// help
-void cmd_help() {
-    printf("Команды:\n"
-           "  \\q         — выход\n"
-           "  \\history   — история\n"
-           "  \\e <var>   — переменная окружения\n"
-           "  \\l <диск>  — разделы диска\n"
-           "  \\vfs       — структура VFS\n"
-           "  \\refresh   — синхронизация VFS\n"
-           "  echo ...    — вывод\n"
-           "  adduser ... — создать пользователя\n"
-           "  userdel ... — удалить пользователя\n"
-           "  listusers   — список из VFS\n"
-           "  help        — эта справка\n"
-           "VFS: %s\n", get_users_dir_path());
+static void shell_job_report(const ShellJob *j) {
+    int status = j->statuses[j->npids - 1];
+    if (j->signal) printf("[%d] %s: %s\n", j->id, strsignal(j->signal), j->cmd);
+    else if (status == 0) printf("[%d] Готово: %s\n", j->id, j->cmd);
+    else printf("[%d] Код %d: %s\n", j->id, status, j->cmd);
 }
 
-// Обработка команд
-void process_command(const char *input) {
-    if (strncmp(input, "echo ", 5) == 0) {
-        cmd_echo(input + 5);
-    } else if (strncmp(input, "debug ", 6) == 0) {
-        const char *msg = input + 6;
-        while (*msg == ' ') msg++; // Пропускаем пробелы
-        size_t len = strlen(msg);
-        if (len >= 2 && ((msg[0] == '\'' && msg[len-1] == '\'') || (msg[0] == '"' && msg[len-1] == '"'))) {
-            // Убираем кавычки и выводим значение на отдельной строке
-            printf("\n%.*s\n", (int)(len-2), msg+1);
-        } else {
-            printf("\n%s\n", msg);
-        }
-    } else if (strncmp(input, "adduser ", 8) == 0) {
-        cmd_adduser(input + 8);
-    } else if (strncmp(input, "userdel ", 8) == 0) {
-        cmd_userdel(input + 8);
-    } else if (strcmp(input, "listusers") == 0) {
-        cmd_listusers();
-    } else if (strcmp(input, "help") == 0) {
-        cmd_help();
-    } else if (strcmp(input, "\\history") == 0) {
-        print_history();
-    } else if (strncmp(input, "\\e", 2) == 0) {
-        cmd_environment(input + 2);
-    } else if (strncmp(input, "\\l", 2) == 0) {
-        cmd_list_partitions(input + 2);
-    } else if (strcmp(input, "\\vfs") == 0) {
-        cmd_show_vfs();
-    } else if (strcmp(input, "\\refresh") == 0) {
-        cmd_refresh_vfs();
-    } else {
-        // Выполнение бинарника из $PATH через system (использует shell → ищет в PATH)
-        int result = system(input);
-        if (result != 0) {
-            printf("%s: command not found\n", input);
-        }
+// Код завершения в стиле sh. О гибели от сигнала сообщается один раз на конвейер
+// (*reported); SIGINT и SIGPIPE — обычное завершение, без сообщения.
+static int exit_code(int status, int *reported) {
+    if (!WIFSIGNALED(status)) return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    int sig = WTERMSIG(status);
+    if (!*reported && sig != SIGINT && sig != SIGPIPE) {
+        printf("%s%s\n", strsignal(sig), WCOREDUMP(status) ? " (core dumped)" : "");
+        *reported = 1;
+    } else if (!*reported && sig == SIGINT) {
+        printf("\n");
+        *reported = 1;
     }
+    return 128 + sig;
 }
 
-// Главная функция
-int main() {
-    signal(SIGHUP, sighup_handler);
+// Завершение процесса i задания без сообщения о сигнале
+static void shell_job_exited(ShellJob *j, int i, int status) {
+    int quiet = 1;
+    j->statuses[i] = exit_code(status, &quiet);
+    if (i == j->npids - 1) j->signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    j->pids[i] = -1;
+}
+
+// Ожидание процессов конвейера. Пока команды работают, Ctrl-C и Ctrl-\ достаются
+// только им, как при system(). Возвращает код завершения последнего процесса в стиле sh;
+// pid -1 означает стадию, которую не удалось запустить (её код уже в statuses).
+int wait_pipeline(const pid_t *pids, int *statuses, int n) {
+    struct sigaction ign = { .sa_handler = SIG_IGN }, old_int, old_quit;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGINT, &ign, &old_int);
+    sigaction(SIGQUIT, &ign, &old_quit);
+
+    int reported = 0;
+    for (int i = 0; i < n; i++) {
+        if (pids[i] == -1) continue;
+        int status = 0;
+        while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR) {}
+        statuses[i] = exit_code(status, &reported);
+    }
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGQUIT, &old_quit, NULL);
+    return n > 0 ? statuses[n - 1] : 0;
+}
+
+// SIGCHLD читается из signalfd; дочерние процессы получают обычную маску в spawn_command()
+void sigchld_init() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    sigchld_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+void sigchld_drain() {
+    struct signalfd_siginfo si;
+    while (read(sigchld_fd, &si, sizeof(si)) == sizeof(si)) {}
+}
+
+// Ожидание конвейера из сценария клиента сервера. Его процессы не в группе терминала
+// клиента, и Ctrl-C до них не доходит: вместе с SIGCHLD следим за сокетом клиента и,
+// если тот завершился, убиваем группу конвейера, чтобы он не держал сервер.
+static int wait_pipeline_client(const pid_t *pids, int *statuses, int n, pid_t pgid) {
+    pid_t *live = malloc(n * sizeof(pid_t));
+    if (!live) { perror("malloc"); exit(1); }
+    memcpy(live, pids, n * sizeof(pid_t));
+    int left = 0, reported = 0;
+    for (int i = 0; i < n; i++) left += live[i] != -1;
+
+    while (left > 0) {
+        struct pollfd pfd[2] = {
+            { daemon_client_gone ? -1 : daemon_client_fd, POLLRDHUP, 0 },
+            { sigchld_fd, POLLIN, 0 },
+        };
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfd[1].revents & POLLIN) sigchld_drain();
+        for (int i = 0; i < n; i++) {
+            if (live[i] == -1) continue;
+            int status;
+            pid_t r = waitpid(live[i], &status, WNOHANG);
+            if (r == 0 || (r == -1 && errno == EINTR)) continue;
+            statuses[i] = r == -1 ? 1 : exit_code(status, &reported);
+            live[i] = -1;
+            left--;
+        }
+        if (left > 0 && (pfd[0].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+            daemon_client_gone = 1;
+            reported = 1;      // сообщать о SIGKILL уже некому
+            kill(-pgid, SIGKILL);
+        }
+    }
+    // poll() не работает — дожидаемся оставшихся как обычно
+    for (int i = 0; i < n; i++) {
+        if (live[i] == -1) continue;
+        int status = 0;
+        while (waitpid(live[i], &status, 0) == -1 && errno == EINTR) {}
+        statuses[i] = exit_code(status, &reported);
+    }
+    free(live);
+    return n > 0 ? statuses[n - 1] : 0;
+}
+
+// Задание на переднем плане: терминал у его группы, пока оно не завершится или не
+// остановится. cont — продолжить остановленное (fg). Остановившееся задание
+// попадает в список; возвращает код завершения (128 + SIGTSTP при остановке).
+int job_foreground(ShellJob *j, int cont) {
+    struct sigaction ign = { .sa_handler = SIG_IGN }, old_int, old_quit;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGINT, &ign, &old_int);
+    sigaction(SIGQUIT, &ign, &old_quit);
+    if (job_control) {
+        if (j->has_tmodes) tcsetattr(STDIN_FILENO, TCSADRAIN, &j->tmodes);
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+    }
+    // Процесс мог успеть остановиться на чтении терминала, пока тот был у kubsh
+    if (cont || job_control) kill(-j->pgid, SIGCONT);
+
+    j->stopped = 0;
+    int reported = 0;
+    for (int i = 0; i < j->npids && !j->stopped; i++) {
+        while (j->pids[i] != -1) {
+            int status;
+            if (waitpid(j->pids[i], &status, WUNTRACED) == -1) {
+                if (errno == EINTR) continue;
+                j->pids[i] = -1;
+                break;
+            }
+            if (WIFSTOPPED(status)) {
+                int sig = WSTOPSIG(status);
+                if (job_control && (sig == SIGTTIN || sig == SIGTTOU)) {
+                    kill(-j->pgid, SIGCONT);
+                    continue;
+                }
+                j->stopped = 1;
+                break;
+            }
+            j->statuses[i] = exit_code(status, &reported);
+            j->pids[i] = -1;
+        }
+    }
+
+    if (job_control) {
+        if (j->stopped) j->has_tmodes = tcgetattr(STDIN_FILENO, &j->tmodes) == 0;
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGQUIT, &old_quit, NULL);
+    if (!j->stopped) return j->statuses[j->npids - 1];
+    if (!j->id) shell_job_add(j);
+    printf("\n[%d] Остановлено: %s\n", j->id, j->cmd);
+    return 128 + SIGTSTP;
+}
+
+// Запущенные процессы строки: в фоне — новое задание, иначе ожидание.
+// pgid — их группа (0 — своей группы нет). Возвращает код завершения.
+int job_launched(const pid_t *pids, int *statuses, int n, pid_t pgid, const char *cmd, int background) {
+    if (background && pgid) {
+        ShellJob *j = shell_job_new(pids, statuses, n, pgid, cmd);
+        shell_job_add(j);
+        if (interactive) printf("[%d] %d\n", j->id, (int)pgid);
+        return 0;
+    }
+    if (pgid && !job_control && daemon_client_fd != -1 && sigchld_fd != -1) {
+        return wait_pipeline_client(pids, statuses, n, pgid);
+    }
+    if (!pgid || !job_control) return wait_pipeline(pids, statuses, n);
+    ShellJob *j = shell_job_new(pids, statuses, n, pgid, cmd);
+    int status = job_foreground(j, 0);
+    for (int i = 0; i < n; i++) statuses[i] = j->statuses[i];
+    if (!j->stopped) shell_job_free(j);
+    return status;
+}
+
+// Подбор завершившихся и остановившихся фоновых процессов без ожидания;
+// report — сообщать о них. Возвращает число выведенных сообщений.
+int shell_jobs_reap(int report) {
+    int reported = 0;
+    for (ShellJob *j = shell_jobs, *next; j; j = next) {
+        next = j->next;
+        int was_stopped = j->stopped, alive = 0;
+        for (int i = 0; i < j->npids; i++) {
+            if (j->pids[i] == -1) continue;
+            int status;
+            pid_t r = waitpid(j->pids[i], &status, WNOHANG | WUNTRACED | WCONTINUED);
+            if (r == 0) {
+                alive = 1;
+            } else if (r == -1) {
+                // Уже подобран (wait, fg) — считаем завершившимся
+                if (errno == EINTR) alive = 1;
+                else j->pids[i] = -1;
+            } else if (WIFSTOPPED(status)) {
+                j->stopped = 1;
+                alive = 1;
+            } else if (WIFCONTINUED(status)) {
+                j->stopped = 0;
+                alive = 1;
+            } else {
+                shell_job_exited(j, i, status);
+            }
+        }
+        if (!alive) {
+            if (report) shell_job_report(j);
+            shell_job_remove(j);
+            shell_job_free(j);
+            reported += report;
+        } else if (j->stopped && !was_stopped && report) {
+            printf("[%d] Остановлено: %s\n", j->id, j->cmd);
+            reported++;
+        }
+    }
+    return reported;
+}
+
+// Управление заданиями — только когда kubsh на переднем плане своего терминала
+void job_control_init() {
+    pid_t pgrp;
+    while ((pgrp = tcgetpgrp(STDIN_FILENO)) != -1 && pgrp != getpgrp()) kill(-getpgrp(), SIGTTIN);
+    if (pgrp == -1) return;
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    if (getpgrp() != getpid()) setpgid(0, 0);
+    shell_pgid = getpgrp();
+    if (tcsetpgrp(STDIN_FILENO, shell_pgid) == -1 || tcgetattr(STDIN_FILENO, &shell_tmodes) == -1) return;
+    job_control = 1;
+}
+
+// Выход: остановленные задания иначе так и остались бы висеть
+void shell_jobs_hangup() {
+    while (shell_jobs) {
+        ShellJob *j = shell_jobs;
+        if (j->stopped) {
+            kill(-j->pgid, SIGHUP);
+            kill(-j->pgid, SIGCONT);
+        }
+        shell_jobs = j->next;
+        shell_job_free(j);
+    }
+}
+
+// Сообщение об ошибке запуска; возвращает код завершения в стиле sh
+static int report_spawn_error(const char *name, int err) {
+    if (err == ENOENT) {
+        printf("%s: command not found\n", name);
+        return 127;
+    }
+    printf("%s: %s\n", name, strerror(err));
+    return 126;
+}
+
+// Запуск argv в своей группе процессов: с ожиданием или в фоне (background).
+// line — текст задания для jobs (NULL — сами слова argv). Сообщения об ошибке
+// запуска печатаются здесь.
+int run_argv_job(char *const argv[], const char *line, int background) {
+    fflush(stdout);
+    PhaseTimer t;
+    phase_begin(&t);
+    // Команды сценария клиента сервера — в своей группе: при его отключении её убивают
+    int grouped = job_control || background || daemon_client_fd != -1;
+    posix_spawn_file_actions_t fa, *fap = NULL;
+    if (background && !job_control) {
+        // Без управления заданиями фоновая команда терминал не читает
+        posix_spawn_file_actions_init(&fa);
+        posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        fap = &fa;
+    }
+    spawn_pgid = grouped ? 0 : -1;
+    pid_t pid = spawn_command(argv, fap);
+    int err = errno;
+    spawn_pgid = -1;
+    if (fap) posix_spawn_file_actions_destroy(fap);
+    if (pid == -1) return report_spawn_error(argv[0], err);
+
+    int status = 0, argc = 0;
+    while (argv[argc]) argc++;
+    char *joined = line ? NULL : argv_join(argc, (char **)argv);
+    int rc = job_launched(&pid, &status, 1, grouped ? pid : 0, line ? line : joined, background);
+    free(joined);
+    if (!background) phase_end(PH_EXEC, &t);
+    return rc;
+}
+
+// Запуск и ожидание argv
+int run_argv(char *const argv[]) {
+    return run_argv_job(argv, NULL, 0);
+}
+
+// run_argv с учётом времени в фазе phase (useradd/userdel через sudo)
+int run_argv_timed(int phase, char *const argv[]) {
+    PhaseTimer t;
+    phase_begin(&t);
+    int status = run_argv(argv);
+    phase_end(phase, &t);
+    return status;
+}
+
+// hash — показать или сбросить (-r) кэш путей команд
+void cmd_hash(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        path_cache_clear();
+        return;
+    }
+    if (!path_cache_count) {
+        printf("hash: кэш команд пуст\n");
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < path_cache_cap; i++) {
+        if (path_cache[i].name) printf("%4u\t%s\n", path_cache[i].hits, path_cache[i].path);
+    }
+}
+
+// Изменения каталогов, пришедшие событиями inotify и ещё не применённые
+NameList pending_dirs_added;
+NameList pending_dirs_removed;
+
+// Перечитывание корня VFS, только если изменился его mtime.
+// Возвращает -1, если корня VFS нет.
+int vfs_snapshot_refresh(NameList *added, NameList *removed) {
+    char *users_dir = get_users_dir_path();
+    struct stat st;
+    if (k_stat(users_dir, &st) == -1) return -1;
+    if (vfs_snapshot_valid &&
+        st.st_mtim.tv_sec == vfs_stamp.tv_sec && st.st_mtim.tv_nsec == vfs_stamp.tv_nsec) {
+        return 0;
+    }
+
+    DIR *dir = k_opendir(users_dir);
+    if (!dir) return -1;
+
+    UserSet fresh = {0};
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat est;
+            if (k_fstatat(dirfd(dir), entry->d_name, &est, 0) != 0 || !S_ISDIR(est.st_mode)) continue;
+        } else if (entry->d_type != DT_DIR) {
+            continue;
+        }
+        user_set_add(&fresh, entry->d_name);
+        if (!user_set_find(&vfs_snapshot, entry->d_name)) name_list_push(added, entry->d_name);
+    }
+    closedir(dir);
+
+    user_set_foreach(&vfs_snapshot, old) {
+        if (!user_set_find(&fresh, old->name)) name_list_push(removed, old->name);
+    }
+
+    user_set_free(&vfs_snapshot);
+    vfs_snapshot = fresh;
+    vfs_stamp = st.st_mtim;
+    vfs_snapshot_valid = 1;
+    return 1;
+}
+
+// --- Буферизованный вывод ---
+// Длинные листинги (\vfs, listusers) копятся в буфере и пишутся в stdout крупными
+// кусками: на терминале stdout построчный, и иначе каждая строка — отдельный write().
+
+typedef struct {
+    FILE *sink;          // куда сбрасывать; NULL — stdout
+    size_t len;
+    char data[65536];
+} OutBuf;
+
+void out_flush(OutBuf *o) {
+    fwrite(o->data, 1, o->len, o->sink ? o->sink : stdout);
+    o->len = 0;
+}
+
+void out_put(OutBuf *o, const char *s, size_t len) {
+    if (o->len + len > sizeof(o->data)) out_flush(o);
+    if (len > sizeof(o->data)) {
+        fwrite(s, 1, len, o->sink ? o->sink : stdout);
+        return;
+    }
+    memcpy(o->data + o->len, s, len);
+    o->len += len;
+}
+
+// Колонка как у "%-Ns ": значение, добивка пробелами до width и разделитель
+void out_column(OutBuf *o, const char *s, int width) {
+    static const char spaces[] = "                                ";
+    size_t len = strlen(s);
+    out_put(o, s, len);
+    size_t pad = (size_t)width > len ? width - len : 0;
+    out_put(o, spaces, pad + 1 < sizeof(spaces) ? pad + 1 : sizeof(spaces) - 1);
+}
+
+__attribute__((format(printf, 2, 3)))
+void out_printf(OutBuf *o, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->data + o->len, sizeof(o->data) - o->len, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && (size_t)n < sizeof(o->data) - o->len) {
+        o->len += n;
+        return;
+    }
+    // Не поместилось — сбрасываем и форматируем заново
+    out_flush(o);
+    char *s = NULL;
+    va_start(ap, fmt);
+    n = vasprintf(&s, fmt, ap);
+    va_end(ap);
+    if (n >= 0) out_put(o, s, n);
+    free(s);
+}
+
+// --- Структурированный вывод ---
+// kubsh --format=json|csv|tsv (или \format): listusers, \e, \l, \history и system_stats
+// выдают записи вместо текста. Записи идут по одной через OutBuf, документ целиком не
+// собирается: JSON — объект на строку (JSON Lines, читается jq), CSV — по RFC 4180,
+// TSV — с заголовком и экранированием \t, \n, \r и \\.
+
+enum { FMT_TEXT, FMT_JSON, FMT_CSV, FMT_TSV };
+int output_format = FMT_TEXT;
+static const char *const format_names[] = { "text", "json", "csv", "tsv" };
+
+int parse_format(const char *name) {
+    for (int i = 0; i < (int)(sizeof(format_names) / sizeof(*format_names)); i++) {
+        if (strcmp(name, format_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+typedef struct {
+    OutBuf *out;
+    int format;
+    const char *const *keys;   // имена полей, они же заголовок CSV/TSV
+    int nkeys;
+    int field;                 // следующее поле текущей записи
+    int written;               // JSON: сколько полей записи уже выведено
+} Emitter;
+
+static void emit_escaped(Emitter *em, const char *s) {
+    if (em->format == FMT_CSV) {
+        if (!s[strcspn(s, ",\"\r\n")]) {
+            out_put(em->out, s, strlen(s));
+            return;
+        }
+        out_put(em->out, "\"", 1);
+        for (const char *q; (q = strchr(s, '"')); s = q + 1) {
+            out_put(em->out, s, q + 1 - s);
+            out_put(em->out, "\"", 1);
+        }
+        out_put(em->out, s, strlen(s));
+        out_put(em->out, "\"", 1);
+        return;
+    }
+
+    int json = em->format == FMT_JSON;
+    if (json) out_put(em->out, "\"", 1);
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        const char *esc = NULL;
+        char hex[8];
+        if (c == '\\') esc = "\\\\";
+        else if (c == '\t') esc = "\\t";
+        else if (c == '\n') esc = "\\n";
+        else if (c == '\r') esc = "\\r";
+        else if (json && c == '"') esc = "\\\"";
+        else if (json && c < 0x20) {
+            snprintf(hex, sizeof(hex), "\\u%04x", c);
+            esc = hex;
+        }
+        if (!esc) continue;
+        out_put(em->out, run, s - run);
+        out_put(em->out, esc, strlen(esc));
+        run = s + 1;
+    }
+    out_put(em->out, run, s - run);
+    if (json) out_put(em->out, "\"", 1);
+}
+
+// Переход к полю col: в CSV/TSV пропущенные поля остаются пустыми, в JSON их нет
+static void emit_seek(Emitter *em, int col) {
+    if (em->format != FMT_JSON) {
+        for (int i = em->field; i <= col; i++) {
+            if (i > 0) out_put(em->out, em->format == FMT_CSV ? "," : "\t", 1);
+        }
+    } else {
+        out_put(em->out, em->written++ ? "," : "{", 1);
+        emit_escaped(em, em->keys[col]);
+        out_put(em->out, ":", 1);
+    }
+    em->field = col + 1;
+}
+
+void emit_begin(Emitter *em, OutBuf *out, const char *const *keys, int nkeys) {
+    *em = (Emitter){ out, output_format == FMT_TEXT ? FMT_TSV : output_format, keys, nkeys, 0, 0 };
+    if (em->format == FMT_JSON) return;
+    for (int i = 0; i < nkeys; i++) {
+        if (i) out_put(out, em->format == FMT_CSV ? "," : "\t", 1);
+        emit_escaped(em, keys[i]);
+    }
+    out_put(out, "\n", 1);
+}
+
+// Поля записи выводятся по возрастанию номера; NULL — пустое поле
+void emit_str(Emitter *em, int col, const char *s) {
+    if (!s) return;
+    emit_seek(em, col);
+    emit_escaped(em, s);
+}
+
+void emit_num(Emitter *em, int col, long long v) {
+    char buf[24];
+    emit_seek(em, col);
+    out_put(em->out, buf, snprintf(buf, sizeof(buf), "%lld", v));
+}
+
+void emit_end(Emitter *em) {
+    if (em->format == FMT_JSON) {
+        out_put(em->out, em->written ? "}\n" : "{}\n", em->written ? 2 : 3);
+    } else {
+        for (; em->field < em->nkeys; em->field++) {
+            if (em->field > 0) out_put(em->out, em->format == FMT_CSV ? "," : "\t", 1);
+        }
+        out_put(em->out, "\n", 1);
+    }
+    em->field = em->written = 0;
+}
+
+// --- Ленивая генерация VFS ---
+// Манифест VFS_INDEX_FILE в корне VFS хранит по строке на пользователя в формате
+// name:uid:gid:gecos:home:shell — это то, что сейчас записано в его каталоге.
+// Если строка из passwd совпадает с манифестом и каталог на месте, файлы не трогаем;
+// иначе сравниваем содержимое каждого файла и пишем только изменившиеся
+// (через временный файл и rename(), чтобы читатель не увидел половину записи).
+
+UserSet vfs_manifest;        // имя → хеш строки манифеста
+int vfs_manifest_loaded = 0;
+int vfs_manifest_dirty = 0;
+
+int format_manifest_line(const UserRecord *u, char *buf, size_t size) {
+    return snprintf(buf, size, "%s:%u:%u:%s:%s:%s", u->name, (unsigned)u->uid, (unsigned)u->gid,
+                    u->gecos, u->dir, u->shell);
+}
+
+char *get_manifest_path() {
+    static char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", get_users_dir_path(), VFS_INDEX_FILE);
+    return path;
+}
+
+void vfs_manifest_load() {
+    if (vfs_manifest_loaded) return;
+    vfs_manifest_loaded = 1;
+    FILE *f = k_fopen(get_manifest_path(), "r");
+    if (!f) return;
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) > 0) {
+        if (line[len-1] == '\n') line[--len] = '\0';
+        char *colon = strchr(line, ':');
+        if (!colon) continue;
+        unsigned long h = hash_str(line);
+        *colon = '\0';
+        user_set_add(&vfs_manifest, line)->hash = h;
+    }
+    free(line);
+    fclose(f);
+}
+
+// Сбросить манифест: следующая генерация сверит содержимое всех файлов
+void vfs_manifest_reset() {
+    user_set_free(&vfs_manifest);
+    vfs_manifest_loaded = 1;
+    vfs_manifest_dirty = 1;
+}
+
+// Запись манифеста целиком, если он менялся. При ошибке манифест остаётся
+// «грязным» и записывается при следующей генерации.
+int vfs_manifest_save() {
+    if (!vfs_manifest_dirty) return 0;
+    char tmp[PATH_MAX];
+    int len = snprintf(tmp, sizeof(tmp), "%s.tmp", get_manifest_path());
+    if (len < 0 || (size_t)len >= sizeof(tmp)) return -1;
+    FILE *f = k_fopen(tmp, "w");
+    if (!f) return -1;
+
+    char line[4096];
+    for (size_t i = 0; i < user_index.count; i++) {
+        const UserRecord *u = &user_index.users[i];
+        UserSetEntry *m = user_set_find(&vfs_manifest, u->name);
+        if (!m) continue;
+        format_manifest_line(u, line, sizeof(line));
+        // В манифест попадают только записи, совпадающие с файлами на диске
+        if (m->hash == hash_str(line)) fprintf(f, "%s\n", line);
+    }
+    if (fclose(f) == 0 && rename(tmp, get_manifest_path()) == 0) {
+        vfs_manifest_dirty = 0;
+        return 0;
+    }
+    unlink(tmp);
+    return -1;
+}
+
+// Запись файла, только если содержимое отличается. Возвращает 1, если файл записан.
+int write_file_if_changed(int dirfd, const char *name, const char *data, size_t len) {
+    char cur[4096];
+    int fd = k_openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd != -1) {
+        ssize_t n = read(fd, cur, sizeof(cur));
+        close(fd);
+        if (n == (ssize_t)len && memcmp(cur, data, len) == 0) return 0;
+    }
+
+    char tmp[NAME_MAX + 1];
+    snprintf(tmp, sizeof(tmp), ".%s.tmp", name);
+    fd = k_openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) return -1;
+    ssize_t written = write(fd, data, len);
+    close(fd);
+    if (written != (ssize_t)len || renameat(dirfd, tmp, dirfd, name) == -1) {
+        unlinkat(dirfd, tmp, 0);
+        return -1;
+    }
+    return 1;
+}
+
+// Содержимое файла из каталога пользователя; -1 — такого файла нет
+int render_user_file(const UserRecord *u, const char *file, char *buf, size_t size) {
+    int len;
+    if (strcmp(file, "id") == 0) {
+        len = snprintf(buf, size, "%d", u->uid);
+    } else if (strcmp(file, "home") == 0) {
+        len = snprintf(buf, size, "%s", u->dir);
+    } else if (strcmp(file, "shell") == 0) {
+        len = snprintf(buf, size, "%s", u->shell);
+    } else if (strcmp(file, "info") == 0) {
+        len = snprintf(buf, size, "Username: %s\nUID: %d\nGID: %d\nHome: %s\nShell: %s\nGECOS: %s\n",
+                       u->name, u->uid, u->gid, u->dir, u->shell, u->gecos);
+    } else {
+        return -1;
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+// Создание файлов пользователя в VFS
+void create_user_vfs_entry(const UserRecord *pw) {
+    vfs_manifest_load();
+    char line[4096];
+    format_manifest_line(pw, line, sizeof(line));
+    unsigned long h = hash_str(line);
+    UserSetEntry *m = user_set_find(&vfs_manifest, pw->name);
+    if (m && m->hash == h && vfs_snapshot_valid && user_set_find(&vfs_snapshot, pw->name)) {
+        return; // каталог уже соответствует passwd
+    }
+
+    char *users_dir = get_users_dir_path();
+    char user_dir_path[PATH_MAX];
+    int plen = snprintf(user_dir_path, sizeof(user_dir_path), "%s/%s", users_dir, pw->name);
+    if (plen < 0 || (size_t)plen >= sizeof(user_dir_path)) {
+        // Обрезанный путь указал бы на чужой каталог — пользователя пропускаем
+        errno = ENAMETOOLONG;
+        perror("Ошибка создания директории пользователя");
+        return;
+    }
+
+    if (mkdir(user_dir_path, 0755) == -1 && errno != EEXIST) {
+        perror("Ошибка создания директории пользователя");
+        return;
+    }
+    user_set_add(&vfs_snapshot, pw->name);
+
+    int dfd = k_open(user_dir_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd == -1) {
+        perror("Ошибка открытия директории пользователя");
+        return;
+    }
+
+    char buf[4096];
+    static const char *files[] = { "id", "home", "shell", "info" };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        int len = render_user_file(pw, files[i], buf, sizeof(buf));
+        if (len >= 0) write_file_if_changed(dfd, files[i], buf, len);
+    }
+
+    // symlink: пересоздаём, если домашний каталог сменился
+    ssize_t n = readlinkat(dfd, "home_link", buf, sizeof(buf) - 1);
+    if (n < 0 || (size_t)n != strlen(pw->dir) || memcmp(buf, pw->dir, n) != 0) {
+        if (n >= 0) unlinkat(dfd, "home_link", 0);
+        symlinkat(pw->dir, dfd, "home_link");
+    }
+    close(dfd);
+
+    user_set_add(&vfs_manifest, pw->name)->hash = h;
+    vfs_manifest_dirty = 1;
+}
+
+// Приведение каталогов всех пользователей в соответствие с passwd
+void regenerate_users_vfs() {
+    user_index_refresh();
+    vfs_manifest_load();
+    // Снимок каталогов нужен, чтобы пропускать неизменившихся пользователей без syscall'ов
+    vfs_snapshot_refresh(&pending_dirs_added, &pending_dirs_removed);
+    for (size_t i = 0; i < user_index.count; i++) {
+        // Создаём VFS только для пользователей с shell, заканчивающимся на 'sh'
+        if (user_index.users[i].sh) {
+            create_user_vfs_entry(&user_index.users[i]);
+        }
+    }
+    vfs_manifest_save();
+}
+
+// Создание VFS
+// Содержимое system_stats в текущем формате. Возвращает длину неизменной части —
+// всё, что до времени создания.
+static const char *const stats_columns[] = { "vfs", "owner", "created" };
+
+size_t render_system_stats(OutBuf *o, time_t created) {
+    const char *owner = getenv("USER") ?: "unknown";
+    char when[32];
+    if (output_format == FMT_TEXT) {
+        out_printf(o, "VFS создан: %s\nВладелец: %s\n", get_users_dir_path(), owner);
+        size_t prefix = o->len;
+        out_printf(o, "Время создания: %s", ctime_r(&created, when));
+        return prefix;
+    }
+    Emitter em;
+    emit_begin(&em, o, stats_columns, 3);
+    emit_str(&em, 0, get_users_dir_path());
+    emit_str(&em, 1, owner);
+    size_t prefix = o->len;
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&created, &tm));
+    emit_str(&em, 2, when);
+    emit_end(&em);
+    return prefix;
+}
+
+void create_users_vfs() {
+    char *users_dir = get_users_dir_path();
+    struct stat st = {0};
+
+    if (k_stat(users_dir, &st) == -1) {
+        if (mkdir(users_dir, 0755) == -1) {
+            perror("Ошибка создания директории пользователей");
+            return;
+        }
+        vfs_manifest_reset();
+    }
+
+    regenerate_users_vfs();
+
+    // system_stats: время создания сохраняем, пока не сменились VFS, владелец и формат
+    int dfd = k_open(users_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    OutBuf *stats = malloc(sizeof(OutBuf));
+    if (dfd != -1 && stats) {
+        stats->sink = NULL;
+        stats->len = 0;
+        size_t prefix = render_system_stats(stats, time(NULL));
+        char cur[1024];
+        int fd = k_openat(dfd, "system_stats", O_RDONLY | O_CLOEXEC);
+        ssize_t n = fd != -1 ? read(fd, cur, sizeof(cur)) : -1;
+        if (fd != -1) close(fd);
+        if (n < (ssize_t)prefix || memcmp(cur, stats->data, prefix) != 0) {
+            write_file_if_changed(dfd, "system_stats", stats->data, stats->len);
+        }
+    }
+    free(stats);
+    if (dfd != -1) close(dfd);
+
+    if (interactive) printf("VFS создан в %s\n", users_dir);
+}
+
+// Удаление каталога пользователя из VFS (только файлы, которые создаёт kubsh)
+void remove_user_vfs_entry(const char *name) {
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/%s", get_users_dir_path(), name);
+
+    // Каталог с обрезанным путём kubsh не создавал — на диске трогать нечего
+    if (len >= 0 && (size_t)len < sizeof(path)) {
+        int dfd = k_open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dfd != -1) {
+            static const char *files[] = { "id", "home", "shell", "info", "home_link" };
+            for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+                unlinkat(dfd, files[i], 0);
+            }
+            close(dfd);
+        }
+        rmdir(path);
+    }
+    user_set_remove(&vfs_snapshot, name);
+    if (user_set_find(&vfs_manifest, name)) {
+        user_set_remove(&vfs_manifest, name);
+        vfs_manifest_dirty = 1;
+    }
+}
+
+// --- Пакетное создание пользователей ---
+// useradd на каждого пользователя переписывает passwd/shadow/group целиком и
+// порождает отдельное обновление VFS. Для пачки (adduser -f, сразу много каталогов в VFS)
+// kubsh сам берёт блокировку lckpwdf() один раз, дописывает все записи в копии файлов,
+// подменяет их rename(), а домашние каталоги создаёт параллельно.
+
+typedef struct {
+    const char *name;
+    uid_t uid;
+    gid_t gid;
+    char home[PATH_MAX];
+    int ok;
+} NewUser;
+
+// Имя, которое примет useradd: [A-Za-z0-9_.][A-Za-z0-9_.-]*[$]?, кроме "." и ".."
+int valid_username(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len >= MAX_USERNAME_SIZE || name[0] == '-') return 0;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (c == '$' && i == len - 1 && i > 0) break;
+        if (!(c == '_' || c == '-' || c == '.' || (c >= 'a' && c <= 'z') ||
+              (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) return 0;
+    }
+    return 1;
+}
+
+// Значение из файла вида "KEY value" или "KEY=value" (login.defs, default/useradd)
+static int read_config_value(const char *path, const char *key, char *out, size_t size) {
+    FILE *f = k_fopen(path, "r");
+    if (!f) return -1;
+    char line[512];
+    size_t klen = strlen(key);
+    int found = -1;
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (strncmp(p, key, klen) != 0 || !strchr(" \t=", p[klen])) continue;
+        p += klen;
+        while (*p == ' ' || *p == '\t' || *p == '=') p++;
+        p[strcspn(p, " \t\r\n#")] = '\0';
+        snprintf(out, size, "%s", p);
+        found = 0;
+    }
+    fclose(f);
+    return found;
+}
+
+static long login_defs_long(const char *key, long def) {
+    char val[64];
+    if (read_config_value("/etc/login.defs", key, val, sizeof(val)) != 0 || !*val) return def;
+    return strtol(val, NULL, 0);
+}
+
+// Содержимое файла целиком (для /etc/group: занятые GID и имена групп)
+static char *read_whole_file(const char *path, size_t *len) {
+    int fd = k_open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    struct stat st;
+    char *data = NULL;
+    if (k_fstat(fd, &st) == 0 && (data = malloc(st.st_size + 1))) {
+        ssize_t n = read(fd, data, st.st_size);
+        *len = n > 0 ? (size_t)n : 0;
+        data[*len] = '\0';
+    }
+    close(fd);
+    return data;
+}
+
+// Есть ли в group-файле запись с таким именем (name) или GID (name == NULL)
+static int group_taken(const char *groups, const char *name, gid_t gid) {
+    size_t nlen = name ? strlen(name) : 0;
+    for (const char *line = groups; line && *line; ) {
+        const char *end = strchr(line, '\n');
+        if (name) {
+            if (strncmp(line, name, nlen) == 0 && line[nlen] == ':') return 1;
+        } else {
+            // name:x:gid:members
+            const char *f = strchr(line, ':');
+            if (f) f = strchr(f + 1, ':');
+            if (f && (!end || f < end) && f[1] >= '0' && f[1] <= '9' &&
+                (gid_t)strtoul(f + 1, NULL, 10) == gid) return 1;
+        }
+        line = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+// Копирование содержимого файла: клон блоков (FICLONE) там, где ФС это умеет,
+// иначе copy_file_range внутри ядра, в крайнем случае read/write
+static int copy_fd_data(int in, int out, off_t size) {
+    if (size > 0 && ioctl(out, FICLONE, in) == 0) return 0;
+    off_t left = size;
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+        if (n > 0) { left -= n; continue; }
+        if (n == 0) return -1;
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) return -1;
+        // copy_file_range недоступен — обычное копирование с текущей позиции
+        char buf[65536];
+        ssize_t r;
+        while (left > 0 && (r = read(in, buf, sizeof(buf))) > 0) {
+            if (write(out, buf, r) != r) return -1;
+            left -= r;
+        }
+        return left > 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+// Копия файла учётных записей с дописанными строками: path+ рядом с оригиналом,
+// с теми же правами и владельцем. Подмена — отдельно, когда готовы все файлы.
+static int stage_db_file(const char *path, const char *data, size_t len) {
+    int in = k_open(path, O_RDONLY | O_CLOEXEC);
+    if (in == -1) return -1;
+    struct stat st;
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s+", path);
+    int out = -1, ok = 0;
+    if (k_fstat(in, &st) == 0 &&
+        (out = k_open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777)) != -1 &&
+        fchown(out, st.st_uid, st.st_gid) == 0 && fchmod(out, st.st_mode & 07777) == 0) {
+        ok = 1;
+        // Старое содержимое копирует ядро
+        if (copy_fd_data(in, out, st.st_size) != 0) ok = 0;
+        char last = '\n';
+        if (ok && st.st_size > 0 && pread(in, &last, 1, st.st_size - 1) != 1) ok = 0;
+        if (ok && last != '\n' && write(out, "\n", 1) != 1) ok = 0;
+        if (ok && write(out, data, len) != (ssize_t)len) ok = 0;
+        if (ok && fsync(out) != 0) ok = 0;
+    }
+    int saved = errno;
+    if (out != -1) close(out);
+    close(in);
+    if (!ok) {
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// Копирование /etc/skel (рекурсивно) с передачей файлов новому владельцу
+static void copy_skel_tree(int sfd, int dfd, uid_t uid, gid_t gid) {
+    DIR *dir = fdopendir(dup(sfd));
+    if (!dir) return;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        struct stat st;
+        if (k_fstatat(sfd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (mkdirat(dfd, e->d_name, 0700) == -1) continue;
+            int s = k_openat(sfd, e->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            int d = k_openat(dfd, e->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (s != -1 && d != -1) {
+                copy_skel_tree(s, d, uid, gid);
+                if (fchown(d, uid, gid) == 0) fchmod(d, st.st_mode & 07777);
+            }
+            if (s != -1) close(s);
+            if (d != -1) close(d);
+        } else if (S_ISREG(st.st_mode)) {
+            int s = k_openat(sfd, e->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            int d = s == -1 ? -1 : k_openat(dfd, e->d_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (d != -1) {
+                copy_fd_data(s, d, st.st_size);
+                if (fchown(d, uid, gid) == 0) fchmod(d, st.st_mode & 07777);
+                close(d);
+            }
+            if (s != -1) close(s);
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t n = readlinkat(sfd, e->d_name, target, sizeof(target) - 1);
+            if (n < 0) continue;
+            target[n] = '\0';
+            if (symlinkat(target, dfd, e->d_name) == 0) {
+                fchownat(dfd, e->d_name, uid, gid, AT_SYMLINK_NOFOLLOW);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+static int create_home(const NewUser *u, mode_t mode) {
+    // Как useradd: существующий каталог не трогаем (EEXIST попадёт в отчёт задания)
+    if (mkdir(u->home, 0700) == -1) return -1;
+    int dfd = k_open(u->home, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd == -1) return -1;
+    int sfd = k_open("/etc/skel", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sfd != -1) {
+        copy_skel_tree(sfd, dfd, u->uid, u->gid);
+        close(sfd);
+    }
+    int rc = fchown(dfd, u->uid, u->gid) == 0 && fchmod(dfd, mode) == 0 ? 0 : -1;
+    close(dfd);
+    return rc;
+}
+
+// /etc/skel в каталог, который уже создал useradd: права и метки каталога — его
+static int fill_home(const NewUser *u) {
+    int dfd = k_open(u->home, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd == -1) return -1;
+    int sfd = k_open("/etc/skel", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sfd != -1) {
+        copy_skel_tree(sfd, dfd, u->uid, u->gid);
+        close(sfd);
+    }
+    close(dfd);
+    return 0;
+}
+
+// --- Пул рабочих потоков ---
+// Домашние каталоги копируются и удаляются в фоне: команда сразу получает номер
+// задания, а о завершении главный цикл узнаёт через канал job_notify_fd и сообщает
+// "[N] Готово". Задание (JobGroup) состоит из нескольких задач (Job); последняя
+// завершившаяся задача отправляет группу в канал.
+
+typedef struct JobGroup {
+    int id;
+    char desc[PATH_MAX + 64];
+    char root[PATH_MAX];   // удаляемый каталог: rmdir после всех задач
+    int pending;           // незавершённые задачи + 1, пока группа не закрыта
+    int error;             // первая ошибка (errno)
+    struct JobGroup *active_next;  // список job_groups для jobs (главный поток)
+} JobGroup;
+
+enum { JOB_HOME, JOB_SKEL, JOB_DELETE_ROOT, JOB_DELETE_TREE };
+
+typedef struct Job {
+    int kind;
+    JobGroup *group;
+    NewUser user;          // JOB_HOME, JOB_SKEL
+    mode_t mode;
+    char path[PATH_MAX];   // JOB_DELETE_*
+    struct Job *next;
+} Job;
+
+#define JOB_MAX_THREADS 8
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static Job *job_head, *job_tail;
+static int job_threads = 0;
+int job_groups_active = 0;   // отправленные и ещё не сообщённые задания (главный поток)
+int job_notify_fd = -1;      // читающий конец канала завершений
+static int job_notify_wr = -1;
+JobGroup *job_groups;        // отправленные и ещё не сообщённые задания (главный поток)
+
+static void job_submit(JobGroup *g, Job *j);
+
+static void job_finish(JobGroup *g, int err) {
+    pthread_mutex_lock(&job_lock);
+    if (err && !g->error) g->error = err;
+    int done = --g->pending == 0;
+    pthread_mutex_unlock(&job_lock);
+    if (!done) return;
+
+    if (g->root[0] && rmdir(g->root) == -1 && !g->error) g->error = errno;
+    // Указатель меньше PIPE_BUF — запись атомарна
+    while (write(job_notify_wr, &g, sizeof(g)) == -1 && errno == EINTR) {}
+}
+
+// Рекурсивное удаление содержимого каталога через openat/unlinkat
+static int remove_tree_at(int dfd) {
+    DIR *dir = fdopendir(dup(dfd));
+    if (!dir) return errno;
+    int err = 0;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        int is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = k_fstatat(dfd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            int sub = k_openat(dfd, e->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (sub != -1) {
+                int rc = remove_tree_at(sub);
+                if (rc && !err) err = rc;
+                close(sub);
+            }
+        }
+        if (unlinkat(dfd, e->d_name, is_dir ? AT_REMOVEDIR : 0) == -1 && !err) err = errno;
+    }
+    closedir(dir);
+    return err;
+}
+
+static int job_run(Job *j) {
+    if (j->kind == JOB_HOME) {
+        return create_home(&j->user, j->mode) == -1 ? errno : 0;
+    }
+    if (j->kind == JOB_SKEL) {
+        return fill_home(&j->user) == -1 ? errno : 0;
+    }
+
+    int dfd = k_open(j->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd == -1) return errno;
+    int err = 0;
+    if (j->kind == JOB_DELETE_TREE) {
+        err = remove_tree_at(dfd);
+        close(dfd);
+        if (rmdir(j->path) == -1 && !err) err = errno;
+        return err;
+    }
+
+    // Корень удаляемого дерева: файлы удаляем сразу, подкаталоги раздаём другим потокам
+    DIR *dir = fdopendir(dfd);
+    if (!dir) {
+        close(dfd);
+        return errno;
+    }
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        int is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = k_fstatat(dfd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        Job *sub = is_dir ? calloc(1, sizeof(Job)) : NULL;
+        if (sub && (size_t)snprintf(sub->path, sizeof(sub->path), "%s/%s", j->path, e->d_name) >= sizeof(sub->path)) {
+            // По обрезанному пути удалялось бы что-то другое: подкаталог пропускаем
+            free(sub);
+            if (!err) err = ENAMETOOLONG;
+            continue;
+        }
+        if (sub) {
+            sub->kind = JOB_DELETE_TREE;
+            job_submit(j->group, sub);
+        } else if (unlinkat(dfd, e->d_name, is_dir ? AT_REMOVEDIR : 0) == -1 && !err) {
+            err = errno;
+        }
+    }
+    closedir(dir);
+    return err;
+}
+
+static void *job_worker(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&job_lock);
+        while (!job_head) pthread_cond_wait(&job_ready, &job_lock);
+        Job *j = job_head;
+        job_head = j->next;
+        if (!job_head) job_tail = NULL;
+        pthread_mutex_unlock(&job_lock);
+
+        int err = job_run(j);
+        JobGroup *g = j->group;
+        free(j);
+        job_finish(g, err);
+    }
+    return NULL;
+}
+
+// fork() во время работы пула (фоновая строка со встроенными командами): потоков
+// у копии нет, а канал завершений общий с родителем — копия заводит свои
+static void job_pool_prepare() { pthread_mutex_lock(&job_lock); }
+static void job_pool_parent() { pthread_mutex_unlock(&job_lock); }
+static void job_pool_child() {
+    pthread_mutex_unlock(&job_lock);
+    job_threads = 0;
+    job_head = job_tail = NULL;
+    job_groups_active = 0;
+    job_groups = NULL;
+    if (job_notify_fd != -1) close(job_notify_fd);
+    if (job_notify_wr != -1) close(job_notify_wr);
+    job_notify_fd = job_notify_wr = -1;
+}
+
+// Потоки и канал создаются при первом задании
+static int job_pool_start() {
+    static int atfork_set = 0;
+    if (job_threads > 0) return 0;
+    if (!atfork_set) {
+        pthread_atfork(job_pool_prepare, job_pool_parent, job_pool_child);
+        atfork_set = 1;
+    }
+    if (job_notify_fd == -1) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+        job_notify_fd = fds[0];
+        job_notify_wr = fds[1];
+    }
+
+    // Потокам сигналы не нужны: SIGHUP и прочие обрабатывает главный поток
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = ncpu > 0 && ncpu < JOB_MAX_THREADS ? (int)ncpu : JOB_MAX_THREADS;
+    for (int i = 0; i < want; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, job_worker, NULL) != 0) break;
+        pthread_detach(t);
+        job_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return job_threads > 0 ? 0 : -1;
+}
+
+JobGroup *job_group_new() {
+    // Без потоков задачи выполняются на месте, но канал завершений нужен всегда
+    if (job_pool_start() == -1 && job_notify_fd == -1) return NULL;
+    JobGroup *g = calloc(1, sizeof(JobGroup));
+    if (!g) return NULL;
+    g->id = job_next_id++;
+    g->pending = 1;
+    g->active_next = job_groups;
+    job_groups = g;
+    job_groups_active++;
+    return g;
+}
+
+static void job_submit(JobGroup *g, Job *j) {
+    j->group = g;
+    j->next = NULL;
+    pthread_mutex_lock(&job_lock);
+    g->pending++;
+    if (job_threads > 0) {
+        if (job_tail) job_tail->next = j;
+        else job_head = j;
+        job_tail = j;
+        pthread_cond_signal(&job_ready);
+    }
+    pthread_mutex_unlock(&job_lock);
+    if (job_threads > 0) return;
+
+    // Потоков нет — выполняем на месте
+    int err = job_run(j);
+    free(j);
+    job_finish(g, err);
+}
+
+// Все задачи группы отправлены; возвращает номер задания
+int job_group_close(JobGroup *g) {
+    int id = g->id;
+    job_finish(g, 0);
+    return id;
+}
+
+// Сообщения о завершённых заданиях. Возвращает их число.
+int jobs_report() {
+    int reported = 0;
+    JobGroup *g;
+    fd_set rfds;
+    struct timeval tv = {0, 0};
+    FD_ZERO(&rfds);
+    FD_SET(job_notify_fd, &rfds);
+    while (job_groups_active > 0 && select(job_notify_fd + 1, &rfds, NULL, NULL, &tv) > 0 &&
+           read(job_notify_fd, &g, sizeof(g)) == sizeof(g)) {
+        if (g->error) printf("[%d] Ошибка: %s: %s\n", g->id, g->desc, strerror(g->error));
+        else printf("[%d] Готово: %s\n", g->id, g->desc);
+        for (JobGroup **p = &job_groups; *p; p = &(*p)->active_next) {
+            if (*p == g) {
+                *p = g->active_next;
+                break;
+            }
+        }
+        free(g);
+        job_groups_active--;
+        reported++;
+    }
+    return reported;
+}
+
+// Перед выходом дожидаемся всех заданий
+void jobs_wait_all() {
+    while (job_groups_active > 0) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(job_notify_fd, &rfds);
+        if (select(job_notify_fd + 1, &rfds, NULL, NULL, NULL) == -1 && errno != EINTR) break;
+        jobs_report();
+    }
+}
+
+// Создание одного пользователя под root. Учётную запись и сам каталог делает useradd
+// (кэши nscd/sssd, метки SELinux, subuid/subgid, USERGROUPS_ENAB), но с пустым skel:
+// содержимое /etc/skel копируется в фоне. *job — номер задания, 0 — если его нет.
+int add_user_async(const char *name, int *job) {
+    *job = 0;
+    char empty_skel[] = "/tmp/kubsh-skel.XXXXXX";
+    int have_empty = mkdtemp(empty_skel) != NULL;
+    char *argv[] = { "useradd", "-m", "-k", empty_skel, "-s", "/bin/bash", (char *)name, NULL };
+    // Без пустого каталога — обычный useradd, skel копирует он сам
+    char *plain_argv[] = { "useradd", "-m", "-s", "/bin/bash", (char *)name, NULL };
+    int rc = run_argv_timed(PH_USERADD, have_empty ? argv : plain_argv);
+    if (have_empty) rmdir(empty_skel);
+    if (rc != 0) return -1;
+
+    user_index_refresh();
+    const UserRecord *u = user_index_by_name(name);
+    struct stat st;
+    // Каталог, который существовал раньше и принадлежит не новому пользователю, не трогаем
+    if (!have_empty || !u || u->dir[0] != '/' || strlen(u->dir) >= PATH_MAX ||
+        k_lstat(u->dir, &st) == -1 || !S_ISDIR(st.st_mode) || st.st_uid != u->uid) {
+        return 0;
+    }
+    JobGroup *g = job_group_new();
+    if (!g) return 0;
+    snprintf(g->desc, sizeof(g->desc), "домашний каталог %s", u->dir);
+    Job *j = calloc(1, sizeof(Job));
+    if (j) {
+        j->kind = JOB_SKEL;
+        j->user.name = name;
+        j->user.uid = u->uid;
+        j->user.gid = u->gid;
+        snprintf(j->user.home, sizeof(j->user.home), "%s", u->dir);
+        job_submit(g, j);
+    } else {
+        g->error = ENOMEM;
+    }
+    *job = job_group_close(g);
+    return 0;
+}
+
+// Удаление пользователя под root: userdel без -r, а домашний каталог сразу
+// переименовывается рядом в скрытый и удаляется в фоне. Возвращает номер задания,
+// 0 — если удалять каталог не нужно, -1 — ошибка userdel.
+int remove_user_async(const char *name) {
+    const UserRecord *u = user_index_by_name(name);
+    if (!u) return -1;
+    char home[PATH_MAX];
+    snprintf(home, sizeof(home), "%s", u->dir);
+    uid_t uid = u->uid;
+
+    // Как userdel -r: чужой или общий с другим пользователем каталог не трогаем
+    struct stat st;
+    int remove_home = home[0] == '/' && home[1] != '\0' &&
+                      k_lstat(home, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == uid;
+    for (size_t i = 0; remove_home && i < user_index.count; i++) {
+        const UserRecord *o = &user_index.users[i];
+        if (o->uid != uid && strcmp(o->dir, home) == 0) remove_home = 0;
+    }
+
+    // Почтовый ящик — как у userdel -r: MAIL_DIR/имя; при одном MAIL_FILE ящик лежит
+    // в домашнем каталоге и уйдёт вместе с ним; без обоих — /var/mail
+    char mail_dir[PATH_MAX] = "", mail_file[PATH_MAX] = "", spool[PATH_MAX] = "";
+    read_config_value("/etc/login.defs", "MAIL_DIR", mail_dir, sizeof(mail_dir));
+    read_config_value("/etc/login.defs", "MAIL_FILE", mail_file, sizeof(mail_file));
+    if (!mail_dir[0] && !mail_file[0]) snprintf(mail_dir, sizeof(mail_dir), "/var/mail");
+    if (mail_dir[0] && (size_t)snprintf(spool, sizeof(spool), "%s/%s", mail_dir, name) >= sizeof(spool)) {
+        spool[0] = '\0';
+    }
+
+    char *argv[] = { "userdel", (char *)name, NULL };
+    if (run_argv_timed(PH_USERDEL, argv) != 0) return -1;
+    // Чужой ящик userdel -r тоже не удаляет
+    if (spool[0] && k_lstat(spool, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == uid) unlink(spool);
+    if (!remove_home) return 0;
+
+    JobGroup *g = job_group_new();
+    if (!g) return 0;
+    // Имя освобождается сразу: новый пользователь с тем же именем получит чистый каталог
+    char *slash = strrchr(home, '/');
+    snprintf(g->root, sizeof(g->root), "%.*s/.%s.kubsh-deleted.%d.%d",
+             (int)(slash - home), home, slash + 1, (int)getpid(), g->id);
+    snprintf(g->desc, sizeof(g->desc), "удаление %s", home);
+    // Задачу выделяем до rename: иначе каталог остался бы переименованным и неудалённым
+    Job *j = calloc(1, sizeof(Job));
+    if (!j) {
+        g->error = ENOMEM;
+        g->root[0] = '\0';
+    } else if (rename(home, g->root) == -1) {
+        g->error = errno;
+        g->root[0] = '\0';
+        free(j);
+    } else {
+        j->kind = JOB_DELETE_ROOT;
+        snprintf(j->path, sizeof(j->path), "%s", g->root);
+        job_submit(g, j);
+    }
+    return job_group_close(g);
+}
+
+// Создание пачки пользователей одной транзакцией над passwd/shadow/group/gshadow
+// (только root). Возвращает число созданных; ok у каждого записывается в users[i].
+// Домашние каталоги создаются в фоне, номер задания — в *job (0, если задания нет).
+size_t provision_users(NewUser *users, size_t count, int *job) {
+    *job = 0;
+    if (count == 0) return 0;
+    // Фаза useradd — транзакция над файлами; домашние каталоги копируются в фоне
+    PhaseTimer t;
+    phase_begin(&t);
+    if (lckpwdf() != 0) {
+        perror("kubsh: не удалось заблокировать /etc/passwd");
+        phase_end(PH_USERADD, &t);
+        return 0;
+    }
+
+    char home_base[PATH_MAX] = "/home";
+    read_config_value("/etc/default/useradd", "HOME", home_base, sizeof(home_base));
+    uid_t uid_min = login_defs_long("UID_MIN", 1000), uid_max = login_defs_long("UID_MAX", 60000);
+
+    // Индекс перечитываем под блокировкой: никто не допишет passwd между проверкой и записью
+    user_index_refresh();
+    size_t glen = 0;
+    char *groups = read_whole_file("/etc/group", &glen);
+    uid_t next = uid_min;
+    for (size_t i = 0; i < user_index.count; i++) {
+        uid_t uid = user_index.users[i].uid;
+        if (uid >= next && uid < uid_max) next = uid + 1;
+    }
+
+    // Строки для всех четырёх файлов
+    size_t cap = count * (2 * MAX_USERNAME_SIZE + strlen(home_base) + 64);
+    char *pw = malloc(cap), *sp = malloc(cap), *gr = malloc(cap), *gs = malloc(cap);
+    size_t pwl = 0, spl = 0, grl = 0, gsl = 0, created = 0;
+    long days = time(NULL) / 86400;
+    for (size_t i = 0; pw && sp && gr && gs && i < count; i++) {
+        NewUser *u = &users[i];
+        u->ok = 0;
+        if (!valid_username(u->name)) {
+            printf("Некорректное имя пользователя: %s\n", u->name);
+            continue;
+        }
+        if (user_index_by_name(u->name)) {
+            printf("Пользователь %s уже существует\n", u->name);
+            continue;
+        }
+        if (group_taken(groups, u->name, 0)) {
+            printf("Группа %s уже существует\n", u->name);
+            continue;
+        }
+        // Одинаковое имя в одной пачке
+        int dup = 0;
+        for (size_t j = 0; j < i && !dup; j++) dup = users[j].ok && strcmp(users[j].name, u->name) == 0;
+        if (dup) continue;
+
+        while (next <= uid_max && (user_index_by_uid(next) || group_taken(groups, NULL, next))) next++;
+        if (next > uid_max) {
+            printf("Закончились свободные UID для %s\n", u->name);
+            break;
+        }
+        if ((size_t)snprintf(u->home, sizeof(u->home), "%s/%s", home_base, u->name) >= sizeof(u->home)) {
+            printf("Слишком длинный путь домашнего каталога для %s\n", u->name);
+            continue;
+        }
+        u->uid = u->gid = next++;
+        pwl += sprintf(pw + pwl, "%s:x:%u:%u::%s:/bin/bash\n", u->name, u->uid, u->gid, u->home);
+        spl += sprintf(sp + spl, "%s:!:%ld:0:99999:7:::\n", u->name, days);
+        grl += sprintf(gr + grl, "%s:x:%u:\n", u->name, u->gid);
+        gsl += sprintf(gs + gsl, "%s:!::\n", u->name);
+        u->ok = 1;
+        created++;
+    }
+
+    if (created) {
+        // Сначала готовим все копии, затем подменяем: ошибка записи не оставит
+        // полузаписанных файлов, а чтение passwd никогда не видит пустой файл
+        struct { const char *path; const char *data; size_t len; int staged; } db[] = {
+            { "/etc/group", gr, grl, 0 }, { "/etc/gshadow", gs, gsl, 0 },
+            { "/etc/shadow", sp, spl, 0 }, { PASSWD_FILE, pw, pwl, 0 },
+        };
+        size_t ndb = sizeof(db) / sizeof(db[0]);
+        int failed = 0;
+        for (size_t i = 0; i < ndb && !failed; i++) {
+            if (stage_db_file(db[i].path, db[i].data, db[i].len) == 0) db[i].staged = 1;
+            // gshadow есть не везде
+            else if (!(errno == ENOENT && i == 1)) failed = 1;
+            if (failed) fprintf(stderr, "kubsh: %s: %s\n", db[i].path, strerror(errno));
+        }
+        // passwd подменяется последним: пока его нет, пользователей не существует.
+        // Сбой посреди подмен останавливает остальные и сообщается как частичная запись
+        size_t renamed = 0;
+        for (size_t i = 0; i < ndb; i++) {
+            if (!db[i].staged) continue;
+            char tmp[PATH_MAX];
+            snprintf(tmp, sizeof(tmp), "%s+", db[i].path);
+            if (failed) {
+                unlink(tmp);
+            } else if (rename(tmp, db[i].path) == -1) {
+                fprintf(stderr, "kubsh: %s: %s\n", db[i].path, strerror(errno));
+                unlink(tmp);
+                failed = 1;
+                if (renamed) {
+                    fprintf(stderr, "kubsh: частичная запись: уже заменены");
+                    for (size_t r = 0; r < i; r++) {
+                        if (db[r].staged) fprintf(stderr, " %s", db[r].path);
+                    }
+                    fprintf(stderr, " — в них остались записи несозданных пользователей\n");
+                }
+            } else {
+                renamed++;
+            }
+        }
+        if (failed) {
+            for (size_t i = 0; i < count; i++) users[i].ok = 0;
+            created = 0;
+        }
+    }
+    ulckpwdf();
+    phase_end(PH_USERADD, &t);
+    free(groups);
+    free(pw); free(sp); free(gr); free(gs);
+
+    if (created) {
+        long umask_val = login_defs_long("UMASK", 022);
+        mode_t mode = login_defs_long("HOME_MODE", 0777 & ~umask_val) & 07777;
+        JobGroup *g = job_group_new();
+        if (!g) return created;
+        snprintf(g->desc, sizeof(g->desc), "домашние каталоги: %zu", created);
+        for (size_t i = 0; i < count; i++) {
+            if (!users[i].ok) continue;
+            if (created == 1) snprintf(g->desc, sizeof(g->desc), "домашний каталог %s", users[i].home);
+            Job *j = calloc(1, sizeof(Job));
+            if (!j) continue;
+            j->kind = JOB_HOME;
+            j->user = users[i];
+            j->mode = mode;
+            job_submit(g, j);
+        }
+        *job = job_group_close(g);
+    }
+    return created;
+}
+
+// В VFS появились каталоги без пользователей: создаём их одной транзакцией (ТОЛЬКО под root)
+void vfs_user_dirs_added(const NameList *dirs) {
+    if (geteuid() != 0 || dirs->count == 0 || !accounts_writable()) return;
+
+    NewUser *users = calloc(dirs->count, sizeof(NewUser));
+    if (!users) return;
+    size_t n = 0;
+    for (size_t i = 0; i < dirs->count; i++) {
+        if (!user_index_by_name(dirs->items[i])) users[n++].name = dirs->items[i];
+    }
+    int job;
+    // Один каталог — обычный useradd; пачка — одной транзакцией
+    if (n == 1) {
+        const UserRecord *u = add_user_async(users[0].name, &job) == 0 ? user_index_by_name(users[0].name) : NULL;
+        if (u) create_user_vfs_entry(u);
+    } else if (provision_users(users, n, &job)) {
+        user_index_refresh();
+        for (size_t i = 0; i < n; i++) {
+            const UserRecord *u = users[i].ok ? user_index_by_name(users[i].name) : NULL;
+            if (u) create_user_vfs_entry(u);
+        }
+    }
+    free(users);
+}
+
+// Из VFS пропал каталог: удаляем пользователя (ТОЛЬКО под root).
+// Удаляем только обычных пользователей с shell на *sh, root и системные аккаунты не трогаем.
+void vfs_user_dir_removed(const char *name) {
+    if (geteuid() != 0 || !accounts_writable()) return;
+    const UserRecord *u = user_index_by_name(name);
+    if (!u || u->uid < 1000 || !u->sh) return;
+    remove_user_async(name);
+}
+
+// 🔁 Синхронизация VFS с системой.
+// Индекс пользователей и снимок VFS перечитываются только при изменении файла/каталога,
+// дальше применяется лишь разница: без изменений это два вызова stat().
+void sync_vfs_with_system() {
+    // В режиме FUSE VFS вычисляется из passwd при каждом обращении — синхронизировать нечего
+    if (fuse_mode) return;
+    PhaseTimer t;
+    phase_begin(&t);
+    user_index_refresh();
+    if (vfs_snapshot_refresh(&pending_dirs_added, &pending_dirs_removed) == -1) {
+        user_set_free(&vfs_snapshot);
+        vfs_snapshot_valid = 0;
+        name_list_free(&pending_dirs_added);
+        name_list_free(&pending_dirs_removed);
+        create_users_vfs();
+    }
+
+    // 1. Если каталог есть, но пользователя нет — создаём (все сразу — одной транзакцией)
+    vfs_user_dirs_added(&pending_dirs_added);
+    // 2. Если каталог пропал, а пользователь (UID>=1000) есть — удаляем пользователя
+    for (size_t i = 0; i < pending_dirs_removed.count; i++) {
+        vfs_user_dir_removed(pending_dirs_removed.items[i]);
+    }
+    name_list_free(&pending_dirs_added);
+    name_list_free(&pending_dirs_removed);
+
+    // Шаги 1-2 сами обновляют индекс, поэтому изменения passwd забираем после них
+    NameList added = pending_users_added;
+    NameList changed = pending_users_changed;
+    NameList removed = pending_users_removed;
+    memset(&pending_users_added, 0, sizeof(NameList));
+    memset(&pending_users_changed, 0, sizeof(NameList));
+    memset(&pending_users_removed, 0, sizeof(NameList));
+
+    // 3. Новые пользователи получают каталог, изменённые — обновлённые файлы
+    for (size_t i = 0; i < added.count + changed.count; i++) {
+        int is_new = i < added.count;
+        const char *name = is_new ? added.items[i] : changed.items[i - added.count];
+        const UserRecord *u = user_index_by_name(name);
+        if (!u || !u->sh) continue;
+        if (is_new && user_set_find(&vfs_snapshot, name)) continue;
+        create_user_vfs_entry(u);
+    }
+    // 4. Удалённые из системы пользователи пропадают из VFS
+    for (size_t i = 0; i < removed.count; i++) {
+        if (user_set_find(&vfs_snapshot, removed.items[i])) {
+            remove_user_vfs_entry(removed.items[i]);
+        }
+    }
+
+    name_list_free(&added);
+    name_list_free(&changed);
+    name_list_free(&removed);
+    vfs_manifest_save();
+    phase_end(PH_SYNC, &t);
+}
+
+// --- Отслеживание изменений через inotify ---
+// Следим за корнем VFS (появление/удаление каталогов пользователей)
+// и за каталогом /etc (замена /etc/passwd через rename в useradd/userdel).
+// Если inotify недоступен (или sync = poll) — опрос раз в sync_interval мс.
+
+int vfs_watch_fd = -1;
+int vfs_watch_wd = -1;
+int passwd_watch_wd = -1;
+
+void vfs_watch_close() {
+    if (vfs_watch_fd != -1) close(vfs_watch_fd);
+    vfs_watch_fd = vfs_watch_wd = passwd_watch_wd = -1;
+}
+
+int vfs_watch_init() {
+    vfs_watch_close();
+    vfs_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (vfs_watch_fd == -1) return -1;
+
+    vfs_watch_wd = inotify_add_watch(vfs_watch_fd, get_users_dir_path(),
+                                     IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    // Каталог, а не сам файл: useradd подменяет passwd через rename
+    char passwd_dir[PATH_MAX];
+    snprintf(passwd_dir, sizeof(passwd_dir), "%s", config.passwd_file);
+    char *slash = strrchr(passwd_dir, '/');
+    if (slash) *slash = '\0';
+    passwd_watch_wd = inotify_add_watch(vfs_watch_fd, slash && *passwd_dir ? passwd_dir : slash ? "/" : ".",
+                                        IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (vfs_watch_wd == -1 || passwd_watch_wd == -1) {
+        vfs_watch_close();
+        return -1;
+    }
+    return 0;
+}
+
+// Разбор накопившихся событий. Каталоги пользователей сразу вносятся в снимок VFS,
+// поэтому повторно читать корень VFS не нужно; /etc/passwd проверяется по stat().
+void vfs_watch_handle() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int rewatch = 0;
+    int root_fd = k_open(get_users_dir_path(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    while (1) {
+        ssize_t len = read(vfs_watch_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) continue;
+            break;
+        }
+
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            count_event(CNT_INOTIFY);
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                vfs_snapshot_valid = 0;
+            } else if (ev->wd == vfs_watch_wd) {
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    rewatch = 1;
+                } else if (ev->len && (ev->mask & IN_ISDIR) && vfs_snapshot_valid) {
+                    // Собственные mkdir/rmdir kubsh уже отражены в снимке и здесь отсеиваются.
+                    // События могут устареть (каталог создан и уже удалён), поэтому
+                    // наличие каталога сверяется с тем, что есть на диске сейчас.
+                    struct stat st;
+                    int exists = root_fd != -1 && k_fstatat(root_fd, ev->name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+                    if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && exists) {
+                        if (!user_set_find(&vfs_snapshot, ev->name)) {
+                            user_set_add(&vfs_snapshot, ev->name);
+                            name_list_push(&pending_dirs_added, ev->name);
+                        }
+                    } else if ((ev->mask & (IN_DELETE | IN_MOVED_FROM)) && !exists) {
+                        if (user_set_find(&vfs_snapshot, ev->name)) {
+                            user_set_remove(&vfs_snapshot, ev->name);
+                            name_list_push(&pending_dirs_removed, ev->name);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (root_fd != -1) close(root_fd);
+
+    if (rewatch) {
+        // Корень VFS удалён или перемещён — каталоги пропали вместе с ним,
+        // пользователей не трогаем: пересоздаём VFS и ставим наблюдение заново
+        name_list_free(&pending_dirs_removed);
+        user_set_free(&vfs_snapshot);
+        vfs_snapshot_valid = 0;
+        create_users_vfs();
+        if (vfs_watch_init() == -1) return;
+    } else if (vfs_snapshot_valid) {
+        // Все изменения до этого момента либо уже прочитаны, либо ещё в очереди
+        struct stat st;
+        if (k_stat(get_users_dir_path(), &st) == 0) vfs_stamp = st.st_mtim;
+    }
+    sync_vfs_with_system();
+}
+
+// Команда: обновить VFS (с синхронизацией)
+void cmd_refresh_vfs() {
+    printf("Синхронизация VFS с системой...\n");
+    PhaseTimer t;
+    phase_begin(&t);
+    user_index_valid = 0;
+    vfs_snapshot_valid = 0;
+    sync_vfs_with_system();
+    // Полная сверка файлов с passwd: пишутся только отличающиеся
+    if (!fuse_mode) {
+        vfs_manifest_reset();
+        regenerate_users_vfs();
+    }
+    phase_end(PH_REFRESH, &t);
+    printf("VFS обновлён\n");
+}
+
+// --- \vfs: дерево каталога ---
+// Обход через openat/fdopendir, тип записи берётся из d_type (stat только для
+// DT_UNKNOWN), вывод идёт через OutBuf. По умолчанию
+// записи выводятся в порядке каталога, не дожидаясь конца чтения; -s сортирует
+// каждый каталог.
+
+typedef struct {
+    int max_depth;          // -L, 0 — без ограничения
+    long limit;             // -n, 0 — без ограничения
+    int sorted;             // -s
+    int all;                // -a: и скрытые (.kubsh_index)
+    long printed;
+    long dirs;
+    long files;
+    OutBuf out;
+} TreeWalk;
+
+typedef struct {
+    char *name;
+    unsigned char type;
+} TreeEntry;
+
+static void tree_put(TreeWalk *w, const char *s, size_t len) {
+    out_put(&w->out, s, len);
+}
+
+static int tree_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const TreeEntry *)a)->name, ((const TreeEntry *)b)->name);
+}
+
+static unsigned char tree_entry_type(int dfd, const struct dirent *e) {
+    if (e->d_type != DT_UNKNOWN) return e->d_type;
+    struct stat st;
+    if (k_fstatat(dfd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) return DT_UNKNOWN;
+    return S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+}
+
+static int tree_skip(const TreeWalk *w, const char *name) {
+    if (name[0] != '.') return 0;
+    return !w->all || !strcmp(name, ".") || !strcmp(name, "..");
+}
+
+static void tree_walk(TreeWalk *w, int dfd, char *prefix, size_t prefix_len, int depth);
+
+// Одна строка дерева; для каталога — спуск на уровень ниже
+static void tree_emit(TreeWalk *w, int dfd, const char *name, unsigned char type, int last,
+                      char *prefix, size_t prefix_len, int depth) {
+    if (w->limit && w->printed >= w->limit) return;
+    w->printed++;
+    tree_put(w, prefix, prefix_len);
+    tree_put(w, last ? "└── " : "├── ", strlen("├── "));
+    tree_put(w, name, strlen(name));
+    if (type == DT_LNK) {
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(dfd, name, target, sizeof(target));
+        if (n > 0) {
+            tree_put(w, " -> ", 4);
+            tree_put(w, target, n);
+        }
+    }
+    tree_put(w, "\n", 1);
+
+    if (type != DT_DIR) {
+        w->files++;
+        return;
+    }
+    w->dirs++;
+    if (w->max_depth && depth >= w->max_depth) return;
+    int sub = k_openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (sub == -1) return;
+    const char *pad = last ? "    " : "│   ";
+    size_t pad_len = strlen(pad);
+    if (prefix_len + pad_len < PATH_MAX) {
+        memcpy(prefix + prefix_len, pad, pad_len);
+        tree_walk(w, sub, prefix, prefix_len + pad_len, depth + 1);
+    }
+    close(sub);
+}
+
+static void tree_walk(TreeWalk *w, int dfd, char *prefix, size_t prefix_len, int depth) {
+    DIR *dir = fdopendir(dup(dfd));
+    if (!dir) return;
+    struct dirent *e;
+
+    if (w->sorted) {
+        TreeEntry *items = NULL;
+        size_t count = 0, cap = 0;
+        while ((e = readdir(dir))) {
+            if (tree_skip(w, e->d_name)) continue;
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                TreeEntry *grown = realloc(items, cap * sizeof(TreeEntry));
+                if (!grown) break;
+                items = grown;
+            }
+            items[count].name = strdup(e->d_name);
+            items[count].type = tree_entry_type(dfd, e);
+            count++;
+        }
+        closedir(dir);
+        qsort(items, count, sizeof(TreeEntry), tree_entry_cmp);
+        for (size_t i = 0; i < count; i++) {
+            tree_emit(w, dfd, items[i].name, items[i].type, i + 1 == count, prefix, prefix_len, depth);
+            free(items[i].name);
+        }
+        free(items);
+        return;
+    }
+
+    // Потоковый режим: одна запись вперёд, чтобы знать, последняя ли текущая
+    char name[NAME_MAX + 1];
+    unsigned char type = 0;
+    int have = 0;
+    while ((e = readdir(dir))) {
+        if (tree_skip(w, e->d_name)) continue;
+        if (have) tree_emit(w, dfd, name, type, 0, prefix, prefix_len, depth);
+        snprintf(name, sizeof(name), "%s", e->d_name);
+        type = tree_entry_type(dfd, e);
+        have = 1;
+        if (w->limit && w->printed >= w->limit) break;
+    }
+    closedir(dir);
+    if (have) tree_emit(w, dfd, name, type, 1, prefix, prefix_len, depth);
+}
+
+// \vfs [-L глубина] [-n число] [-s] [-a]
+void cmd_show_vfs(int argc, char **argv) {
+    TreeWalk *w = calloc(1, sizeof(TreeWalk));
+    if (!w) return;
+    w->max_depth = 2;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) w->sorted = 1;
+        else if (strcmp(argv[i], "-a") == 0) w->all = 1;
+        else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) w->max_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) w->limit = atol(argv[++i]);
+        else {
+            printf("Использование: \\vfs [-L глубина] [-n число] [-s] [-a]\n");
+            free(w);
+            return;
+        }
+    }
+
+    char *users_dir = get_users_dir_path();
+    printf("Структура VFS в %s:\n", users_dir);
+    printf("==========================================\n");
+    int dfd = k_open(users_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1) {
+        printf("Ошибка открытия %s: %s\n", users_dir, strerror(errno));
+        free(w);
+        return;
+    }
+
+    char prefix[PATH_MAX];
+    tree_put(w, users_dir, strlen(users_dir));
+    tree_put(w, "\n", 1);
+    tree_walk(w, dfd, prefix, 0, 1);
+    close(dfd);
+    out_flush(&w->out);
+    if (w->limit && w->printed >= w->limit) printf("... вывод ограничен %ld записями\n", w->limit);
+    printf("\n%ld directories, %ld files\n", w->dirs, w->files);
+    free(w);
+}
+
+// --- Блочные устройства ---
+// \l разбирает всё сам: список устройств и разделов — из /sys/class/block,
+// таблицу разделов (MBR с расширенными разделами или GPT) — прямо с устройства
+// или из файла-образа, заполненность — statfs() точек монтирования из
+// /proc/self/mountinfo (сопоставление по major:minor). Вывод таблицы повторяет
+// fdisk -l. \l -m — машиночитаемый вариант; он кэшируется и пересчитывается,
+// только если изменились /proc/partitions, таблица монтирования или сам образ.
+
+#define SYSFS_BLOCK "/sys/class/block"
+#define MAX_PARTITIONS 128
+
+typedef struct {
+    unsigned num;
+    uint64_t start;
+    uint64_t sectors;
+    int boot;
+    unsigned char mbr_type;   // 0 для GPT
+    char type[64];
+} PartEntry;
+
+typedef struct {
+    char label[8];            // dos / gpt
+    char id[40];
+    int count;
+    PartEntry parts[MAX_PARTITIONS];
+} PartTable;
+
+static uint32_t get_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static uint32_t crc32_buf(const unsigned char *p, size_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// GUID в GPT хранится смешанно: первые три поля — little-endian
+static void format_guid(const unsigned char *g, char *out, size_t size) {
+    snprintf(out, size, "%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+             get_le32(g), g[4] | g[5] << 8, g[6] | g[7] << 8,
+             g[8], g[9], g[10], g[11], g[12], g[13], g[14], g[15]);
+}
+
+static const char *gpt_type_name(const char *guid) {
+    static const struct { const char *guid, *name; } types[] = {
+        { "C12A7328-F81F-11D2-BA4B-00A0C93EC93B", "EFI System" },
+        { "21686148-6449-6E6F-744E-656564454649", "BIOS boot" },
+        { "0FC63DAF-8483-4772-8E79-3D69D8477DE4", "Linux filesystem" },
+        { "4F68BCE3-E8CD-4DB1-96E7-FBCAF984B709", "Linux root (x86-64)" },
+        { "BC13C2FF-59E6-4262-A352-B275FD6F7172", "Linux extended boot" },
+        { "0657FD6D-A4AB-43C4-84E5-0933C84B4F4F", "Linux swap" },
+        { "E6D6D379-F507-44C2-A23C-238F2A3DF928", "Linux LVM" },
+        { "A19D880F-05FC-4D3B-A006-743F0F84911E", "Linux RAID" },
+        { "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", "Microsoft basic data" },
+        { "E3C9E316-0B5C-4DB8-817D-F92DF00215AE", "Microsoft reserved" },
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcmp(types[i].guid, guid) == 0) return types[i].name;
+    }
+    return guid;
+}
+
+static const char *mbr_type_name(unsigned char type) {
+    switch (type) {
+    case 0x05: return "Extended";
+    case 0x07: return "HPFS/NTFS/exFAT";
+    case 0x0b: return "W95 FAT32";
+    case 0x0c: return "W95 FAT32 (LBA)";
+    case 0x0f: return "W95 Ext'd (LBA)";
+    case 0x82: return "Linux swap / Solaris";
+    case 0x83: return "Linux";
+    case 0x85: return "Linux extended";
+    case 0x8e: return "Linux LVM";
+    case 0xee: return "GPT";
+    case 0xef: return "EFI (FAT-12/16/32)";
+    case 0xfd: return "Linux raid autodetect";
+    default: return "Unknown";
+    }
+}
+
+static int mbr_is_extended(unsigned char type) {
+    return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+static int read_gpt(int fd, unsigned sector, uint64_t total, PartTable *t) {
+    unsigned char *hdr = malloc(sector);
+    if (!hdr) return -1;
+    // Основной заголовок в LBA 1, резервный — в последнем секторе
+    uint64_t lbas[2] = { 1, total ? total - 1 : 0 };
+    int valid = 0;
+    for (int i = 0; i < 2 && !valid && lbas[i]; i++) {
+        if (pread(fd, hdr, sector, lbas[i] * sector) != (ssize_t)sector) continue;
+        uint32_t hsize = get_le32(hdr + 12);
+        if (memcmp(hdr, "EFI PART", 8) != 0 || hsize < 92 || hsize > sector) continue;
+        uint32_t crc = get_le32(hdr + 16);
+        memset(hdr + 16, 0, 4);
+        valid = crc32_buf(hdr, hsize) == crc;
+    }
+    if (!valid) {
+        free(hdr);
+        return -1;
+    }
+
+    strcpy(t->label, "gpt");
+    format_guid(hdr + 56, t->id, sizeof(t->id));
+    uint64_t entries_lba = get_le64(hdr + 72);
+    uint32_t nentries = get_le32(hdr + 80), esize = get_le32(hdr + 84);
+    free(hdr);
+    if (esize < 128 || esize > 4096 || nentries > 1024) return -1;
+
+    size_t len = (size_t)nentries * esize;
+    unsigned char *ents = malloc(len);
+    if (!ents || pread(fd, ents, len, entries_lba * sector) != (ssize_t)len) {
+        free(ents);
+        return -1;
+    }
+    static const unsigned char zero[16];
+    for (uint32_t i = 0; i < nentries && t->count < MAX_PARTITIONS; i++) {
+        const unsigned char *e = ents + (size_t)i * esize;
+        if (memcmp(e, zero, 16) == 0) continue;
+        PartEntry *p = &t->parts[t->count++];
+        memset(p, 0, sizeof(*p));
+        p->num = i + 1;
+        p->start = get_le64(e + 32);
+        p->sectors = get_le64(e + 40) - p->start + 1;
+        char guid[40];
+        format_guid(e, guid, sizeof(guid));
+        snprintf(p->type, sizeof(p->type), "%s", gpt_type_name(guid));
+    }
+    free(ents);
+    return 0;
+}
+
+// Таблица разделов устройства или образа; -1, если её нет или прочитать нельзя
+int read_partition_table(int fd, unsigned sector, uint64_t total, PartTable *t) {
+    unsigned char mbr[512];
+    memset(t, 0, sizeof(*t));
+    if (pread(fd, mbr, sizeof(mbr), 0) != sizeof(mbr) || mbr[510] != 0x55 || mbr[511] != 0xAA) {
+        return -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (mbr[446 + i * 16 + 4] == 0xEE) return read_gpt(fd, sector, total, t);
+    }
+
+    strcpy(t->label, "dos");
+    snprintf(t->id, sizeof(t->id), "0x%08x", get_le32(mbr + 440));
+    uint64_t ext_base = 0;
+    for (int i = 0; i < 4; i++) {
+        const unsigned char *e = mbr + 446 + i * 16;
+        if (e[4] == 0) continue;
+        PartEntry *p = &t->parts[t->count++];
+        memset(p, 0, sizeof(*p));
+        p->num = i + 1;
+        p->boot = e[0] == 0x80;
+        p->mbr_type = e[4];
+        p->start = get_le32(e + 8);
+        p->sectors = get_le32(e + 12);
+        snprintf(p->type, sizeof(p->type), "%s", mbr_type_name(e[4]));
+        if (mbr_is_extended(e[4]) && !ext_base) ext_base = p->start;
+    }
+
+    // Логические разделы: цепочка EBR внутри расширенного раздела
+    uint64_t ebr = ext_base;
+    for (unsigned num = 5; ebr && t->count < MAX_PARTITIONS && num < 5 + MAX_PARTITIONS; num++) {
+        unsigned char buf[512];
+        if (pread(fd, buf, sizeof(buf), ebr * sector) != sizeof(buf) ||
+            buf[510] != 0x55 || buf[511] != 0xAA) break;
+        const unsigned char *e = buf + 446;
+        if (e[4]) {
+            PartEntry *p = &t->parts[t->count++];
+            memset(p, 0, sizeof(*p));
+            p->num = num;
+            p->boot = e[0] == 0x80;
+            p->mbr_type = e[4];
+            p->start = ebr + get_le32(e + 8);
+            p->sectors = get_le32(e + 12);
+            snprintf(p->type, sizeof(p->type), "%s", mbr_type_name(e[4]));
+        }
+        uint64_t next = get_le32(e + 16 + 8);
+        if (!next || ext_base + next <= ebr) break;
+        ebr = ext_base + next;
+    }
+    return 0;
+}
+
+// Размер как у fdisk/lsblk: 512M, 1.5G
+static void format_size(uint64_t bytes, char *out, size_t size) {
+    static const char units[] = "BKMGTPE";
+    double v = bytes;
+    int u = 0;
+    while (v >= 1024 && u < 6) { v /= 1024; u++; }
+    if (u == 0) snprintf(out, size, "%lluB", (unsigned long long)bytes);
+    else if (v < 10 && v != (uint64_t)v) snprintf(out, size, "%.1f%c", v, units[u]);
+    else snprintf(out, size, "%.0f%c", v, units[u]);
+}
+
+static int sysfs_read(const char *name, const char *attr, char *buf, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), SYSFS_BLOCK "/%s/%s", name, attr);
+    int fd = k_open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+static uint64_t sysfs_u64(const char *name, const char *attr) {
+    char buf[64];
+    return sysfs_read(name, attr, buf, sizeof(buf)) == 0 ? strtoull(buf, NULL, 10) : 0;
+}
+
+// Имя блочного устройства в sysfs по его номеру (/sys/dev/block/M:m → vda1)
+static int sysfs_name_of(dev_t rdev, char *out, size_t size) {
+    char link[PATH_MAX], target[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(rdev), minor(rdev));
+    ssize_t n = readlink(link, target, sizeof(target) - 1);
+    if (n <= 0) return -1;
+    target[n] = '\0';
+    snprintf(out, size, "%s", strrchr(target, '/') + 1);
+    return 0;
+}
+
+// Точки монтирования из /proc/self/mountinfo
+typedef struct {
+    unsigned major, minor;
+    char point[PATH_MAX];
+    char source[PATH_MAX];
+    char fstype[32];
+} MountEntry;
+
+// Вызывает fn для каждого монтирования устройства major:minor (minor < 0 — любого)
+static void for_each_mount(unsigned maj, int min, void (*fn)(const MountEntry *, void *), void *arg) {
+    FILE *f = k_fopen("/proc/self/mountinfo", "re");
+    if (!f) return;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) > 0) {
+        MountEntry m;
+        char point[PATH_MAX];
+        // id parent major:minor root point options ... - fstype source
+        if (sscanf(line, "%*d %*d %u:%u %*s %4095s", &m.major, &m.minor, point) != 3) continue;
+        if (m.major != maj || (min >= 0 && m.minor != (unsigned)min)) continue;
+        char *sep = strstr(line, " - ");
+        if (!sep || sscanf(sep + 3, "%31s %4095s", m.fstype, m.source) != 2) continue;
+        // Пробелы и спецсимволы в пути экранированы как \040
+        char *o = m.point;
+        for (const char *p = point; *p; p++) {
+            if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3' && p[2] && p[3]) {
+                *o++ = (char)((p[1] - '0') * 64 + (p[2] - '0') * 8 + (p[3] - '0'));
+                p += 3;
+            } else {
+                *o++ = *p;
+            }
+        }
+        *o = '\0';
+        fn(&m, arg);
+    }
+    free(line);
+    fclose(f);
+}
+
+// Поля записей \l -m: у каждого вида записи (record: block, disk, part, mount)
+// заполнена только часть из них
+enum { BLK_RECORD, BLK_DEVICE, BLK_DEVNO, BLK_TYPE, BLK_NUMBER, BLK_START, BLK_END, BLK_SECTORS,
+       BLK_SIZE, BLK_SECTOR_SIZE, BLK_USED, BLK_AVAIL, BLK_FSTYPE, BLK_MOUNTPOINT, BLK_NCOLS };
+static const char *const blk_columns[BLK_NCOLS] = {
+    "record", "device", "devno", "type", "number", "start", "end", "sectors",
+    "size", "sector_size", "used", "avail", "fstype", "mountpoint"
+};
+
+static void emit_block(Emitter *em, const char *name, const char *devno, const char *type,
+                       uint64_t bytes, const char *point) {
+    char dev[NAME_MAX + 8];
+    snprintf(dev, sizeof(dev), "/dev/%s", name);
+    emit_str(em, BLK_RECORD, "block");
+    emit_str(em, BLK_DEVICE, dev);
+    emit_str(em, BLK_DEVNO, devno);
+    emit_str(em, BLK_TYPE, type);
+    emit_num(em, BLK_SIZE, bytes);
+    emit_str(em, BLK_MOUNTPOINT, *point ? point : NULL);
+    emit_end(em);
+}
+
+typedef struct {
+    FILE *out;
+    Emitter *em;         // структурированный вывод (\l -m, --format); NULL — текст
+    int found;
+} MountReport;
+
+static void report_mount(const MountEntry *m, void *arg) {
+    MountReport *r = arg;
+    struct statvfs vfs;
+    if (statvfs(m->point, &vfs) == -1) return;
+    uint64_t total = (uint64_t)vfs.f_blocks * vfs.f_frsize;
+    uint64_t avail = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+    uint64_t used = total - (uint64_t)vfs.f_bfree * vfs.f_frsize;
+    if (r->em) {
+        char devno[32];
+        snprintf(devno, sizeof(devno), "%u:%u", m->major, m->minor);
+        emit_str(r->em, BLK_RECORD, "mount");
+        emit_str(r->em, BLK_DEVICE, m->source);
+        emit_str(r->em, BLK_DEVNO, devno);
+        emit_num(r->em, BLK_SIZE, total);
+        emit_num(r->em, BLK_USED, used);
+        emit_num(r->em, BLK_AVAIL, avail);
+        emit_str(r->em, BLK_FSTYPE, m->fstype);
+        emit_str(r->em, BLK_MOUNTPOINT, m->point);
+        emit_end(r->em);
+    } else {
+        char s[16], u[16], a[16];
+        format_size(total, s, sizeof(s));
+        format_size(used, u, sizeof(u));
+        format_size(avail, a, sizeof(a));
+        unsigned pct = used + avail ? (unsigned)((used * 100 + used + avail - 1) / (used + avail)) : 0;
+        if (!r->found) {
+            // Колонки как у df -hT
+            fprintf(r->out, "%-20s %-8s %6s %6s %6s %4s %s\n",
+                    "Filesystem", "Type", "Size", "Used", "Avail", "Use%", "Mounted on");
+        }
+        fprintf(r->out, "%-20s %-8s %6s %6s %6s %3u%% %s\n", m->source, m->fstype, s, u, a, pct, m->point);
+    }
+    r->found++;
+}
+
+static void first_mount(const MountEntry *m, void *arg) {
+    char *point = arg;
+    if (!*point) snprintf(point, PATH_MAX, "%s", m->point);
+}
+
+// Разделы устройства из sysfs: подкаталоги с файлом partition
+static void list_sysfs_partitions(const char *disk, FILE *out, Emitter *em) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), SYSFS_BLOCK "/%s", disk);
+    DIR *dir = k_opendir(path);
+    if (!dir) return;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (strncmp(e->d_name, disk, strlen(disk)) != 0) continue;
+        char attr[NAME_MAX + 16];
+        snprintf(attr, sizeof(attr), "%s/partition", e->d_name);
+        char num[16];
+        if (sysfs_read(disk, attr, num, sizeof(num)) != 0) continue;
+
+        char dev[32], point[PATH_MAX] = "";
+        if (sysfs_read(e->d_name, "dev", dev, sizeof(dev)) != 0) continue;
+        unsigned maj, min;
+        if (sscanf(dev, "%u:%u", &maj, &min) != 2) continue;
+        for_each_mount(maj, min, first_mount, point);
+        uint64_t bytes = sysfs_u64(e->d_name, "size") * 512;
+        if (em) {
+            emit_block(em, e->d_name, dev, "part", bytes, point);
+        } else {
+            char s[16];
+            format_size(bytes, s, sizeof(s));
+            fprintf(out, "%-16s %8s %-6s %s\n", e->d_name, s, "part", point);
+        }
+    }
+    closedir(dir);
+}
+
+// Все диски (не разделы) из sysfs; пустые loop и ram пропускаются
+static void list_block_devices(FILE *out, Emitter *em) {
+    DIR *dir = k_opendir(SYSFS_BLOCK);
+    if (!dir) return;
+    if (!em) fprintf(out, "%-16s %8s %-6s %s\n", "NAME", "SIZE", "TYPE", "MOUNTPOINT");
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (e->d_name[0] == '.') continue;
+        char buf[16];
+        if (sysfs_read(e->d_name, "partition", buf, sizeof(buf)) == 0) continue;
+        uint64_t bytes = sysfs_u64(e->d_name, "size") * 512;
+        if (bytes == 0) continue;
+
+        char dev[32], point[PATH_MAX] = "";
+        unsigned maj, min;
+        if (sysfs_read(e->d_name, "dev", dev, sizeof(dev)) == 0 && sscanf(dev, "%u:%u", &maj, &min) == 2) {
+            for_each_mount(maj, min, first_mount, point);
+        }
+        const char *type = strncmp(e->d_name, "loop", 4) == 0 ? "loop" : "disk";
+        if (em) {
+            emit_block(em, e->d_name, dev, type, bytes, point);
+        } else {
+            char s[16];
+            format_size(bytes, s, sizeof(s));
+            fprintf(out, "%-16s %8s %-6s %s\n", e->d_name, s, type, point);
+        }
+        list_sysfs_partitions(e->d_name, out, em);
+    }
+    closedir(dir);
+}
+
+// Имя раздела: sda + 1 → sda1, nvme0n1 + 1 → nvme0n1p1
+static void partition_path(const char *disk, unsigned num, char *out, size_t size) {
+    size_t len = strlen(disk);
+    int digit = len && disk[len - 1] >= '0' && disk[len - 1] <= '9';
+    snprintf(out, size, "%s%s%u", disk, digit ? "p" : "", num);
+}
+
+static void print_partition_table(const char *path, const PartTable *t, unsigned sector, FILE *out, Emitter *em) {
+    if (em) {
+        for (int i = 0; i < t->count; i++) {
+            const PartEntry *p = &t->parts[i];
+            char dev[PATH_MAX];
+            partition_path(path, p->num, dev, sizeof(dev));
+            emit_str(em, BLK_RECORD, "part");
+            emit_str(em, BLK_DEVICE, dev);
+            emit_str(em, BLK_TYPE, p->type);
+            emit_num(em, BLK_NUMBER, p->num);
+            emit_num(em, BLK_START, p->start);
+            emit_num(em, BLK_END, p->start + p->sectors - 1);
+            emit_num(em, BLK_SECTORS, p->sectors);
+            emit_num(em, BLK_SIZE, p->sectors * sector);
+            emit_end(em);
+        }
+        return;
+    }
+
+    fprintf(out, "Disklabel type: %s\nDisk identifier: %s\n", t->label, t->id);
+    if (t->count == 0) return;
+    int dos = strcmp(t->label, "dos") == 0;
+    fprintf(out, "\n%-16s%s %10s %10s %10s %6s %s%s\n", "Device", dos ? " Boot" : "", "Start", "End",
+            "Sectors", "Size", dos ? "Id " : "", "Type");
+    for (int i = 0; i < t->count; i++) {
+        const PartEntry *p = &t->parts[i];
+        char dev[PATH_MAX], size[16], id[8] = "";
+        partition_path(path, p->num, dev, sizeof(dev));
+        format_size(p->sectors * sector, size, sizeof(size));
+        if (dos) snprintf(id, sizeof(id), "%02x ", p->mbr_type);
+        fprintf(out, "%-16s%s %10llu %10llu %10llu %6s %s%s\n", dev, dos ? (p->boot ? " *   " : "     ") : "",
+                (unsigned long long)p->start, (unsigned long long)(p->start + p->sectors - 1),
+                (unsigned long long)p->sectors, size, id, p->type);
+    }
+}
+
+// Сведения об устройстве или образе; -1, если его нет
+static int describe_device(const char *dev_path, FILE *out, Emitter *em) {
+    struct stat st;
+    if (k_stat(dev_path, &st) == -1) return -1;
+
+    unsigned sector = 512;
+    uint64_t bytes = 0;
+    char name[NAME_MAX + 1] = "";
+    int is_block = S_ISBLK(st.st_mode);
+    if (is_block) {
+        sysfs_name_of(st.st_rdev, name, sizeof(name));
+        bytes = sysfs_u64(name, "size") * 512;
+        uint64_t lbs = sysfs_u64(name, "queue/logical_block_size");
+        if (lbs >= 512) sector = lbs;
+    } else if (S_ISREG(st.st_mode)) {
+        bytes = st.st_size;
+    }
+
+    if (em) {
+        emit_str(em, BLK_RECORD, "disk");
+        emit_str(em, BLK_DEVICE, dev_path);
+        emit_num(em, BLK_SIZE, bytes);
+        emit_num(em, BLK_SECTOR_SIZE, sector);
+        emit_end(em);
+    } else {
+        char s[16];
+        format_size(bytes, s, sizeof(s));
+        // Как у fdisk -l: "Disk /dev/sda: 256 GiB, ..."
+        size_t n = strlen(s);
+        char unit[4] = { s[n - 1], 'i', 'B', '\0' };
+        if (s[n - 1] == 'B') unit[1] = '\0';
+        fprintf(out, "Disk %s: %.*s %s, %llu bytes, %llu sectors\n", dev_path, (int)n - 1, s, unit,
+                (unsigned long long)bytes, (unsigned long long)(bytes / sector));
+        fprintf(out, "Units: sectors of 1 * %u = %u bytes\n", sector, sector);
+    }
+
+    // Таблицу разделов читаем с самого устройства/образа (для устройства нужны права)
+    int fd = k_open(dev_path, O_RDONLY | O_CLOEXEC);
+    PartTable *t = malloc(sizeof(PartTable));
+    if (fd == -1) {
+        if (!em) fprintf(out, "Таблица разделов недоступна: %s\n", strerror(errno));
+    } else if (t && read_partition_table(fd, sector, bytes / sector, t) == 0) {
+        print_partition_table(dev_path, t, sector, out, em);
+    } else if (!em) {
+        fprintf(out, "Таблица разделов не найдена\n");
+    }
+    free(t);
+    if (fd != -1) close(fd);
+
+    if (!is_block) return 0;
+    if (!em) fprintf(out, "\n--- Разделы ---\n%-16s %8s %-6s %s\n", "NAME", "SIZE", "TYPE", "MOUNTPOINT");
+    if (*name) list_sysfs_partitions(name, out, em);
+
+    if (!em) fprintf(out, "\n--- Файловые системы ---\n");
+    MountReport r = { out, em, 0 };
+    for_each_mount(major(st.st_rdev), minor(st.st_rdev), report_mount, &r);
+    // Разделы диска: у них тот же major (у nvme/mmc — extended minor, ищем по sysfs)
+    if (*name) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), SYSFS_BLOCK "/%s", name);
+        DIR *dir = k_opendir(path);
+        struct dirent *e;
+        while (dir && (e = readdir(dir))) {
+            char dev[32];
+            unsigned maj, min;
+            if (strncmp(e->d_name, name, strlen(name)) != 0 ||
+                sysfs_read(e->d_name, "dev", dev, sizeof(dev)) != 0 ||
+                sscanf(dev, "%u:%u", &maj, &min) != 2) continue;
+            for_each_mount(maj, min, report_mount, &r);
+        }
+        if (dir) closedir(dir);
+    }
+    if (!r.found && !em) fprintf(out, "Нет примонтированных разделов\n");
+    return 0;
+}
+
+// Кэш структурированного вывода: ключ — устройство и формат; сбрасывается, если изменились
+// /proc/partitions, таблица монтирования (poll() на mountinfo) или сам файл
+static struct {
+    char key[PATH_MAX];
+    int format;
+    char *text;
+    size_t len;
+    char partitions[4096];
+    struct timespec mtime;
+    off_t size;
+    int mounts_fd;
+} blk_cache = { .mounts_fd = -1 };
+
+static int blk_cache_valid(const char *key, const char *partitions, const struct stat *st) {
+    if (!blk_cache.text || strcmp(blk_cache.key, key) != 0 || blk_cache.format != output_format) return 0;
+    if (strcmp(blk_cache.partitions, partitions) != 0) return 0;
+    if (st && (st->st_mtim.tv_sec != blk_cache.mtime.tv_sec ||
+               st->st_mtim.tv_nsec != blk_cache.mtime.tv_nsec || st->st_size != blk_cache.size)) return 0;
+    // Ядро помечает mountinfo как POLLPRI при любом mount/umount
+    struct pollfd pfd = { blk_cache.mounts_fd, POLLPRI, 0 };
+    return blk_cache.mounts_fd != -1 && poll(&pfd, 1, 0) == 0;
+}
+
+static void list_partitions_records(const char *dev_path) {
+    char partitions[4096] = "";
+    int fd = k_open("/proc/partitions", O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        ssize_t n = read(fd, partitions, sizeof(partitions) - 1);
+        if (n > 0) partitions[n] = '\0';
+        close(fd);
+    }
+    struct stat st, *stp = NULL;
+    if (*dev_path && k_stat(dev_path, &st) == -1) {
+        fprintf(stderr, "Ошибка: устройство %s не найдено\n", dev_path);
+        return;
+    }
+    if (*dev_path && S_ISREG(st.st_mode)) stp = &st;
+
+    if (!blk_cache_valid(dev_path, partitions, stp)) {
+        // Сначала переоткрываем mountinfo: изменения во время сбора сбросят кэш
+        if (blk_cache.mounts_fd != -1) close(blk_cache.mounts_fd);
+        blk_cache.mounts_fd = k_open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+        char drain[4096];
+        while (blk_cache.mounts_fd != -1 && read(blk_cache.mounts_fd, drain, sizeof(drain)) > 0) {}
+
+        free(blk_cache.text);
+        blk_cache.text = NULL;
+        FILE *mem = open_memstream(&blk_cache.text, &blk_cache.len);
+        OutBuf *out = mem ? malloc(sizeof(OutBuf)) : NULL;
+        if (!out) {
+            if (mem) fclose(mem);
+            free(blk_cache.text);
+            blk_cache.text = NULL;
+            return;
+        }
+        out->sink = mem;
+        out->len = 0;
+        Emitter em;
+        emit_begin(&em, out, blk_columns, BLK_NCOLS);
+        if (*dev_path) describe_device(dev_path, NULL, &em);
+        else list_block_devices(NULL, &em);
+        out_flush(out);
+        free(out);
+        fclose(mem);
+        snprintf(blk_cache.key, sizeof(blk_cache.key), "%s", dev_path);
+        blk_cache.format = output_format;
+        snprintf(blk_cache.partitions, sizeof(blk_cache.partitions), "%s", partitions);
+        if (stp) {
+            blk_cache.mtime = stp->st_mtim;
+            blk_cache.size = stp->st_size;
+        }
+    }
+    fwrite(blk_cache.text, 1, blk_cache.len, stdout);
+}
+
+// \l [-m] [устройство|образ]; -m — записи в формате --format (по умолчанию TSV)
+void cmd_list_partitions(int argc, char **argv) {
+    int records = output_format != FMT_TEXT;
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "-m") == 0) {
+        records = 1;
+        i++;
+    }
+    const char *device = i < argc ? argv[i] : "";
+
+    // Разрешаем ввод без /dev/, например: \l sda. Файл с таким именем в текущем
+    // каталоге (\l disk.img) важнее устройства
+    char dev_path[PATH_MAX] = "";
+    struct stat st;
+    if (*device && (strchr(device, '/') || k_stat(device, &st) == 0)) {
+        snprintf(dev_path, sizeof(dev_path), "%s", device);
+    } else if (*device) {
+        snprintf(dev_path, sizeof(dev_path), "/dev/%s", device);
+    }
+
+    if (records) {
+        list_partitions_records(dev_path);
+        return;
+    }
+
+    if (!*dev_path) {
+        printf("Использование: \\l [-m] <устройство> (например, \\l /dev/sda или \\l disk.img)\n");
+        printf("Доступные устройства:\n");
+        list_block_devices(stdout, NULL);
+        return;
+    }
+
+    if (k_stat(dev_path, &st) == -1) {
+        printf("Ошибка: устройство %s не найдено\n", dev_path);
+        return;
+    }
+
+    printf("Информация о %s:\n", dev_path);
+    printf("==========================================\n");
+    describe_device(dev_path, stdout, NULL);
+}
+
+// --- История ---
+// Кольцевой буфер на history_cap команд поверх общего для всех сессий журнала.
+// Файл: заголовок HISTORY_MAGIC и записи [u32 длина][команда][u32 длина] — по
+// хвостовой длине журнал читается с конца, поэтому при запуске разбираются только
+// последние history_cap записей. Каждая команда дописывается одним writev() через
+// O_APPEND под разделяемой flock(); сжатие (перезапись последних записей через
+// временный файл и rename) идёт под исключительной. Сессия, державшая старый файл,
+// замечает подмену по inode и переоткрывает журнал — записи не теряются.
+// Для поиска у каждой команды хранится 64-битная сигнатура её биграмм: команды,
+// в которых заведомо нет всех биграмм запроса, отбрасываются без strstr().
+
+#define HISTORY_MAGIC "KUBSHH1\n"
+#define HISTORY_MAGIC_LEN 8
+#define HISTORY_MAX_RECORD (1 << 20)
+
+char **history;
+uint64_t *history_sig;
+size_t history_cap = 0;
+size_t history_start = 0;
+size_t history_count = 0;
+size_t history_bytes = 0;    // объём записей кольца в журнале
+int history_fd = -1;
+
+// i-я команда с начала истории
+const char *history_at(size_t i) {
+    return history[(history_start + i) % history_cap];
+}
+
+uint64_t history_signature(const char *s) {
+    uint64_t sig = 0;
+    for (; s[0] && s[1]; s++) {
+        sig |= 1ULL << (((unsigned char)s[0] * 31u + (unsigned char)s[1]) & 63);
+    }
+    return sig;
+}
+
+static void history_push(const char *line, size_t len) {
+    size_t slot;
+    if (history_count == history_cap) {
+        // Буфер полон — вытесняем самую старую
+        slot = history_start;
+        history_bytes -= strlen(history[slot]) + 8;
+        free(history[slot]);
+        history_start = (history_start + 1) % history_cap;
+    } else {
+        slot = (history_start + history_count++) % history_cap;
+    }
+    history[slot] = strndup(line, len);
+    history_sig[slot] = history_signature(history[slot]);
+    history_bytes += len + 8;
+}
+
+// Длина записи, которая заканчивается на end, или -1, если рамка повреждена
+static long history_frame_before(const char *data, size_t end) {
+    if (end < HISTORY_MAGIC_LEN + 8) return -1;
+    uint32_t len, head;
+    memcpy(&len, data + end - 4, 4);
+    if (len > HISTORY_MAX_RECORD || end - HISTORY_MAGIC_LEN < (size_t)len + 8) return -1;
+    memcpy(&head, data + end - 8 - len, 4);
+    return head == len ? (long)len : -1;
+}
+
+// Смещение начала не более чем cap последних записей; -1, если журнал повреждён
+static long history_tail(const char *data, size_t size, size_t cap) {
+    size_t pos = size;
+    for (size_t n = 0; pos > HISTORY_MAGIC_LEN && n < cap; n++) {
+        long len = history_frame_before(data, pos);
+        if (len < 0) return -1;
+        pos -= len + 8;
+    }
+    return pos;
+}
+
+static void history_frame_append(char **buf, size_t *len, size_t *cap, const char *s, uint32_t n) {
+    if (*len + n + 8 > *cap) {
+        *cap = (*len + n + 8) * 2;
+        char *p = realloc(*buf, *cap);
+        if (!p) { perror("realloc"); exit(1); }
+        *buf = p;
+    }
+    memcpy(*buf + *len, &n, 4);
+    memcpy(*buf + *len + 4, s, n);
+    memcpy(*buf + *len + 4 + n, &n, 4);
+    *len += n + 8;
+}
+
+// Открытый и заблокированный (op) дескриптор текущего журнала: если файл успели
+// подменить при сжатии, переоткрываем его
+static int history_lock(int *fd, int op, int flags) {
+    char *path = get_history_path();
+    for (int attempt = 0; attempt < 8; attempt++) {
+        if (*fd == -1) *fd = k_open(path, flags | O_CREAT | O_CLOEXEC, 0600);
+        if (*fd == -1) return -1;
+        while (flock(*fd, op) == -1) {
+            if (errno != EINTR) return -1;
+        }
+        struct stat a, b;
+        if (k_fstat(*fd, &a) == 0 && k_stat(path, &b) == 0 && a.st_ino == b.st_ino && a.st_dev == b.st_dev) {
+            return 0;
+        }
+        close(*fd);
+        *fd = -1;
+    }
+    return -1;
+}
+
+// Перезапись журнала под исключительной блокировкой (fd): остаются последние keep
+// записей. Старый текстовый формат (строка — команда) переводится в записи,
+// повреждённые участки пропускаются.
+static int history_rewrite(int fd, size_t keep) {
+    struct stat st;
+    if (k_fstat(fd, &st) == -1) return -1;
+    char *data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) return -1;
+    }
+
+    size_t size = st.st_size, len = HISTORY_MAGIC_LEN, cap = HISTORY_MAGIC_LEN + size + 64;
+    char *buf = malloc(cap);
+    if (!buf) {
+        if (data) munmap(data, size);
+        return -1;
+    }
+    memcpy(buf, HISTORY_MAGIC, HISTORY_MAGIC_LEN);
+    if (size >= HISTORY_MAGIC_LEN && memcmp(data, HISTORY_MAGIC, HISTORY_MAGIC_LEN) == 0) {
+        for (size_t pos = HISTORY_MAGIC_LEN; pos + 8 <= size; ) {
+            uint32_t n, tail;
+            memcpy(&n, data + pos, 4);
+            if (n <= HISTORY_MAX_RECORD && pos + 8 + n <= size &&
+                (memcpy(&tail, data + pos + 4 + n, 4), tail == n)) {
+                history_frame_append(&buf, &len, &cap, data + pos + 4, n);
+                pos += n + 8;
+            } else {
+                pos++;   // ищем следующую целую запись
+            }
+        }
+    } else {
+        for (const char *p = data, *end = data + size; p && p < end; ) {
+            const char *nl = memchr(p, '\n', end - p);
+            size_t n = (nl ? nl : end) - p;
+            if (n) history_frame_append(&buf, &len, &cap, p, n);
+            p += n + 1;
+        }
+    }
+    if (data) munmap(data, size);
+
+    long from = history_tail(buf, len, keep);
+    if (from < 0) from = HISTORY_MAGIC_LEN;
+
+    char tmp[PATH_MAX];
+    int tlen = snprintf(tmp, sizeof(tmp), "%s+", get_history_path());
+    if (tlen < 0 || (size_t)tlen >= sizeof(tmp)) {
+        free(buf);
+        return -1;
+    }
+    int out = k_open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int ok = out != -1 && write(out, buf, HISTORY_MAGIC_LEN) == HISTORY_MAGIC_LEN &&
+             write(out, buf + from, len - from) == (ssize_t)(len - from) && fsync(out) == 0;
+    if (out != -1) close(out);
+    free(buf);
+    if (!ok || rename(tmp, get_history_path()) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void history_compact() {
+    int fd = -1;
+    if (history_lock(&fd, LOCK_EX, O_RDONLY) == 0) history_rewrite(fd, history_cap);
+    if (fd != -1) close(fd);
+}
+
+// Ёмкость кольца: KUBSH_HISTSIZE, иначе history_size из конфигурации
+size_t history_capacity() {
+    char *env = getenv("KUBSH_HISTSIZE");
+    long cap = env ? atol(env) : 0;
+    return cap > 0 ? (size_t)cap : (size_t)config.history_size;
+}
+
+void load_history() {
+    if (!history_cap) history_cap = history_capacity();
+    history = calloc(history_cap, sizeof(char *));
+    history_sig = calloc(history_cap, sizeof(uint64_t));
+    if (!history || !history_sig) {
+        free(history);
+        free(history_sig);
+        history = NULL;
+        history_sig = NULL;
+        history_cap = 0;
+        return;
+    }
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        int fd = -1;
+        if (history_lock(&fd, LOCK_SH, O_RDONLY) == -1) {
+            if (fd != -1) close(fd);
+            return;
+        }
+        struct stat st;
+        char *data = MAP_FAILED;
+        if (k_fstat(fd, &st) == 0 && st.st_size > 0) {
+            data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        long from = -1;
+        if (data != MAP_FAILED && st.st_size >= HISTORY_MAGIC_LEN &&
+            memcmp(data, HISTORY_MAGIC, HISTORY_MAGIC_LEN) == 0) {
+            from = history_tail(data, st.st_size, history_cap);
+        }
+        if (from >= 0) {
+            // Читаем только хвост: не больше history_cap записей с конца
+            for (size_t pos = from; pos < (size_t)st.st_size; ) {
+                uint32_t n;
+                memcpy(&n, data + pos, 4);
+                if (n) history_push(data + pos + 4, n);
+                pos += n + 8;
+            }
+        }
+        if (data != MAP_FAILED) munmap(data, st.st_size);
+
+        // Пустой, текстовый или повреждённый журнал переписываем и читаем заново
+        if (from < 0) {
+            flock(fd, LOCK_UN);
+            int ex = -1;
+            if (history_lock(&ex, LOCK_EX, O_RDONLY) == 0) history_rewrite(ex, history_cap);
+            if (ex != -1) close(ex);
+        }
+        close(fd);
+        if (from >= 0) break;
+    }
+}
+
+void add_to_history(const char *cmd) {
+    if (!history_cap || strlen(cmd) == 0 || strcmp(cmd, "\\q") == 0) return;
+    size_t len = strlen(cmd);
+    if (len > HISTORY_MAX_RECORD) return;
+    history_push(cmd, len);
+
+    PhaseTimer t;
+    phase_begin(&t);
+    if (history_lock(&history_fd, LOCK_SH, O_WRONLY | O_APPEND) == -1) return;
+    uint32_t n = len;
+    struct iovec iov[3] = { { &n, 4 }, { (char *)cmd, len }, { &n, 4 } };
+    struct stat st;
+    if (k_fstat(history_fd, &st) == 0 && st.st_size == 0) {
+        // Журнал удалили — новый файл начинается с заголовка
+        flock(history_fd, LOCK_EX);
+        if (k_fstat(history_fd, &st) == 0 && st.st_size == 0) {
+            (void)!write(history_fd, HISTORY_MAGIC, HISTORY_MAGIC_LEN);
+        }
+    }
+    // Запись целиком одним writev(): параллельные сессии не перемешивают команды
+    ssize_t written = writev(history_fd, iov, 3);
+    off_t end = lseek(history_fd, 0, SEEK_CUR);
+    flock(history_fd, LOCK_UN);
+
+    if (written == (ssize_t)len + 8 && history_count == history_cap && end > 2 * (off_t)history_bytes) {
+        history_compact();
+    }
+    phase_end(PH_HISTORY, &t);
+}
+
+// Совпадает ли i-я команда с запросом (sig — сигнатура запроса)
+int history_matches(size_t i, const char *query, uint64_t sig) {
+    size_t slot = (history_start + i) % history_cap;
+    return (history_sig[slot] & sig) == sig && strstr(history[slot], query) != NULL;
+}
+
+// Ближайшая к концу команда с подстрокой query среди первых before; -1, если нет
+long history_search(const char *query, size_t before) {
+    uint64_t sig = history_signature(query);
+    if (before > history_count) before = history_count;
+    while (before-- > 0) {
+        if (history_matches(before, query, sig)) return (long)before;
+    }
+    return -1;
+}
+
+static const char *const history_columns[] = { "index", "command" };
+
+// Строка \history: "  N: команда" или запись структурированного вывода
+static void history_print(Emitter *em, size_t i) {
+    if (!em) {
+        printf("%3zu: %s\n", i + 1, history_at(i));
+        return;
+    }
+    emit_num(em, 0, i + 1);
+    emit_str(em, 1, history_at(i));
+    emit_end(em);
+}
+
+// \history [N] — вся история или последние N команд; \history grep <строка> — поиск
+void cmd_history(int argc, char **argv) {
+    char *query = NULL;
+    size_t from = 0;
+    if (argc > 1 && strcmp(argv[1], "grep") == 0) {
+        if (argc < 3) { printf("Использование: \\history grep <строка>\n"); return; }
+        // Строка поиска — все остальные слова через пробел
+        query = argv_join(argc - 2, argv + 2);
+    } else if (argc > 1) {
+        long n = atol(argv[1]);
+        if (n <= 0) { printf("Использование: \\history [N] | \\history grep <строка>\n"); return; }
+        if ((size_t)n < history_count) from = history_count - n;
+    }
+
+    Emitter em, *emp = NULL;
+    OutBuf *out = output_format != FMT_TEXT ? malloc(sizeof(OutBuf)) : NULL;
+    if (out) {
+        out->sink = NULL;
+        out->len = 0;
+        emit_begin(&em, out, history_columns, 2);
+        emp = &em;
+    }
+    uint64_t sig = query ? history_signature(query) : 0;
+    for (size_t i = from; i < history_count; i++) {
+        if (!query || history_matches(i, query, sig)) history_print(emp, i);
+    }
+    if (out) out_flush(out);
+    free(out);
+    free(query);
+}
+
+void free_history() {
+    for (size_t i = 0; i < history_count; i++) free(history[(history_start + i) % history_cap]);
+    free(history);
+    free(history_sig);
+    history = NULL;
+    history_sig = NULL;
+    history_start = history_count = history_bytes = 0;
+    if (history_fd != -1) close(history_fd);
+    history_fd = -1;
+}
+
+// echo
+void cmd_echo(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        fputs(argv[i], stdout);
+        if (i + 1 < argc) putchar(' ');
+    }
+    putchar('\n');
+}
+
+// \e в структурированном формате: запись name/value; без аргумента — всё окружение
+static void environment_records(const char *arg) {
+    static const char *const columns[] = { "name", "value" };
+    char var[256] = "";
+    if (arg) snprintf(var, sizeof(var), "%s", *arg == '$' ? arg + 1 : arg);
+    if (*var && !getenv(var)) {
+        fprintf(stderr, "Переменная '%s' не найдена\n", var);
+        return;
+    }
+
+    OutBuf *out = malloc(sizeof(OutBuf));
+    if (!out) return;
+    out->sink = NULL;
+    out->len = 0;
+    Emitter em;
+    emit_begin(&em, out, columns, 2);
+    for (char **env = environ; env && *env; env++) {
+        const char *eq = strchr(*env, '=');
+        if (!eq || (size_t)(eq - *env) >= sizeof(var)) continue;
+        char name[256];
+        memcpy(name, *env, eq - *env);
+        name[eq - *env] = '\0';
+        if (*var && strcmp(name, var) != 0) continue;
+        emit_str(&em, 0, name);
+        emit_str(&em, 1, eq + 1);
+        emit_end(&em);
+        if (*var) break;
+    }
+    out_flush(out);
+    free(out);
+}
+
+// \e — переменные окружения
+void cmd_environment(int argc, char **argv) {
+    if (output_format != FMT_TEXT) {
+        environment_records(argc > 1 ? argv[1] : NULL);
+        return;
+    }
+    if (argc < 2) {
+        printf("Использование: \\e <переменная> (например, \\e PATH)\n");
+        return;
+    }
+    const char *var = argv[1][0] == '$' ? argv[1] + 1 : argv[1];
+    char *val = getenv(var);
+    if (!val) {
+        printf("Переменная '%s' не найдена\n", var);
+        return;
+    }
+
+    printf("Переменная: %s\nЗначение: %s\n", var, val);
+    // Для совместимости с тестами — выводим сырое значение отдельной строкой
+    printf("%s\n", val);
+    if (strchr(val, ':')) {
+        char *copy = strdup(val);
+        char *tok = strtok(copy, ":");
+        while (tok) {
+            printf("%s\n", tok);
+            tok = strtok(NULL, ":");
+        }
+        free(copy);
+    }
+}
+
+// После adduser/userdel: в пакетном режиме VFS обновится один раз в конце
+void users_changed() {
+    if (batch_mode) vfs_sync_pending = 1;
+    else cmd_refresh_vfs();
+}
+
+// После userdel: каталог в VFS убираем сразу. Отложенная синхронизация пакетного
+// режима иначе увидела бы каталог без пользователя и создала бы его заново.
+void user_removed(const char *name) {
+    if (!fuse_mode) remove_user_vfs_entry(name);
+    users_changed();
+}
+
+// adduser для нескольких имён: под root — одна транзакция, иначе sudo useradd
+// на каждого, но VFS в любом случае обновляется один раз в конце
+void add_users_bulk(const NameList *names) {
+    size_t created = 0;
+    int job = 0;
+    if (geteuid() == 0) {
+        NewUser *users = calloc(names->count, sizeof(NewUser));
+        if (!users) return;
+        for (size_t i = 0; i < names->count; i++) users[i].name = names->items[i];
+        created = provision_users(users, names->count, &job);
+        for (size_t i = 0; i < names->count; i++) {
+            if (users[i].ok) printf("Пользователь %s создан\n", users[i].name);
+        }
+        free(users);
+    } else {
+        user_index_refresh();
+        for (size_t i = 0; i < names->count; i++) {
+            const char *user = names->items[i];
+            if (user_index_by_name(user)) { printf("Пользователь %s уже существует\n", user); continue; }
+            char *argv[] = { "sudo", "useradd", "-m", "-s", "/bin/bash", (char *)user, NULL };
+            if (run_argv_timed(PH_USERADD, argv) == 0) {
+                printf("Пользователь %s создан\n", user);
+                created++;
+            } else {
+                printf("Ошибка создания %s\n", user);
+            }
+        }
+    }
+
+    printf("Создано пользователей: %zu из %zu. Обновляем VFS...\n", created, names->count);
+    if (job) printf("[%d] Домашние каталоги создаются в фоне\n", job);
+    if (created) users_changed();
+}
+
+// Имена из файла: по одному в строке, пустые строки и # комментарии пропускаются
+int read_user_list(const char *path, NameList *names) {
+    FILE *f = k_fopen(path, "r");
+    if (!f) {
+        printf("Ошибка открытия %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line + strspn(line, " \t");
+        p[strcspn(p, " \t\r\n#")] = '\0';
+        if (*p) name_list_push(names, p);
+    }
+    fclose(f);
+    return 0;
+}
+
+// adduser (через команду): adduser <имя> [имя...] | adduser -f <файл>
+void cmd_adduser(int argc, char **argv) {
+    if (argc < 2) { printf("Использование: adduser <username> | adduser -f <файл>\n"); return; }
+    if (accounts_locked("adduser")) return;
+    if (argc > 2 || strcmp(argv[1], "-f") == 0) {
+        NameList names = {0};
+        int from_file = strcmp(argv[1], "-f") == 0;
+        if (from_file) {
+            if (argc < 3) printf("Использование: adduser -f <файл>\n");
+            else read_user_list(argv[2], &names);
+        } else {
+            for (int i = 1; i < argc; i++) name_list_push(&names, argv[i]);
+        }
+        if (names.count) add_users_bulk(&names);
+        else if (from_file && argc > 2) printf("Список пользователей пуст\n");
+        name_list_free(&names);
+        return;
+    }
+    const char *user = argv[1];
+    user_index_refresh();
+    if (user_index_by_name(user)) { printf("Пользователь %s уже существует\n", user); return; }
+
+    // Под root useradd создаёт запись и пустой каталог, skel копируется в фоне
+    if (geteuid() == 0) {
+        int job;
+        if (add_user_async(user, &job) == 0) {
+            printf("Пользователь %s создан. Обновляем VFS...\n", user);
+            if (job) printf("[%d] Домашний каталог заполняется в фоне\n", job);
+            users_changed();
+        } else {
+            printf("Ошибка создания %s\n", user);
+        }
+        return;
+    }
+
+    char *sudo_argv[] = { "sudo", "useradd", "-m", "-s", "/bin/bash", (char *)user, NULL };
+    if (run_argv_timed(PH_USERADD, sudo_argv) == 0) {
+        printf("Пользователь %s создан. Обновляем VFS...\n", user);
+        users_changed();
+    } else {
+        printf("Ошибка создания %s\n", user);
+    }
+}
+
+// userdel
+void cmd_userdel(int argc, char **argv) {
+    if (argc != 2) { printf("Использование: userdel <username>\n"); return; }
+    if (accounts_locked("userdel")) return;
+    const char *user = argv[1];
+    user_index_refresh();
+    if (!user_index_by_name(user)) { printf("Пользователь %s не существует\n", user); return; }
+
+    // Под root домашний каталог удаляется в фоне, команда возвращается сразу
+    if (geteuid() == 0) {
+        int job = remove_user_async(user);
+        if (job >= 0) {
+            printf("Пользователь %s удалён. Обновляем VFS...\n", user);
+            if (job) printf("[%d] Домашний каталог удаляется в фоне\n", job);
+            user_removed(user);
+        } else {
+            printf("Ошибка удаления %s\n", user);
+        }
+        return;
+    }
+
+    char *sudo_argv[] = { "sudo", "userdel", "-r", (char *)user, NULL };
+    if (run_argv_timed(PH_USERDEL, sudo_argv) == 0) {
+        printf("Пользователь %s удалён. Обновляем VFS...\n", user);
+        user_removed(user);
+    } else {
+        printf("Ошибка удаления %s\n", user);
+    }
+}
+
+// listusers — из VFS. Каталоги берутся из корня VFS (одно чтение каталога, без stat
+// при известном d_type), данные пользователей — из манифеста .kubsh_index одним
+// чтением; файлы id/home/shell открываются только для каталогов, которых в
+// манифесте нет.
+// listusers [--uid-min N] [--uid-max N] [--shell sh] [--sort name|uid]
+
+typedef struct {
+    const char *name;
+    long uid;            // -1, если id не прочитан
+    const char *home;
+    const char *shell;
+    char *owned;         // строки, прочитанные из файлов каталога (иначе — из манифеста)
+} ListedUser;
+
+typedef struct {
+    long uid_min, uid_max;
+    const char *shell;
+    int sort;            // 0 — порядок VFS, 'n' — по имени, 'u' — по UID
+} ListFilter;
+
+static int listed_by_name(const void *a, const void *b) {
+    return strcmp(((const ListedUser *)a)->name, ((const ListedUser *)b)->name);
+}
+
+static int listed_by_uid(const void *a, const void *b) {
+    const ListedUser *x = a, *y = b;
+    if (x->uid != y->uid) return x->uid < y->uid ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// Фильтр по shell: полный путь или имя (bash совпадает с /bin/bash)
+static int listed_shell_matches(const char *shell, const char *want) {
+    if (strcmp(shell, want) == 0) return 1;
+    const char *base = strrchr(shell, '/');
+    return base && strcmp(base + 1, want) == 0;
+}
+
+// Первая строка файла каталога пользователя
+static int read_user_file(int dfd, const char *file, char *buf, size_t size) {
+    int fd = k_openat(dfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+// Запасной путь: id, home и shell из файлов каталога
+static void listed_from_files(int root, const char *name, ListedUser *u) {
+    char id[64] = "", home[PATH_MAX] = "??", shell[PATH_MAX] = "??";
+    int dfd = k_openat(root, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd != -1) {
+        read_user_file(dfd, "id", id, sizeof(id));
+        read_user_file(dfd, "home", home, sizeof(home));
+        read_user_file(dfd, "shell", shell, sizeof(shell));
+        close(dfd);
+    }
+    // Имя, home и shell — одной строкой: name\0home\0shell\0
+    size_t nl = strlen(name), hl = strlen(home), sl = strlen(shell);
+    u->owned = malloc(nl + hl + sl + 3);
+    if (!u->owned) return;
+    memcpy(u->owned, name, nl + 1);
+    memcpy(u->owned + nl + 1, home, hl + 1);
+    memcpy(u->owned + nl + hl + 2, shell, sl + 1);
+    u->name = u->owned;
+    u->home = u->owned + nl + 1;
+    u->shell = u->owned + nl + hl + 2;
+    u->uid = *id ? strtol(id, NULL, 10) : -1;
+}
+
+void cmd_listusers(int argc, char **argv) {
+    ListFilter filter = { -1, -1, NULL, 0 };
+    for (int i = 1; i < argc; i += 2) {
+        const char *opt = argv[i], *val = argv[i + 1];
+        if (val && strcmp(opt, "--uid-min") == 0) filter.uid_min = atol(val);
+        else if (val && strcmp(opt, "--uid-max") == 0) filter.uid_max = atol(val);
+        else if (val && strcmp(opt, "--shell") == 0) filter.shell = val;
+        else if (val && strcmp(opt, "--sort") == 0 && (!strcmp(val, "name") || !strcmp(val, "uid"))) {
+            filter.sort = val[0];
+        } else {
+            printf("Использование: listusers [--uid-min N] [--uid-max N] [--shell sh] [--sort name|uid]\n");
+            return;
+        }
+    }
+
+    char *users_dir = get_users_dir_path();
+    DIR *dir = k_opendir(users_dir);
+    if (!dir) {
+        printf("VFS не найден. Создаём...\n");
+        create_users_vfs();
+        dir = k_opendir(users_dir);
+        if (!dir) { printf("Ошибка VFS\n"); return; }
+    }
+    int root = dirfd(dir);
+
+    // Манифест: копия в памяти, строки name:uid:gid:gecos:home:shell режутся на месте,
+    // поиск по имени — открытая адресация по номерам строк, без копирования имён
+    char *data = NULL;
+    size_t nlines = 0, buckets = 0;
+    char **lines = NULL;
+    uint32_t *by_name = NULL;
+    int mfd = k_openat(root, VFS_INDEX_FILE, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (mfd != -1 && k_fstat(mfd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, mfd, 0);
+        if (data == MAP_FAILED) data = NULL;
+    }
+    if (mfd != -1) close(mfd);
+    size_t manifest_size = data ? (size_t)st.st_size : 0;
+    if (data) {
+        for (char *p = data, *end = data + manifest_size; p < end; ) {
+            char *nl = memchr(p, '\n', end - p);
+            if (!nl) break;   // недописанная строка — её каталог прочитаем из файлов
+            *nl = '\0';
+            if (nlines % 1024 == 0) {
+                char **grown = realloc(lines, (nlines + 1024) * sizeof(char *));
+                if (!grown) break;
+                lines = grown;
+            }
+            char *colon = strchr(p, ':');
+            if (colon) {
+                *colon = '\0';
+                lines[nlines++] = p;
+            }
+            p = nl + 1;
+        }
+        for (buckets = 64; buckets < nlines * 2; buckets *= 2) {}
+        by_name = calloc(buckets, sizeof(uint32_t));
+        for (size_t i = 0; by_name && i < nlines; i++) {
+            size_t b = hash_str(lines[i]) & (buckets - 1);
+            while (by_name[b]) b = (b + 1) & (buckets - 1);
+            by_name[b] = i + 1;
+        }
+    }
+
+    ListedUser *users = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (e->d_name[0] == '.') continue;
+        int is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN) {
+            is_dir = k_fstatat(root, e->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (!is_dir) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            ListedUser *grown = realloc(users, cap * sizeof(ListedUser));
+            if (!grown) break;
+            users = grown;
+        }
+        ListedUser *u = &users[count++];
+        memset(u, 0, sizeof(*u));
+
+        char *line = NULL;
+        if (by_name) {
+            for (size_t b = hash_str(e->d_name) & (buckets - 1); by_name[b]; b = (b + 1) & (buckets - 1)) {
+                if (strcmp(lines[by_name[b] - 1], e->d_name) == 0) {
+                    line = lines[by_name[b] - 1];
+                    break;
+                }
+            }
+        }
+        // После имени: uid:gid:gecos:home:shell
+        char *f[5] = { line ? line + strlen(line) + 1 : NULL };
+        for (int i = 1; f[0] && i < 5; i++) {
+            f[i] = f[i - 1] ? strchr(f[i - 1], ':') : NULL;
+            if (f[i]) *f[i]++ = '\0';
+        }
+        if (f[0] && f[4]) {
+            u->name = line;
+            u->uid = strtol(f[0], NULL, 10);
+            u->home = f[3];
+            u->shell = f[4];
+        } else {
+            listed_from_files(root, e->d_name, u);
+        }
+    }
+
+    if (filter.sort == 'n') qsort(users, count, sizeof(ListedUser), listed_by_name);
+    if (filter.sort == 'u') qsort(users, count, sizeof(ListedUser), listed_by_uid);
+
+    static const char *const columns[] = { "name", "uid", "home", "shell" };
+    Emitter em;
+    OutBuf *out = malloc(sizeof(OutBuf));
+    if (out) {
+        out->sink = NULL;
+        out->len = 0;
+        if (output_format != FMT_TEXT) {
+            emit_begin(&em, out, columns, 4);
+        } else {
+            out_printf(out, "%-15s %-8s %-20s %s\n", "Username", "UID", "Home", "Shell");
+            out_printf(out, "------------------------------------------------------------\n");
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        ListedUser *u = &users[i];
+        int show = u->name && u->home;
+        if (show && filter.uid_min >= 0 && (u->uid < 0 || u->uid < filter.uid_min)) show = 0;
+        if (show && filter.uid_max >= 0 && (u->uid < 0 || u->uid > filter.uid_max)) show = 0;
+        if (show && filter.shell && !listed_shell_matches(u->shell, filter.shell)) show = 0;
+        if (show && out && output_format != FMT_TEXT) {
+            emit_str(&em, 0, u->name);
+            if (u->uid >= 0) emit_num(&em, 1, u->uid);
+            emit_str(&em, 2, u->home);
+            emit_str(&em, 3, u->shell);
+            emit_end(&em);
+        } else if (show && out) {
+            // То же, что "%-15s %-8s %-20s %s\n", но без разбора формата на каждой строке
+            char id[24] = "??";
+            if (u->uid >= 0) snprintf(id, sizeof(id), "%ld", u->uid);
+            out_column(out, u->name, 15);
+            out_column(out, id, 8);
+            out_column(out, u->home, 20);
+            out_put(out, u->shell, strlen(u->shell));
+            out_put(out, "\n", 1);
+        }
+        free(u->owned);
+    }
+    if (out) out_flush(out);
+    free(out);
+    free(users);
+    free(lines);
+    free(by_name);
+    if (data) munmap(data, manifest_size);
+    closedir(dir);
+}
+
+// help
+void cmd_help() {
+    printf("Команды:\n"
+           "  \\q         — выход\n"
+           "  \\history   — история (\\history N, \\history grep строка)\n"
+           "  \\e <var>   — переменная окружения\n"
+           "  \\l <диск>  — разделы диска или образа (\\l -m — машиночитаемо)\n"
+           "  \\format    — формат вывода: text, json (объект на строку), csv, tsv\n"
+           "  \\vfs       — структура VFS (-L глубина, -n число, -s, -a)\n"
+           "  \\refresh   — синхронизация VFS (\\sync — только по изменениям)\n"
+           "  \\stats     — время фаз и счётчики вызовов (-h — гистограммы, reset)\n"
+           "  echo ...    — вывод\n"
+           "  adduser ... — создать пользователя (adduser -f файл — списком)\n"
+           "  userdel ... — удалить пользователя\n"
+           "  listusers   — список из VFS (--uid-min N, --uid-max N, --shell sh, --sort name|uid)\n"
+           "  hash [-r]   — кэш путей команд\n"
+           "  a | b > f   — конвейеры и перенаправления (<, >, >>, 2>&1, <<<)\n"
+           "  команда &   — в фоне; jobs, fg [%%N], bg [%%N], wait [%%N] — задания\n"
+           "  help        — эта справка\n"
+           "Tab — дополнение, ↑/↓ — история, Ctrl-R — поиск по истории, Ctrl-Z — остановить команду\n"
+           "VFS: %s\n", get_users_dir_path());
+}
+
+// debug — вывод сообщения на отдельной строке
+void cmd_debug(int argc, char **argv) {
+    // Кавычки сняты при разборе строки; значение — на отдельной строке
+    putchar('\n');
+    cmd_echo(argc, argv);
+}
+
+// --- \stats ---
+// \stats — сводка по фазам и счётчикам, \stats -h — с гистограммами,
+// \stats reset — обнулить. При stats_file то же уходит в файл для сборщиков.
+
+static const char *const phase_stats_columns[] = {
+    "kind", "name", "count", "total_us", "avg_us", "p50_us", "p99_us", "max_us", "opens", "stats"
+};
+
+static uint64_t stats_load(_Atomic uint64_t *v) {
+    return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+// Верхняя граница корзины, в которую попадает доля q вызовов; не больше максимума
+static uint64_t phase_quantile_us(PhaseStats *p, uint64_t count, double q) {
+    uint64_t need = (uint64_t)(q * count + 0.999999), seen = 0;
+    uint64_t max_us = stats_load(&p->max_ns) / 1000;
+    for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+        seen += stats_load(&p->hist[b]);
+        if (seen >= need) return (1ULL << b) < max_us ? (1ULL << b) : max_us;
+    }
+    return max_us;
+}
+
+static void format_usec(uint64_t us, char *out, size_t size) {
+    if (us < 1000) snprintf(out, size, "%lu мкс", (unsigned long)us);
+    else if (us < 1000000) snprintf(out, size, "%.1f мс", us / 1e3);
+    else snprintf(out, size, "%.2f с", us / 1e6);
+}
+
+// Ячейка таблицы шириной width символов (не байтов: в "мкс" по два байта на букву)
+static void stats_cell(OutBuf *o, const char *s, int width, int left) {
+    int chars = 0;
+    for (const char *q = s; *q; q++) chars += ((unsigned char)*q & 0xC0) != 0x80;
+    if (left) out_put(o, s, strlen(s));
+    for (; chars < width; chars++) out_put(o, " ", 1);
+    if (!left) out_put(o, s, strlen(s));
+}
+
+static void stats_histogram(OutBuf *o, PhaseStats *p) {
+    uint64_t top = 0;
+    int first = -1, last = -1;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        uint64_t n = stats_load(&p->hist[b]);
+        if (!n) continue;
+        if (first == -1) first = b;
+        last = b;
+        if (n > top) top = n;
+    }
+    for (int b = first; b != -1 && b <= last; b++) {
+        uint64_t n = stats_load(&p->hist[b]);
+        char bound[32], label[40];
+        format_usec(1ULL << b, bound, sizeof(bound));
+        snprintf(label, sizeof(label), b == STATS_BUCKETS - 1 ? "    >= %s" : "    < %s", bound);
+        stats_cell(o, label, 18, 1);
+        int width = (int)(n * 40 / top);
+        for (int i = 0; i < width; i++) out_put(o, "#", 1);
+        out_printf(o, "%s%lu\n", width ? " " : "", (unsigned long)n);
+    }
+}
+
+static void stats_text(OutBuf *o, int histograms) {
+    static const char *const heads[] = { "Вызовов", "Среднее", "p50", "p99", "Макс", "open/в", "stat/в" };
+    stats_cell(o, "Фаза", 13, 1);
+    for (int i = 0; i < 7; i++) stats_cell(o, heads[i], 10, 0);
+    out_put(o, "\n", 1);
+    for (int i = 0; i < PH_COUNT; i++) {
+        PhaseStats *p = &phase_stats[i];
+        uint64_t count = stats_load(&p->count);
+        char cells[7][32] = { "0", "-", "-", "-", "-", "-", "-" };
+        if (count) {
+            snprintf(cells[0], sizeof(cells[0]), "%lu", (unsigned long)count);
+            format_usec(stats_load(&p->total_ns) / count / 1000, cells[1], sizeof(cells[1]));
+            format_usec(phase_quantile_us(p, count, 0.5), cells[2], sizeof(cells[2]));
+            format_usec(phase_quantile_us(p, count, 0.99), cells[3], sizeof(cells[3]));
+            format_usec(stats_load(&p->max_ns) / 1000, cells[4], sizeof(cells[4]));
+            snprintf(cells[5], sizeof(cells[5]), "%.1f", (double)stats_load(&p->opens) / count);
+            snprintf(cells[6], sizeof(cells[6]), "%.1f", (double)stats_load(&p->stats) / count);
+        }
+        stats_cell(o, phase_names[i], 13, 1);
+        for (int c = 0; c < 7; c++) stats_cell(o, cells[c], 10, 0);
+        out_put(o, "\n", 1);
+        if (histograms && count) stats_histogram(o, p);
+    }
+    out_printf(o, "\nСчётчики:");
+    for (int i = 0; i < CNT_COUNT; i++) {
+        out_printf(o, " %s=%lu", counter_names[i], (unsigned long)stats_load(&counters[i]));
+    }
+    out_put(o, "\n", 1);
+}
+
+static void stats_records(OutBuf *o) {
+    Emitter em;
+    emit_begin(&em, o, phase_stats_columns, sizeof(phase_stats_columns) / sizeof(*phase_stats_columns));
+    for (int i = 0; i < PH_COUNT; i++) {
+        PhaseStats *p = &phase_stats[i];
+        uint64_t count = stats_load(&p->count);
+        emit_str(&em, 0, "phase");
+        emit_str(&em, 1, phase_names[i]);
+        emit_num(&em, 2, count);
+        emit_num(&em, 3, stats_load(&p->total_ns) / 1000);
+        if (count) {
+            emit_num(&em, 4, stats_load(&p->total_ns) / count / 1000);
+            emit_num(&em, 5, phase_quantile_us(p, count, 0.5));
+            emit_num(&em, 6, phase_quantile_us(p, count, 0.99));
+            emit_num(&em, 7, stats_load(&p->max_ns) / 1000);
+        }
+        emit_num(&em, 8, stats_load(&p->opens));
+        emit_num(&em, 9, stats_load(&p->stats));
+        emit_end(&em);
+    }
+    for (int i = 0; i < CNT_COUNT; i++) {
+        emit_str(&em, 0, "counter");
+        emit_str(&em, 1, counter_names[i]);
+        emit_num(&em, 2, stats_load(&counters[i]));
+        emit_end(&em);
+    }
+}
+
+void cmd_stats(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        for (int i = 0; i < PH_COUNT; i++) {
+            PhaseStats *p = &phase_stats[i];
+            atomic_store_explicit(&p->count, 0, memory_order_relaxed);
+            atomic_store_explicit(&p->total_ns, 0, memory_order_relaxed);
+            atomic_store_explicit(&p->max_ns, 0, memory_order_relaxed);
+            atomic_store_explicit(&p->opens, 0, memory_order_relaxed);
+            atomic_store_explicit(&p->stats, 0, memory_order_relaxed);
+            for (int b = 0; b < STATS_BUCKETS; b++) atomic_store_explicit(&p->hist[b], 0, memory_order_relaxed);
+        }
+        for (int i = 0; i < CNT_COUNT; i++) atomic_store_explicit(&counters[i], 0, memory_order_relaxed);
+        return;
+    }
+    int histograms = argc > 1 && strcmp(argv[1], "-h") == 0;
+    if (argc > 2 || (argc > 1 && !histograms)) {
+        printf("Использование: \\stats [-h | reset]\n");
+        return;
+    }
+    OutBuf *out = malloc(sizeof(OutBuf));
+    if (!out) return;
+    out->sink = NULL;
+    out->len = 0;
+    if (output_format == FMT_TEXT) stats_text(out, histograms);
+    else stats_records(out);
+    out_flush(out);
+    free(out);
+}
+
+// Текстовый формат Prometheus (node_exporter textfile): гистограммы фаз в секундах
+static void stats_prometheus(OutBuf *o) {
+    out_printf(o, "# HELP kubsh_phase_seconds Длительность фаз kubsh\n"
+                  "# TYPE kubsh_phase_seconds histogram\n");
+    for (int i = 0; i < PH_COUNT; i++) {
+        PhaseStats *p = &phase_stats[i];
+        uint64_t seen = 0;
+        for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+            seen += stats_load(&p->hist[b]);
+            out_printf(o, "kubsh_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",
+                       phase_names[i], (double)(1ULL << b) / 1e6, (unsigned long)seen);
+        }
+        out_printf(o, "kubsh_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+                      "kubsh_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+                      "kubsh_phase_seconds_count{phase=\"%s\"} %lu\n",
+                   phase_names[i], (unsigned long)stats_load(&p->count),
+                   phase_names[i], stats_load(&p->total_ns) / 1e9,
+                   phase_names[i], (unsigned long)stats_load(&p->count));
+    }
+    out_printf(o, "# HELP kubsh_phase_syscalls_total open/stat за время фазы\n"
+                  "# TYPE kubsh_phase_syscalls_total counter\n");
+    for (int i = 0; i < PH_COUNT; i++) {
+        out_printf(o, "kubsh_phase_syscalls_total{phase=\"%s\",syscall=\"open\"} %lu\n"
+                      "kubsh_phase_syscalls_total{phase=\"%s\",syscall=\"stat\"} %lu\n",
+                   phase_names[i], (unsigned long)stats_load(&phase_stats[i].opens),
+                   phase_names[i], (unsigned long)stats_load(&phase_stats[i].stats));
+    }
+    out_printf(o, "# HELP kubsh_events_total Системные вызовы, процессы, события inotify, команды\n"
+                  "# TYPE kubsh_events_total counter\n");
+    for (int i = 0; i < CNT_COUNT; i++) {
+        out_printf(o, "kubsh_events_total{event=\"%s\"} %lu\n", counter_names[i],
+                   (unsigned long)stats_load(&counters[i]));
+    }
+}
+
+// Файл подменяется через rename(): сборщик не прочитает его наполовину записанным
+static int stats_export(const char *path) {
+    char tmp[PATH_MAX];
+    int len = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (len < 0 || (size_t)len >= sizeof(tmp)) {
+        // Обрезанное имя подменило бы при rename() чужой файл
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *f = k_fopen(tmp, "we");
+    if (!f) return -1;
+    OutBuf *out = malloc(sizeof(OutBuf));
+    if (out) {
+        out->sink = f;
+        out->len = 0;
+        stats_prometheus(out);
+        out_flush(out);
+        free(out);
+    }
+    if (fclose(f) != 0 || !out || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Выгрузка в stats_file, если с прошлой что-то изменилось и прошло stats_interval
+// (force — при выходе, без ожидания). Возвращает, через сколько мс выгрузить
+// накопившееся, чтобы главный цикл проснулся; -1 — ждать нечего.
+long stats_export_tick(int force) {
+    static uint64_t exported_generation;
+    static struct timespec exported_at;
+    if (!config.stats_file[0]) return -1;
+
+    uint64_t generation = 0;
+    for (int i = 0; i < PH_COUNT; i++) generation += stats_load(&phase_stats[i].count);
+    for (int i = 0; i < CNT_COUNT; i++) generation += stats_load(&counters[i]);
+    if (generation == exported_generation) return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - exported_at.tv_sec) * 1000 + (now.tv_nsec - exported_at.tv_nsec) / 1000000;
+    long interval = config.stats_interval * 1000L;
+    if (!force && exported_at.tv_sec && elapsed < interval) return interval - elapsed;
+
+    if (stats_export(config.stats_file) == -1) {
+        static int reported;
+        if (!reported++) fprintf(stderr, "kubsh: %s: %s\n", config.stats_file, strerror(errno));
+    }
+    // Сама выгрузка открывает файл — это изменение следующей не требует
+    exported_generation = generation + 1;
+    exported_at = now;
+    return -1;
+}
+
+// --- jobs, fg, bg, wait ---
+// Задания kubsh: фоновые строки (команда &) и задания пула потоков (домашние
+// каталоги adduser/userdel) — в одном ряду номеров. %N и N — номер задания,
+// без номера — последнее.
+
+static ShellJob *job_by_spec(const char *name, const char *spec) {
+    ShellJob *j = shell_jobs;
+    if (!spec) {
+        while (j && j->next) j = j->next;
+        if (!j) printf("%s: нет заданий\n", name);
+        return j;
+    }
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    while (j && j->id != id) j = j->next;
+    if (!j) printf("%s: %s: нет такого задания\n", name, spec);
+    return j;
+}
+
+static int job_group_listed(int id) {
+    for (JobGroup *g = job_groups; g; g = g->active_next) {
+        if (g->id == id) return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    int id;
+    const char *state;
+    const char *cmd;
+} JobLine;
+
+static int job_line_cmp(const void *a, const void *b) {
+    return ((const JobLine *)a)->id - ((const JobLine *)b)->id;
+}
+
+// jobs [-p] — задания по номерам; -p — только номера групп процессов
+static void cmd_jobs(int argc, char **argv) {
+    int pgids = argc > 1 && strcmp(argv[1], "-p") == 0;
+    shell_jobs_reap(1);
+    jobs_report();
+
+    size_t n = 0;
+    for (ShellJob *j = shell_jobs; j; j = j->next) n++;
+    if (pgids) {
+        for (ShellJob *j = shell_jobs; j; j = j->next) printf("%d\n", (int)j->pgid);
+        return;
+    }
+    for (JobGroup *g = job_groups; g; g = g->active_next) n++;
+    JobLine *lines = malloc((n + 1) * sizeof(JobLine));
+    if (!lines) { perror("malloc"); exit(1); }
+    n = 0;
+    for (ShellJob *j = shell_jobs; j; j = j->next) {
+        lines[n++] = (JobLine){ j->id, j->stopped ? "Остановлено" : "Выполняется", j->cmd };
+    }
+    for (JobGroup *g = job_groups; g; g = g->active_next) {
+        lines[n++] = (JobLine){ g->id, "Выполняется", g->desc };
+    }
+    qsort(lines, n, sizeof(JobLine), job_line_cmp);
+    for (size_t i = 0; i < n; i++) printf("[%d] %s: %s\n", lines[i].id, lines[i].state, lines[i].cmd);
+    free(lines);
+}
+
+// fg [%N] — задание на передний план (остановленное продолжается)
+static void cmd_fg(int argc, char **argv) {
+    shell_jobs_reap(1);
+    ShellJob *j = job_by_spec("fg", argc > 1 ? argv[1] : NULL);
+    if (!j) {
+        last_status = 1;
+        return;
+    }
+    printf("%s\n", j->cmd);
+    fflush(stdout);
+    last_status = job_foreground(j, 1);
+    if (!j->stopped) {
+        shell_job_remove(j);
+        shell_job_free(j);
+    }
+}
+
+// bg [%N] — продолжить остановленное задание в фоне
+static void cmd_bg(int argc, char **argv) {
+    shell_jobs_reap(1);
+    ShellJob *j = job_by_spec("bg", argc > 1 ? argv[1] : NULL);
+    if (!j) {
+        last_status = 1;
+        return;
+    }
+    if (!j->stopped) {
+        printf("bg: задание [%d] уже выполняется в фоне\n", j->id);
+    } else {
+        kill(-j->pgid, SIGCONT);
+        j->stopped = 0;
+        printf("[%d] %s &\n", j->id, j->cmd);
+    }
+    last_status = 0;
+}
+
+static volatile sig_atomic_t wait_interrupted;
+
+static void wait_sigint(int sig) {
+    (void)sig;
+    wait_interrupted = 1;
+}
+
+// Ожидание фонового задания; 0 — прервано Ctrl-C или задание остановилось
+static int wait_shell_job(ShellJob *j) {
+    for (int i = 0; i < j->npids; i++) {
+        while (j->pids[i] != -1) {
+            int status;
+            if (waitpid(j->pids[i], &status, WUNTRACED) == -1) {
+                if (errno == EINTR && wait_interrupted) return 0;
+                if (errno != EINTR) j->pids[i] = -1;
+                continue;
+            }
+            if (WIFSTOPPED(status)) {
+                j->stopped = 1;
+                printf("[%d] Остановлено: %s\n", j->id, j->cmd);
+                last_status = 128 + WSTOPSIG(status);
+                return 0;
+            }
+            shell_job_exited(j, i, status);
+        }
+    }
+    last_status = j->statuses[j->npids - 1];
+    shell_job_report(j);
+    shell_job_remove(j);
+    shell_job_free(j);
+    return 1;
+}
+
+// Ожидание задания пула (id) или всех (0)
+static void wait_job_groups(int id) {
+    while (!wait_interrupted && job_groups_active > 0 && (!id || job_group_listed(id))) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(job_notify_fd, &rfds);
+        if (select(job_notify_fd + 1, &rfds, NULL, NULL, NULL) == -1 && errno != EINTR) break;
+        jobs_report();
+    }
+}
+
+// wait [%N ...] — дождаться заданий (без аргументов — всех); Ctrl-C прерывает ожидание
+static void cmd_wait(int argc, char **argv) {
+    struct sigaction sa = { .sa_handler = wait_sigint }, old;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+    wait_interrupted = 0;
+    last_status = 0;
+
+    if (argc < 2) {
+        while (shell_jobs && wait_shell_job(shell_jobs)) {}
+        wait_job_groups(0);
+    }
+    for (int i = 1; i < argc && !wait_interrupted; i++) {
+        int id = atoi(argv[i][0] == '%' ? argv[i] + 1 : argv[i]);
+        ShellJob *j = shell_jobs;
+        while (j && j->id != id) j = j->next;
+        if (j) {
+            if (!wait_shell_job(j)) break;
+        } else if (job_group_listed(id)) {
+            wait_job_groups(id);
+        } else {
+            printf("wait: %s: нет такого задания\n", argv[i]);
+            last_status = 127;
+        }
+    }
+
+    sigaction(SIGINT, &old, NULL);
+    if (wait_interrupted) {
+        printf("\n");
+        last_status = 130;
+    }
+}
+
+// --- Встроенные команды ---
+// Встроенная команда — первое слово строки; аргументы получает как argc/argv, как
+// внешняя программа. Имена ищутся совершенным хэшем: при первом обращении
+// подбирается seed, при котором все имена попадают в разные ячейки таблицы, и
+// дальше поиск — одно хэширование и одно сравнение, сколько бы команд ни было.
+#define BI_MUTATES_USERS 1   // меняет пользователей: после неё синхронизируется VFS
+
+typedef struct {
+    const char *name;
+    int flags;
+    void (*fn)(int argc, char **argv);
+} Builtin;
+
+static void bi_help(int argc, char **argv) { (void)argc; (void)argv; cmd_help(); }
+
+// \format [text|json|csv|tsv] — формат вывода listusers, \e, \l и \history
+static void cmd_format(int argc, char **argv) {
+    if (argc < 2) {
+        printf("%s\n", format_names[output_format]);
+        return;
+    }
+    int format = parse_format(argv[1]);
+    if (format == -1) {
+        printf("Использование: \\format [text|json|csv|tsv]\n");
+        return;
+    }
+    output_format = format;
+}
+
+static void bi_refresh_vfs(int argc, char **argv) { (void)argc; (void)argv; cmd_refresh_vfs(); }
+
+// \sync — синхронизация только по изменениям, без полной сверки, как \refresh
+static void bi_sync(int argc, char **argv) { (void)argc; (void)argv; sync_vfs_with_system(); }
+
+static const Builtin builtins[] = {
+    { "echo",      0,                cmd_echo },
+    { "debug",     0,                cmd_debug },
+    { "adduser",   BI_MUTATES_USERS, cmd_adduser },
+    { "userdel",   BI_MUTATES_USERS, cmd_userdel },
+    { "listusers", 0,                cmd_listusers },
+    { "help",      0,                bi_help },
+    { "\\history", 0,                cmd_history },
+    { "\\e",       0,                cmd_environment },
+    { "\\l",       0,                cmd_list_partitions },
+    { "\\vfs",     0,                cmd_show_vfs },
+    { "\\format",  0,                cmd_format },
+    { "\\refresh", 0,                bi_refresh_vfs },
+    { "\\sync",    0,                bi_sync },
+    { "\\stats",   0,                cmd_stats },
+    { "hash",      0,                cmd_hash },
+    { "jobs",      0,                cmd_jobs },
+    { "fg",        BI_MUTATES_USERS, cmd_fg },
+    { "bg",        0,                cmd_bg },
+    { "wait",      BI_MUTATES_USERS, cmd_wait },
+};
+
+#define NBUILTINS (sizeof(builtins) / sizeof(*builtins))
+#define BUILTIN_SLOTS 64   // степень двойки; с запасом, чтобы seed находился быстро
+_Static_assert(NBUILTINS * 2 <= BUILTIN_SLOTS, "BUILTIN_SLOTS мал для таблицы встроенных команд");
+
+static unsigned char builtin_slot[BUILTIN_SLOTS];   // номер команды + 1, 0 — пусто
+static uint32_t builtin_seed;
+
+static uint32_t builtin_hash(const char *s, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return (h ^ (h >> 15)) & (BUILTIN_SLOTS - 1);
+}
+
+static void builtin_table_init() {
+    for (uint32_t seed = 1; ; seed++) {
+        memset(builtin_slot, 0, sizeof(builtin_slot));
+        size_t i = 0;
+        for (; i < NBUILTINS; i++) {
+            uint32_t h = builtin_hash(builtins[i].name, seed);
+            if (builtin_slot[h]) break;
+            builtin_slot[h] = i + 1;
+        }
+        if (i == NBUILTINS) {
+            builtin_seed = seed;
+            return;
+        }
+    }
+}
+
+const Builtin *find_builtin(const char *name) {
+    if (!builtin_seed) builtin_table_init();
+    unsigned slot = builtin_slot[builtin_hash(name, builtin_seed)];
+    return slot && strcmp(builtins[slot - 1].name, name) == 0 ? &builtins[slot - 1] : NULL;
+}
+
+// Слова строки для встроенной команды: кавычки '...' и "...", экранирование '\'.
+// В отличие от parse_pipeline(), $ и шаблоны не раскрываются, а остаются как есть:
+// \e $PATH получает "$PATH". TOK_UNTERMINATED — незакрытая кавычка.
+int split_words(const char *line, Argv *a) {
+    char *word = malloc(strlen(line) + 1);
+    if (!word) { perror("malloc"); exit(1); }
+    const char *p = line;
+    int rc = TOK_OK;
+    while (rc == TOK_OK) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+        size_t len = 0;
+        while (*p && *p != ' ' && *p != '\t') {
+            char c = *p++;
+            if (c == '\'') {
+                const char *end = strchr(p, '\'');
+                if (!end) { rc = TOK_UNTERMINATED; break; }
+                memcpy(word + len, p, end - p);
+                len += end - p;
+                p = end + 1;
+            } else if (c == '"') {
+                while (*p && *p != '"') {
+                    if (*p == '\\' && p[1] && strchr("\"\\$`", p[1])) p++;
+                    word[len++] = *p++;
+                }
+                if (*p != '"') { rc = TOK_UNTERMINATED; break; }
+                p++;
+            } else if (c == '\\' && (len > 0 || a->argc > 0 || !((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')))) {
+                if (*p) word[len++] = *p++;
+            } else {
+                // в том числе '\' в начале имени команды: \e, \l, \history
+                word[len++] = c;
+            }
+        }
+        if (rc == TOK_OK) argv_push(a, word, len);
+    }
+    free(word);
+    return rc;
+}
+
+// --- Конвейеры ---
+// Внешние стадии запускаются через posix_spawn() с перестановкой дескрипторов,
+// соединяются каналами pipe2(). Встроенные стадии выполняются в самом kubsh
+// после запуска внешних: их stdout временно направляется прямо в канал или файл.
+
+typedef struct {
+    int fd;
+    int saved;           // копия исходного дескриптора, -1 — был закрыт
+} SavedFd;
+
+static void redirect_in_process(int src, int fd, SavedFd *saved, int *nsaved) {
+    int known = 0;
+    for (int i = 0; i < *nsaved; i++) {
+        if (saved[i].fd == fd) known = 1;
+    }
+    if (!known) {
+        saved[*nsaved].fd = fd;
+        saved[*nsaved].saved = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        (*nsaved)++;
+    }
+    if (src == -1) close(fd);
+    else if (src != fd) dup2(src, fd);
+}
+
+static void restore_in_process(SavedFd *saved, int nsaved) {
+    for (int i = nsaved - 1; i >= 0; i--) {
+        if (saved[i].saved == -1) {
+            close(saved[i].fd);
+        } else {
+            dup2(saved[i].saved, saved[i].fd);
+            close(saved[i].saved);
+        }
+    }
+}
+
+// Открывает файлы перенаправлений стадии: src[i] — дескриптор-источник для redirs[i]
+// (-1 — закрыть), opened[i] — нужно ли его закрыть после запуска.
+static int open_redirects(const Stage *st, int *src, int *opened) {
+    for (int i = 0; i < st->nredirs; i++) {
+        const Redirect *r = &st->redirs[i];
+        opened[i] = 1;
+        switch (r->kind) {
+        case REDIR_IN:
+            src[i] = k_open(r->target, O_RDONLY | O_CLOEXEC);
+            break;
+        case REDIR_OUT:
+            src[i] = k_open(r->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            break;
+        case REDIR_APPEND:
+            src[i] = k_open(r->target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+            break;
+        case REDIR_HERESTRING: {
+            src[i] = memfd_create("kubsh-herestring", MFD_CLOEXEC);
+            struct iovec iov[2] = { { r->target, strlen(r->target) }, { "\n", 1 } };
+            if (src[i] != -1 && (writev(src[i], iov, 2) == -1 || lseek(src[i], 0, SEEK_SET) == -1)) {
+                close(src[i]);
+                src[i] = -1;
+            }
+            break;
+        }
+        default: // REDIR_DUP
+            src[i] = strcmp(r->target, "-") == 0 ? -1 : atoi(r->target);
+            opened[i] = 0;
+            break;
+        }
+        if (opened[i] && src[i] == -1) {
+            printf("kubsh: %s: %s\n", r->target, strerror(errno));
+            for (int j = 0; j < i; j++) {
+                if (opened[j]) close(src[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_redirects(const Stage *st, const int *src, const int *opened) {
+    for (int i = 0; i < st->nredirs; i++) {
+        if (opened[i]) close(src[i]);
+    }
+}
+
+// Встроенная команда в роли стадии конвейера
+static int run_builtin_stage(const Stage *st, int out_fd) {
+    int *src = malloc((st->nredirs + 1) * sizeof(int));
+    int *opened = malloc((st->nredirs + 1) * sizeof(int));
+    SavedFd *saved = malloc((st->nredirs + 1) * sizeof(SavedFd));
+    if (!src || !opened || !saved) { perror("malloc"); exit(1); }
+
+    int status = 1;
+    if (open_redirects(st, src, opened) == 0) {
+        int nsaved = 0;
+        fflush(stdout);
+        fflush(stderr);
+        if (out_fd != -1) redirect_in_process(out_fd, STDOUT_FILENO, saved, &nsaved);
+        for (int i = 0; i < st->nredirs; i++) {
+            redirect_in_process(src[i], st->redirs[i].fd, saved, &nsaved);
+        }
+
+        const Builtin *b = find_builtin(st->args.argv[0]);
+        if (b) b->fn(st->args.argc, st->args.argv);
+        status = 0;
+
+        fflush(stdout);
+        fflush(stderr);
+        restore_in_process(saved, nsaved);
+        close_redirects(st, src, opened);
+    }
+    free(src);
+    free(opened);
+    free(saved);
+    return status;
+}
+
+static int stage_is_builtin(const Stage *st) {
+    return st->args.argc > 0 && find_builtin(st->args.argv[0]) != NULL;
+}
+
+// Запуск внешней стадии с дескрипторами in_fd/out_fd (-1 — унаследовать)
+static pid_t spawn_stage(const Stage *st, int in_fd, int out_fd, int *status) {
+    int *src = malloc((st->nredirs + 1) * sizeof(int));
+    int *opened = malloc((st->nredirs + 1) * sizeof(int));
+    if (!src || !opened) { perror("malloc"); exit(1); }
+
+    pid_t pid = -1;
+    *status = 1;
+    if (open_redirects(st, src, opened) == 0) {
+        *status = 0;
+        if (st->args.argc > 0) {
+            posix_spawn_file_actions_t fa;
+            posix_spawn_file_actions_init(&fa);
+            if (in_fd != -1) posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+            if (out_fd != -1) posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+            for (int i = 0; i < st->nredirs; i++) {
+                if (src[i] == -1) posix_spawn_file_actions_addclose(&fa, st->redirs[i].fd);
+                else posix_spawn_file_actions_adddup2(&fa, src[i], st->redirs[i].fd);
+            }
+            pid = spawn_command(st->args.argv, &fa);
+            if (pid == -1) *status = report_spawn_error(st->args.argv[0], errno);
+            posix_spawn_file_actions_destroy(&fa);
+        }
+        close_redirects(st, src, opened);
+    }
+    free(src);
+    free(opened);
+    return pid;
+}
+
+// Выполнение конвейера; возвращает код завершения последней стадии.
+// Внешние стадии — одна группа процессов; в фоне (background) конвейер
+// становится заданием line и не ожидается.
+int run_pipeline(const Pipeline *pl, const char *line, int background) {
+    int n = pl->nstages;
+    pid_t *pids = malloc(n * sizeof(pid_t));
+    int *statuses = malloc(n * sizeof(int));
+    int *builtin_out = malloc(n * sizeof(int));
+    if (!pids || !statuses || !builtin_out) { perror("malloc"); exit(1); }
+
+    PhaseTimer t;
+    phase_begin(&t);
+    fflush(stdout);
+    fflush(stderr);
+    int grouped = job_control || background || daemon_client_fd != -1;
+    pid_t pgid = 0;
+    spawn_pgid = grouped ? 0 : -1;
+    // Без управления заданиями фоновый конвейер терминал не читает
+    int in_fd = background && !job_control ? k_open("/dev/null", O_RDONLY | O_CLOEXEC) : -1;
+    for (int i = 0; i < n; i++) {
+        const Stage *st = &pl->stages[i];
+        int pipefd[2] = { -1, -1 };
+        pids[i] = -1;
+        statuses[i] = 1;
+        builtin_out[i] = -2;     // -2 — стадия не встроенная
+        if (i < n - 1 && pipe2(pipefd, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            for (int j = i; j < n; j++) { pids[j] = -1; statuses[j] = 1; builtin_out[j] = -2; }
+            break;
+        }
+
+        if (stage_is_builtin(st)) {
+            // Встроенные команды stdin не читают
+            builtin_out[i] = pipefd[1];
+        } else {
+            pids[i] = spawn_stage(st, in_fd, pipefd[1], &statuses[i]);
+            if (pipefd[1] != -1) close(pipefd[1]);
+            // Первая запущенная стадия задаёт группу остальным
+            if (grouped && !pgid && pids[i] != -1) spawn_pgid = pgid = pids[i];
+        }
+        if (in_fd != -1) close(in_fd);
+        in_fd = pipefd[0];
+    }
+    if (in_fd != -1) close(in_fd);
+    spawn_pgid = -1;
+
+    for (int i = 0; i < n; i++) {
+        if (builtin_out[i] == -2) continue;
+        statuses[i] = run_builtin_stage(&pl->stages[i], builtin_out[i]);
+        if (builtin_out[i] != -1) close(builtin_out[i]);
+    }
+
+    int status = job_launched(pids, statuses, n, pgid, line, background);
+    // Конвейер из одних встроенных команд внешним запуском не считается
+    int spawned = 0;
+    for (int i = 0; i < n; i++) spawned |= pids[i] != -1;
+    if (spawned && !background) phase_end(PH_EXEC, &t);
+    free(pids);
+    free(statuses);
+    free(builtin_out);
+    return status;
+}
+
+// Встроенные команды sh, которые раньше работали через system()
+static int is_sh_builtin(const char *name) {
+    static const char *names[] = {
+        ".", ":", "alias", "eval", "exec", "exit", "export", "readonly",
+        "set", "shift", "times", "trap", "umask", "unalias", "unset", "wait", NULL
+    };
+    for (int i = 0; names[i]; i++) {
+        if (strcmp(names[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+// Выполнение строки как внешней команды или конвейера
+void execute_line(const char *line) {
+    Pipeline pl = {0};
+    int rc = parse_pipeline(line, &pl);
+    const Argv *first = pl.nstages > 0 ? &pl.stages[0].args : NULL;
+    int simple = rc == TOK_OK && !pipeline_is_compound(&pl) && first && first->argc > 0;
+
+    if (rc == TOK_UNTERMINATED) {
+        printf("kubsh: незакрытая кавычка\n");
+        last_status = 2;
+    } else if (rc == TOK_SYNTAX) {
+        printf("kubsh: синтаксическая ошибка\n");
+        last_status = 2;
+    } else if (rc == TOK_NEEDS_SHELL ||
+               (simple && is_sh_builtin(first->argv[0]) && !lookup_command(first->argv[0]))) {
+        char *sh_argv[] = { "/bin/sh", "-c", (char *)line, NULL };
+        last_status = run_argv_job(sh_argv, line, 0);
+    } else if (simple && strcmp(first->argv[0], "cd") == 0) {
+        const char *dir = first->argc > 1 ? first->argv[1] : get_home_path();
+        last_status = chdir(dir) == 0 ? 0 : 1;
+        if (last_status) printf("cd: %s: %s\n", dir, strerror(errno));
+    } else if (simple || pipeline_is_compound(&pl)) {
+        last_status = run_pipeline(&pl, line, 0);
+    }
+    pipeline_free(&pl);
+}
+
+// Длина строки без завершающего & (команда в фоне) или 0, если его нет.
+// &&, >&, <&, |& и & в кавычках или после \ фона не означают.
+static size_t background_length(const char *line) {
+    const char *amp = NULL, *last = NULL;
+    for (const char *p = line; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            last = ++p;
+            continue;
+        }
+        if (*p == '\'' || *p == '"') {
+            char quote = *p++;
+            while (*p && *p != quote) {
+                if (quote == '"' && *p == '\\' && p[1]) p++;
+                p++;
+            }
+            if (!*p) return 0;   // незакрытая кавычка — сообщит разбор
+            last = p;
+            continue;
+        }
+        if (*p == '&') amp = p;
+        if (*p != ' ' && *p != '\t' && *p != '\n') last = p;
+    }
+    if (!amp || amp != last || amp == line || strchr("&<>|", amp[-1])) return 0;
+    size_t len = amp - line;
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) len--;
+    return len;
+}
+
+int process_command(const char *input);
+
+// Фоновая строка со встроенными командами или cd: копия kubsh в своей группе
+// процессов выполняет её целиком и дожидается своих заданий пула
+static int run_subshell(const char *line) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        int sigs[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGHUP };
+        for (size_t i = 0; i < sizeof(sigs) / sizeof(*sigs); i++) signal(sigs[i], SIG_DFL);
+        if (!job_control) {
+            int fd = k_open("/dev/null", O_RDONLY);
+            if (fd != -1 && fd != STDIN_FILENO) {
+                dup2(fd, STDIN_FILENO);
+                close(fd);
+            }
+        }
+        if (sigchld_fd != -1) close(sigchld_fd);
+        sigchld_fd = -1;
+        shell_jobs = NULL;   // задания родителя копии не принадлежат
+        job_control = 0;
+        interactive = 0;
+        batch_mode = 1;
+        last_status = 0;
+        process_command(line);
+        jobs_wait_all();
+        fflush(stdout);
+        fflush(stderr);
+        _exit(last_status);
+    }
+    setpgid(pid, pid);
+    int status = 0;
+    return job_launched(&pid, &status, 1, pid, line, 1);
+}
+
+// Выполнение строки в фоне: внешние команды и конвейеры — сразу заданием
+static void run_background(const char *line) {
+    Pipeline pl = {0};
+    int rc = parse_pipeline(line, &pl);
+    const Argv *first = pl.nstages > 0 ? &pl.stages[0].args : NULL;
+    int simple = rc == TOK_OK && pl.nstages == 1 && first->argc > 0;
+    int builtins = 0;
+    for (int i = 0; rc == TOK_OK && i < pl.nstages; i++) {
+        const Argv *a = &pl.stages[i].args;
+        builtins |= a->argc > 0 && (find_builtin(a->argv[0]) || strcmp(a->argv[0], "cd") == 0);
+    }
+
+    if (rc == TOK_NEEDS_SHELL ||
+        (simple && is_sh_builtin(first->argv[0]) && !lookup_command(first->argv[0]))) {
+        char *sh_argv[] = { "/bin/sh", "-c", (char *)line, NULL };
+        last_status = run_argv_job(sh_argv, line, 1);
+    } else if (rc != TOK_OK) {
+        execute_line(line);   // сообщение о синтаксической ошибке
+    } else if (builtins) {
+        last_status = run_subshell(line);
+    } else {
+        last_status = run_pipeline(&pl, line, 1);
+    }
+    pipeline_free(&pl);
+}
+
+// Обработка команд
+// Возвращает 0, если пользователи заведомо не менялись: строка целиком из встроенных
+// команд без BI_MUTATES_USERS. Внешние команды (useradd, ...) могли менять всё.
+int process_command(const char *input) {
+    size_t bg = background_length(input);
+    if (bg) {
+        char *line = strndup(input, bg);
+        if (!line) { perror("strndup"); exit(1); }
+        run_background(line);
+        free(line);
+        return 1;
+    }
+
+    // Конвейеры и перенаправления выполняем сами; простые строки — как раньше
+    Pipeline pl = {0};
+    if (parse_pipeline(input, &pl) == TOK_OK && pipeline_is_compound(&pl)) {
+        int mutates = 0;
+        for (int i = 0; i < pl.nstages; i++) {
+            const Builtin *b = pl.stages[i].args.argc ? find_builtin(pl.stages[i].args.argv[0]) : NULL;
+            if (!b || (b->flags & BI_MUTATES_USERS)) mutates = 1;
+        }
+        last_status = run_pipeline(&pl, input, 0);
+        pipeline_free(&pl);
+        return mutates;
+    }
+    pipeline_free(&pl);
+
+    Argv args = {0};
+    const Builtin *b = NULL;
+    if (split_words(input, &args) == TOK_OK && args.argc > 0) b = find_builtin(args.argv[0]);
+    if (b) {
+        b->fn(args.argc, args.argv);
+    } else {
+        // Выполнение бинарника из $PATH без промежуточного /bin/sh
+        execute_line(input);
+    }
+    argv_free(&args);
+    return !b || (b->flags & BI_MUTATES_USERS);
+}
+
+#ifdef KUBSH_FUSE
+// --- VFS через FUSE ---
+// kubsh --fuse монтирует файловую систему в корень VFS и отдаёт каталоги
+// пользователей прямо из индекса passwd: на диск ничего не пишется, а чтение
+// всегда отражает текущий /etc/passwd. mkdir/rmdir сразу создают/удаляют
+// пользователя. Цикл FUSE работает в отдельном потоке со своим экземпляром индекса,
+// поэтому общих с командной строкой данных у него нет.
+
+static struct fuse *vfs_fuse;
+static pthread_t vfs_fuse_thread;
+static UserIndex fuse_index;
+static struct stat fuse_index_stamp;
+static int fuse_index_valid = 0;
+static time_t fuse_mount_time;
+// Снимок настроек для потока FUSE: config по SIGHUP подменяется в основном потоке
+static char fuse_passwd_file[PATH_MAX];
+static int fuse_accounts_writable;
+
+static const char *fuse_user_files[] = { "id", "home", "shell", "info", "home_link" };
+
+static void fuse_index_refresh() {
+    struct stat st;
+    int fd = k_open(fuse_passwd_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    if (k_fstat(fd, &st) == 0 && !(fuse_index_valid && passwd_stamp_equal(&st, &fuse_index_stamp))) {
+        UserIndex fresh = {0};
+        if (user_index_parse(&fresh, fd, (size_t)st.st_size) == 0) {
+            user_index_free(&fuse_index);
+            fuse_index = fresh;
+            fuse_index_stamp = st;
+            fuse_index_valid = 1;
+        } else {
+            user_index_free(&fresh);
+        }
+    }
+    close(fd);
+}
+
+// Разбор пути: "/" → 0, "/name" → 1, "/name/file" → 2, иначе -1
+static int fuse_split_path(const char *path, char *name, size_t size, const char **file) {
+    if (strcmp(path, "/") == 0) return 0;
+    const char *start = path + 1;
+    const char *slash = strchr(start, '/');
+    size_t len = slash ? (size_t)(slash - start) : strlen(start);
+    if (len == 0 || len >= size) return -1;
+    memcpy(name, start, len);
+    name[len] = '\0';
+    if (!slash) return 1;
+    *file = slash + 1;
+    return strchr(*file, '/') || !**file ? -1 : 2;
+}
+
+static int fuse_render_stats(char *buf, size_t size) {
+    OutBuf *o = malloc(sizeof(OutBuf));
+    if (!o) return 0;
+    o->sink = NULL;
+    o->len = 0;
+    render_system_stats(o, fuse_mount_time);
+    size_t len = o->len < size ? o->len : size - 1;
+    memcpy(buf, o->data, len);
+    free(o);
+    return len;
+}
+
+// Пользователь, чей каталог виден в VFS
+static const UserRecord *fuse_find_user(const char *name) {
+    const UserRecord *u = user_index_find(&fuse_index, name);
+    return u && u->sh ? u : NULL;
+}
+
+// Содержимое файла по пути; -ENOENT, если его нет
+static int fuse_render(const char *path, char *buf, size_t size) {
+    char name[NAME_MAX + 1];
+    const char *file = NULL;
+    int depth = fuse_split_path(path, name, sizeof(name), &file);
+    if (depth == 1 && strcmp(name, "system_stats") == 0) return fuse_render_stats(buf, size);
+    if (depth != 2) return -ENOENT;
+    const UserRecord *u = fuse_find_user(name);
+    int len = u ? render_user_file(u, file, buf, size) : -1;
+    return len >= 0 ? len : -ENOENT;
+}
+
+static int vfs_fuse_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    (void)fi;
+    fuse_index_refresh();
+    memset(st, 0, sizeof(*st));
+    st->st_uid = geteuid();
+    st->st_gid = getegid();
+    st->st_mtim = st->st_ctim = st->st_atim = fuse_index_stamp.st_mtim;
+
+    char name[NAME_MAX + 1];
+    const char *file = NULL;
+    int depth = fuse_split_path(path, name, sizeof(name), &file);
+    if (depth == 0 || (depth == 1 && fuse_find_user(name))) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        return 0;
+    }
+    if (depth == 2 && strcmp(file, "home_link") == 0) {
+        const UserRecord *u = fuse_find_user(name);
+        if (!u) return -ENOENT;
+        st->st_mode = S_IFLNK | 0777;
+        st->st_nlink = 1;
+        st->st_size = strlen(u->dir);
+        return 0;
+    }
+
+    char buf[4096];
+    int len = fuse_render(path, buf, sizeof(buf));
+    if (len < 0) return len;
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = len;
+    return 0;
+}
+
+static int vfs_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+                            struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    (void)off; (void)fi; (void)flags;
+    fuse_index_refresh();
+    char name[NAME_MAX + 1];
+    const char *file = NULL;
+    int depth = fuse_split_path(path, name, sizeof(name), &file);
+
+    if (depth == 0) {
+        filler(buf, ".", NULL, 0, 0);
+        filler(buf, "..", NULL, 0, 0);
+        filler(buf, "system_stats", NULL, 0, 0);
+        for (size_t i = 0; i < fuse_index.count; i++) {
+            const UserRecord *u = &fuse_index.users[i];
+            if (u->sh && user_index_find(&fuse_index, u->name) == u) filler(buf, u->name, NULL, 0, 0);
+        }
+        return 0;
+    }
+    if (depth != 1 || !fuse_find_user(name)) return -ENOENT;
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    for (size_t i = 0; i < sizeof(fuse_user_files) / sizeof(fuse_user_files[0]); i++) {
+        filler(buf, fuse_user_files[i], NULL, 0, 0);
+    }
+    return 0;
+}
+
+static int vfs_fuse_open(const char *path, struct fuse_file_info *fi) {
+    fuse_index_refresh();
+    char buf[4096];
+    int len = fuse_render(path, buf, sizeof(buf));
+    if (len < 0) return len;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+    // Содержимое вычисляется при каждом чтении — кэш страниц ядра не нужен
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int vfs_fuse_read(const char *path, char *out, size_t size, off_t off,
+                         struct fuse_file_info *fi) {
+    (void)fi;
+    fuse_index_refresh();
+    char buf[4096];
+    int len = fuse_render(path, buf, sizeof(buf));
+    if (len < 0) return len;
+    if (off >= len) return 0;
+    if (size > (size_t)(len - off)) size = len - off;
+    memcpy(out, buf + off, size);
+    return size;
+}
+
+static int vfs_fuse_readlink(const char *path, char *buf, size_t size) {
+    fuse_index_refresh();
+    char name[NAME_MAX + 1];
+    const char *file = NULL;
+    if (fuse_split_path(path, name, sizeof(name), &file) != 2 || strcmp(file, "home_link") != 0)
+        return -EINVAL;
+    const UserRecord *u = fuse_find_user(name);
+    if (!u) return -ENOENT;
+    snprintf(buf, size, "%s", u->dir);
+    return 0;
+}
+
+// Запуск useradd/userdel из потока FUSE: без общего с командной строкой кэша PATH
+static int fuse_run(char *const argv[]) {
+    // Поток FUSE унаследовал заблокированный ради signalfd SIGCHLD — потомкам маска
+    // нужна пустая, а сигналы — по умолчанию, как в spawn_command()
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t set;
+    sigemptyset(&set);
+    posix_spawnattr_setsigmask(&attr, &set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGPIPE);
+    sigaddset(&set, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &set);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) return -1;
+    count_event(CNT_CHILD);
+    int status;
+    pid_t r;
+    while ((r = waitpid(pid, &status, 0)) == -1 && errno == EINTR) {}
+    if (r == -1) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// mkdir в корне VFS — создание пользователя, сразу, а не при следующей синхронизации
+static int vfs_fuse_mkdir(const char *path, mode_t mode) {
+    (void)mode;
+    fuse_index_refresh();
+    char name[NAME_MAX + 1];
+    const char *file = NULL;
+    if (fuse_split_path(path, name, sizeof(name), &file) != 1) return -EPERM;
+    if (user_index_find(&fuse_index, name)) return -EEXIST;
+    if (geteuid() != 0 || !fuse_accounts_writable) return -EPERM;
+
+    char *argv[] = { "useradd", "-m", "-s", "/bin/bash", name, NULL };
+    if (fuse_run(argv) != 0) return -EIO;
+    fuse_index_refresh();
+    return fuse_find_user(name) ? 0 : -EIO;
+}
+
+// rmdir — удаление пользователя; root и системные аккаунты не трогаем
+static int vfs_fuse_rmdir(const char *path) {
+    fuse_index_refresh();
+    char name[NAME_MAX + 1];
+    const char *file = NULL;
+    if (fuse_split_path(path, name, sizeof(name), &file) != 1) return -ENOTDIR;
+    const UserRecord *u = fuse_find_user(name);
+    if (!u) return -ENOENT;
+    if (geteuid() != 0 || u->uid < 1000 || !fuse_accounts_writable) return -EPERM;
+
+    char *argv[] = { "userdel", "-r", name, NULL };
+    if (fuse_run(argv) != 0) return -EIO;
+    fuse_index_refresh();
+    return user_index_find(&fuse_index, name) ? -EIO : 0;
+}
+
+static const struct fuse_operations vfs_fuse_ops = {
+    .getattr  = vfs_fuse_getattr,
+    .readdir  = vfs_fuse_readdir,
+    .open     = vfs_fuse_open,
+    .read     = vfs_fuse_read,
+    .readlink = vfs_fuse_readlink,
+    .mkdir    = vfs_fuse_mkdir,
+    .rmdir    = vfs_fuse_rmdir,
+};
+
+static void *vfs_fuse_loop(void *arg) {
+    (void)arg;
+    fuse_loop(vfs_fuse);
+    return NULL;
+}
+
+int vfs_fuse_start() {
+    char *users_dir = get_users_dir_path();
+    if (mkdir(users_dir, 0755) == -1 && errno != EEXIST) {
+        perror("Ошибка создания директории пользователей");
+        return -1;
+    }
+
+    // Под root VFS должен быть виден и остальным пользователям
+    char *fuse_argv[] = { "kubsh", "-o", "default_permissions", "-o", "allow_other", NULL };
+    struct fuse_args args = FUSE_ARGS_INIT(geteuid() == 0 ? 5 : 3, fuse_argv);
+    vfs_fuse = fuse_new(&args, &vfs_fuse_ops, sizeof(vfs_fuse_ops), NULL);
+    fuse_opt_free_args(&args);
+    if (!vfs_fuse) return -1;
+
+    if (fuse_mount(vfs_fuse, users_dir) != 0) {
+        fuse_destroy(vfs_fuse);
+        vfs_fuse = NULL;
+        return -1;
+    }
+    fuse_mount_time = time(NULL);
+    snprintf(fuse_passwd_file, sizeof(fuse_passwd_file), "%s", config.passwd_file);
+    fuse_accounts_writable = accounts_writable();
+    if (pthread_create(&vfs_fuse_thread, NULL, vfs_fuse_loop, NULL) != 0) {
+        fuse_unmount(vfs_fuse);
+        fuse_destroy(vfs_fuse);
+        vfs_fuse = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void vfs_fuse_stop() {
+    if (!vfs_fuse) return;
+    fuse_exit(vfs_fuse);
+    // После размонтирования чтение /dev/fuse в потоке завершается и fuse_loop() выходит
+    fuse_unmount(vfs_fuse);
+    pthread_join(vfs_fuse_thread, NULL);
+    fuse_destroy(vfs_fuse);
+    vfs_fuse = NULL;
+    user_index_free(&fuse_index);
+}
+#endif
+
+// --- Конфигурация ---
+// Сначала /etc/kubsh.conf, затем ~/.kubshrc (перекрывает). Строки "ключ = значение",
+// '#' в начале строки — комментарий:
+//   vfs_root = /srv/users        корень VFS
+//   sync = inotify | poll        как замечать изменения passwd и VFS
+//   sync_interval = 200          период опроса, мс
+//   history_size = 100000        ёмкость истории в памяти
+//   format = text | json | csv | tsv
+//   passwd_file = /etc/passwd    источник пользователей VFS (для тестов и замеров;
+//                                с другим файлом adduser/userdel и создание
+//                                пользователей из VFS отключены)
+//   stats_file = /var/lib/kubsh/stats.prom   выгрузка \stats в текстовом формате
+//                                Prometheus (интерактивный сеанс и --daemon)
+//   stats_interval = 10          не чаще раза в N секунд
+// По SIGHUP файлы перечитываются целиком в новую структуру; при ошибке остаётся
+// старая. Применяются только изменившиеся ключи, и перестраивается только то,
+// что от них зависит: VFS и наблюдение, кольцо истории, формат вывода.
+
+static char *config_trim(char *s) {
+    while (*s == ' ' || *s == '\t') s++;
+    char *end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) end--;
+    *end = '\0';
+    if (end - s >= 2 && ((*s == '"' && end[-1] == '"') || (*s == '\'' && end[-1] == '\''))) {
+        end[-1] = '\0';
+        s++;
+    }
+    return s;
+}
+
+static int config_set(Config *c, const char *key, const char *val) {
+    char *end;
+    if (strcmp(key, "vfs_root") == 0) {
+        // Запас на /имя/файл внутри корня: длиннее корень не принимаем, а не обрезаем
+        int len;
+        if (val[0] == '~' && (val[1] == '/' || !val[1])) {
+            len = snprintf(c->vfs_root, sizeof(c->vfs_root), "%s%s", get_home_path(), val + 1);
+        } else if (val[0] == '/') {
+            len = snprintf(c->vfs_root, sizeof(c->vfs_root), "%s", val);
+        } else {
+            return -1;
+        }
+        if (len < 0 || len >= PATH_MAX - NAME_MAX) return -1;
+        // Без завершающего '/': путь сравнивается при перечитывании
+        while (len > 1 && c->vfs_root[len - 1] == '/') c->vfs_root[--len] = '\0';
+    } else if (strcmp(key, "sync") == 0) {
+        if (strcmp(val, "inotify") == 0) c->sync_poll = 0;
+        else if (strcmp(val, "poll") == 0) c->sync_poll = 1;
+        else return -1;
+    } else if (strcmp(key, "sync_interval") == 0) {
+        long ms = strtol(val, &end, 10);
+        if (*end || ms < 10 || ms > 3600000) return -1;
+        c->sync_interval_ms = ms;
+    } else if (strcmp(key, "history_size") == 0) {
+        long n = strtol(val, &end, 10);
+        if (*end || n <= 0) return -1;
+        c->history_size = n;
+    } else if (strcmp(key, "format") == 0) {
+        if ((c->format = parse_format(val)) == -1) return -1;
+    } else if (strcmp(key, "passwd_file") == 0) {
+        if (val[0] != '/') return -1;
+        snprintf(c->passwd_file, sizeof(c->passwd_file), "%s", val);
+    } else if (strcmp(key, "stats_file") == 0) {
+        if (val[0] && val[0] != '/') return -1;
+        snprintf(c->stats_file, sizeof(c->stats_file), "%s", val);
+    } else if (strcmp(key, "stats_interval") == 0) {
+        long sec = strtol(val, &end, 10);
+        if (*end || sec < 1 || sec > 86400) return -1;
+        c->stats_interval = sec;
+    } else {
+        return -2;
+    }
+    return 0;
+}
+
+// Нет файла — не ошибка
+static int config_parse_file(const char *path, Config *c) {
+    FILE *f = k_fopen(path, "re");
+    if (!f) {
+        if (errno == ENOENT) return 0;
+        fprintf(stderr, "kubsh: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int rc = 0, lineno = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) > 0) {
+        lineno++;
+        char *key = config_trim(line);
+        if (!*key || *key == '#') continue;
+        char *eq = strchr(key, '=');
+        if (!eq) {
+            fprintf(stderr, "kubsh: %s:%d: ожидается ключ = значение\n", path, lineno);
+            rc = -1;
+            continue;
+        }
+        *eq = '\0';
+        char *val = config_trim(eq + 1);
+        key = config_trim(key);
+        int err = config_set(c, key, val);
+        if (err == -2) fprintf(stderr, "kubsh: %s:%d: неизвестный ключ '%s'\n", path, lineno, key);
+        else if (err) fprintf(stderr, "kubsh: %s:%d: недопустимое значение %s = %s\n", path, lineno, key, val);
+        if (err) rc = -1;
+    }
+    free(line);
+    fclose(f);
+    return rc;
+}
+
+int config_load(Config *c) {
+    *c = (Config){ "", 0, SYNC_POLL_INTERVAL_MS, DEFAULT_HISTORY_SIZE, FMT_TEXT, PASSWD_FILE, "", STATS_EXPORT_INTERVAL };
+    char user_path[PATH_MAX];
+    snprintf(user_path, sizeof(user_path), "%s/%s", get_home_path(), USER_CONFIG_FILE);
+    int rc = config_parse_file(SYSTEM_CONFIG_FILE, c);
+    if (config_parse_file(user_path, c) == -1) rc = -1;
+    return rc;
+}
+
+// Переход VFS на новый корень: снимок, манифест и наблюдение относятся к старому
+static void vfs_switch_root() {
+    vfs_watch_close();
+    user_set_free(&vfs_snapshot);
+    vfs_snapshot_valid = 0;
+    name_list_free(&pending_dirs_added);
+    name_list_free(&pending_dirs_removed);
+    user_set_free(&vfs_manifest);
+    vfs_manifest_loaded = vfs_manifest_dirty = 0;
     create_users_vfs();
-    load_history();
-    
-    // Синхронизируем VFS при запуске (для тестов)
-    sync_vfs_with_system();
+}
+
+// SIGHUP: перечитать конфигурацию и применить изменения. Возвращает 1, если сигнал был.
+int config_reload_pending() {
+    char buf[64];
+    int got = 0;
+    while (reload_pipe[0] != -1 && read(reload_pipe[0], buf, sizeof(buf)) > 0) got = 1;
+    if (!got) return 0;
+
+    Config next;
+    if (config_load(&next) == -1) {
+        fprintf(stderr, "kubsh: конфигурация не изменена из-за ошибок\n");
+    } else {
+        Config old = config;
+        char old_root[sizeof(config.vfs_root)];
+        snprintf(old_root, sizeof(old_root), "%s", get_users_dir_path());
+        if (fuse_mode) {
+            // Точку монтирования FUSE на лету не перенести, а поток FUSE читает
+            // снимок passwd_file со старта — оставляем его, чтобы VFS и команды сходились
+            memcpy(next.vfs_root, old.vfs_root, sizeof(next.vfs_root));
+            memcpy(next.passwd_file, old.passwd_file, sizeof(next.passwd_file));
+        }
+        config = next;
+
+        int root_changed = strcmp(old_root, get_users_dir_path()) != 0;
+        int passwd_changed = strcmp(old.passwd_file, config.passwd_file) != 0;
+        if (passwd_changed) user_index_valid = 0;
+        if (root_changed) vfs_switch_root();
+        if (!fuse_mode && (root_changed || passwd_changed || old.sync_poll != config.sync_poll)) {
+            if (config.sync_poll) vfs_watch_close();
+            else vfs_watch_init();
+            sync_vfs_with_system();
+        }
+        if (history && history_capacity() != history_cap) {
+            // Кольцо заново заполняется из журнала: там есть и команды этой сессии
+            free_history();
+            history_cap = history_capacity();
+            load_history();
+        }
+        if (old.format != config.format) output_format = config.format;
+    }
+
+    // В пакетном режиме и у сервера stdout — данные (--format=json|csv): сообщение в stderr
+    if (interactive) {
+        printf("\nConfiguration reloaded (SIGHUP received)\n");
+        fflush(stdout);
+    } else {
+        fprintf(stderr, "kubsh: Configuration reloaded (SIGHUP received)\n");
+    }
+    return 1;
+}
+
+// --- Чтение ввода ---
+// Строки читаются из дескриптора собственным буфером без ограничения длины.
+// В отличие от fgets(), видно, остались ли в буфере готовые строки: ждать
+// ввода в select() (и сбрасывать stdout) нужно только когда их нет.
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t pos;          // начало непрочитанных данных
+    size_t len;          // конец данных
+    size_t cap;
+    int eof;
+} LineReader;
+
+// Один read() в буфер. Возвращает число байт, 0 при EOF, -1 при ошибке.
+ssize_t line_reader_fill(LineReader *r) {
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    if (r->cap - r->len < 4096) {
+        r->cap = r->cap ? r->cap * 2 : 65536;
+        r->buf = realloc(r->buf, r->cap);
+        if (!r->buf) { perror("realloc"); exit(1); }
+    }
+    ssize_t n;
+    do {
+        n = read(r->fd, r->buf + r->len, r->cap - r->len);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) r->eof = 1;
+    else r->len += n;
+    return n;
+}
+
+// Готовая строка из буфера (без '\n') или NULL. После EOF отдаёт и неполный хвост.
+// Указатель действителен до следующего вызова.
+char *line_reader_take(LineReader *r) {
+    if (r->pos >= r->len) return NULL;
+    char *start = r->buf + r->pos;
+    char *nl = memchr(start, '\n', r->len - r->pos);
+    if (!nl) {
+        if (!r->eof) return NULL;
+        if (r->len == r->cap) {
+            r->buf = realloc(r->buf, ++r->cap);
+            if (!r->buf) { perror("realloc"); exit(1); }
+            start = r->buf + r->pos;
+        }
+        nl = r->buf + r->len;
+    }
+    *nl = '\0';
+    r->pos = nl - r->buf + 1;
+    if (r->pos > r->len) r->pos = r->len;
+    return start;
+}
+
+// Блокирующее чтение следующей строки; NULL — конец ввода
+char *line_reader_next(LineReader *r) {
+    char *line;
+    while (!(line = line_reader_take(r))) {
+        if (r->eof || line_reader_fill(r) <= 0) return line_reader_take(r);
+    }
+    return line;
+}
+
+// --- Дополнение по Tab ---
+// Кандидаты берутся из префиксных деревьев: имена встроенных команд (строится один
+// раз), пользователи из индекса passwd (перестраивается, когда индекс перечитан) и
+// исполняемые файлы из PATH. Каталоги PATH сканируются заново, только если сменился
+// сам PATH или mtime каталога, так что на каждый Tab — по одному stat() на каталог.
+
+typedef struct {
+    uint32_t child;       // первый потомок, 0 — нет (корень потомком не бывает)
+    uint32_t next;        // следующий брат; братья упорядочены по ch
+    unsigned char ch;
+    unsigned char end;    // здесь заканчивается слово
+} TrieNode;
+
+typedef struct {
+    TrieNode *nodes;      // nodes[0] — корень
+    size_t count, cap;
+} Trie;
+
+static uint32_t trie_node(Trie *t, unsigned char ch) {
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 256;
+        t->nodes = realloc(t->nodes, t->cap * sizeof(TrieNode));
+        if (!t->nodes) { perror("realloc"); exit(1); }
+    }
+    t->nodes[t->count] = (TrieNode){ 0, 0, ch, 0 };
+    return t->count++;
+}
+
+void trie_insert(Trie *t, const char *word) {
+    if (!t->count) trie_node(t, 0);
+    uint32_t n = 0;
+    for (const unsigned char *p = (const unsigned char *)word; *p; p++) {
+        uint32_t prev = 0, c = t->nodes[n].child;
+        while (c && t->nodes[c].ch < *p) {
+            prev = c;
+            c = t->nodes[c].next;
+        }
+        if (!c || t->nodes[c].ch != *p) {
+            uint32_t m = trie_node(t, *p);
+            t->nodes[m].next = c;
+            if (prev) t->nodes[prev].next = m;
+            else t->nodes[n].child = m;
+            c = m;
+        }
+        n = c;
+    }
+    t->nodes[n].end = 1;
+}
+
+void trie_free(Trie *t) {
+    free(t->nodes);
+    memset(t, 0, sizeof(*t));
+}
+
+static void trie_walk(const Trie *t, uint32_t n, char *word, size_t len, size_t size, NameList *out) {
+    if (t->nodes[n].end) {
+        word[len] = '\0';
+        name_list_push(out, word);
+    }
+    if (len + 1 >= size) return;
+    for (uint32_t c = t->nodes[n].child; c; c = t->nodes[c].next) {
+        word[len] = t->nodes[c].ch;
+        trie_walk(t, c, word, len + 1, size, out);
+    }
+}
+
+// Все слова с префиксом prefix — в out, по возрастанию
+void trie_complete(const Trie *t, const char *prefix, NameList *out) {
+    if (!t->count) return;
+    uint32_t n = 0;
+    for (const unsigned char *p = (const unsigned char *)prefix; *p; p++) {
+        uint32_t c = t->nodes[n].child;
+        while (c && t->nodes[c].ch < *p) c = t->nodes[c].next;
+        if (!c || t->nodes[c].ch != *p) return;
+        n = c;
+    }
+    char word[PATH_MAX];
+    size_t len = strlen(prefix);
+    if (len >= sizeof(word)) return;
+    memcpy(word, prefix, len);
+    trie_walk(t, n, word, len, sizeof(word), out);
+}
 
-    printf("KubShell с VFS\nVFS: %s\nВведите 'help' для справки\n\n", get_users_dir_path());
+static Trie builtin_trie, user_trie, path_trie;
+static unsigned user_trie_generation;
 
-    char input[MAX_INPUT_SIZE];
-    while (1) {
-        // Синхронизируем VFS ПЕРЕД каждым промптом (для тестов)
-        // Это гарантирует, что новые директории будут обнаружены
-        // даже если они созданы после запуска kubsh
+static void builtin_trie_refresh() {
+    if (builtin_trie.count) return;
+    for (size_t i = 0; i < NBUILTINS; i++) trie_insert(&builtin_trie, builtins[i].name);
+    trie_insert(&builtin_trie, "cd");
+    trie_insert(&builtin_trie, "\\q");
+}
+
+static void user_trie_refresh() {
+    user_index_refresh();
+    if (user_trie.count && user_trie_generation == user_index_generation) return;
+    trie_free(&user_trie);
+    trie_insert(&user_trie, "");
+    for (size_t i = 0; i < user_index.count; i++) trie_insert(&user_trie, user_index.users[i].name);
+    user_trie_generation = user_index_generation;
+}
+
+typedef struct {
+    char *dir;
+    struct timespec mtime;
+    int scanned;
+    NameList names;       // исполняемые файлы каталога
+} PathDir;
+
+static PathDir *path_dirs;
+static size_t path_ndirs;
+static char *path_dirs_env;     // PATH, по которому составлен path_dirs
+
+static void path_dir_scan(PathDir *d) {
+    name_list_free(&d->names);
+    DIR *dir = k_opendir(d->dir[0] ? d->dir : ".");
+    if (!dir) return;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (e->d_name[0] == '.' || e->d_type == DT_DIR) continue;
+        if (faccessat(dirfd(dir), e->d_name, X_OK, 0) == 0) name_list_push(&d->names, e->d_name);
+    }
+    closedir(dir);
+}
+
+static void path_trie_refresh() {
+    const char *env = getenv("PATH");
+    if (!env) env = "/usr/local/bin:/usr/bin:/bin";
+    int stale = !path_trie.count;
+
+    if (!path_dirs_env || strcmp(path_dirs_env, env) != 0) {
+        // Новый список каталогов; уже просканированные переносятся из старого
+        size_t n = 1;
+        for (const char *p = env; *p; p++) n += *p == ':';
+        PathDir *dirs = calloc(n, sizeof(PathDir));
+        if (!dirs) return;
+        const char *dir = env;
+        for (size_t i = 0; i < n; i++) {
+            const char *colon = strchr(dir, ':');
+            size_t dlen = colon ? (size_t)(colon - dir) : strlen(dir);
+            for (size_t j = 0; j < path_ndirs && !dirs[i].dir; j++) {
+                if (path_dirs[j].dir && strlen(path_dirs[j].dir) == dlen &&
+                    strncmp(path_dirs[j].dir, dir, dlen) == 0) {
+                    dirs[i] = path_dirs[j];
+                    path_dirs[j] = (PathDir){0};
+                }
+            }
+            if (!dirs[i].dir) dirs[i].dir = strndup(dir, dlen);
+            dir = colon ? colon + 1 : dir + dlen;
+        }
+        for (size_t j = 0; j < path_ndirs; j++) {
+            free(path_dirs[j].dir);
+            name_list_free(&path_dirs[j].names);
+        }
+        free(path_dirs);
+        path_dirs = dirs;
+        path_ndirs = n;
+        free(path_dirs_env);
+        path_dirs_env = strdup(env);
+        stale = 1;
+    }
+
+    for (size_t i = 0; i < path_ndirs; i++) {
+        PathDir *d = &path_dirs[i];
+        struct stat st;
+        if (k_stat(d->dir[0] ? d->dir : ".", &st) == -1) {
+            if (!d->scanned || d->names.count) stale = 1;
+            name_list_free(&d->names);
+            d->scanned = 1;
+            continue;
+        }
+        if (d->scanned && st.st_mtim.tv_sec == d->mtime.tv_sec && st.st_mtim.tv_nsec == d->mtime.tv_nsec) continue;
+        path_dir_scan(d);
+        d->mtime = st.st_mtim;
+        d->scanned = 1;
+        stale = 1;
+    }
+
+    if (!stale) return;
+    trie_free(&path_trie);
+    trie_insert(&path_trie, "");
+    for (size_t i = 0; i < path_ndirs; i++) {
+        for (size_t j = 0; j < path_dirs[i].names.count; j++) trie_insert(&path_trie, path_dirs[i].names.items[j]);
+    }
+}
+
+void completion_free() {
+    trie_free(&builtin_trie);
+    trie_free(&user_trie);
+    trie_free(&path_trie);
+    for (size_t i = 0; i < path_ndirs; i++) {
+        free(path_dirs[i].dir);
+        name_list_free(&path_dirs[i].names);
+    }
+    free(path_dirs);
+    free(path_dirs_env);
+    path_dirs = NULL;
+    path_dirs_env = NULL;
+    path_ndirs = 0;
+}
+
+static int completion_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Кандидаты для слова word; cmd — команда, к которой относится слово (NULL, если
+// дополняется сама команда). Результат отсортирован и без повторов.
+void complete_word(const char *cmd, const char *word, NameList *out) {
+    if (!cmd) {
+        builtin_trie_refresh();
+        trie_complete(&builtin_trie, word, out);
+        if (!strchr(word, '/')) {
+            path_trie_refresh();
+            trie_complete(&path_trie, word, out);
+        }
+    } else if (strcmp(cmd, "adduser") == 0 || strcmp(cmd, "userdel") == 0) {
+        user_trie_refresh();
+        trie_complete(&user_trie, word, out);
+    }
+    if (out->count < 2) return;
+    qsort(out->items, out->count, sizeof(char *), completion_cmp);
+    size_t kept = 1;
+    for (size_t i = 1; i < out->count; i++) {
+        if (strcmp(out->items[i], out->items[kept - 1]) == 0) free(out->items[i]);
+        else out->items[kept++] = out->items[i];
+    }
+    out->count = kept;
+}
+
+// --- Редактор строки ---
+// На терминале строка набирается в raw-режиме самим kubsh: правка, история и
+// поиск по ней, дополнение. Байты приходят из того же LineReader, что и без
+// терминала, поэтому главный цикл по-прежнему ждёт в select() вместе с inotify и
+// заданиями. Длинная строка прокручивается по горизонтали, длина не ограничена.
+//   ←/→ Ctrl-B/F, Alt-B/F — курсор; Home/End Ctrl-A/E; ↑/↓ Ctrl-P/N — история;
+//   Ctrl-R — поиск по истории; Tab — дополнение; Ctrl-K/U/W — удаление до конца,
+//   до начала, слова; Ctrl-L — очистить экран; Ctrl-C — сбросить строку; Ctrl-D — выход
+
+#define EDITOR_PROMPT "kubsh> "
+#define EDITOR_MAX_LISTED 100   // больше кандидатов по двойному Tab не показываем
+
+enum {
+    KEY_INCOMPLETE = -2, KEY_NONE = -1,
+    KEY_UP = 256, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_DELETE,
+    KEY_WORD_LEFT, KEY_WORD_RIGHT, KEY_ESC
+};
+
+typedef struct {
+    int enabled;              // stdin и stdout — терминал
+    int active;               // строка на экране, терминал в raw-режиме
+    struct termios cooked;
+    char *buf;
+    size_t len, pos, cap;     // pos — курсор, в байтах
+    size_t scroll;            // первый видимый символ
+    size_t hist_pos;          // листаемая команда истории; history_count — новая строка
+    char *stash;              // набранное до листания истории или поиска
+    int searching;
+    char query[256];
+    long match;               // найденная команда истории, -1 — нет
+    int last_tab;
+} LineEditor;
+
+LineEditor editor;
+
+static size_t utf8_chars(const char *s, size_t n) {
+    size_t chars = 0;
+    for (size_t i = 0; i < n; i++) chars += ((unsigned char)s[i] & 0xC0) != 0x80;
+    return chars;
+}
+
+// Смещение после n символов, начиная с from
+static size_t utf8_advance(const char *s, size_t len, size_t from, size_t n) {
+    while (from < len && n > 0) {
+        from++;
+        while (from < len && ((unsigned char)s[from] & 0xC0) == 0x80) from++;
+        n--;
+    }
+    return from;
+}
+
+// Начало символа перед pos
+static size_t utf8_prev(const char *s, size_t pos) {
+    while (pos > 0 && ((unsigned char)s[--pos] & 0xC0) == 0x80) {}
+    return pos;
+}
+
+static void editor_reserve(LineEditor *e, size_t extra) {
+    if (e->len + extra + 1 <= e->cap) return;
+    while (e->len + extra + 1 > e->cap) e->cap = e->cap ? e->cap * 2 : 256;
+    e->buf = realloc(e->buf, e->cap);
+    if (!e->buf) { perror("realloc"); exit(1); }
+}
+
+static void editor_insert(LineEditor *e, const char *s, size_t n) {
+    editor_reserve(e, n);
+    memmove(e->buf + e->pos + n, e->buf + e->pos, e->len - e->pos);
+    memcpy(e->buf + e->pos, s, n);
+    e->len += n;
+    e->pos += n;
+    e->buf[e->len] = '\0';
+}
+
+static void editor_erase(LineEditor *e, size_t from, size_t to) {
+    memmove(e->buf + from, e->buf + to, e->len - to);
+    e->len -= to - from;
+    e->buf[e->len] = '\0';
+    if (e->pos > to) e->pos -= to - from;
+    else if (e->pos > from) e->pos = from;
+}
+
+static void editor_set(LineEditor *e, const char *s) {
+    e->len = e->pos = 0;
+    editor_insert(e, s, strlen(s));
+}
+
+static int terminal_width() {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return 80;
+    return ws.ws_col;
+}
+
+static void editor_redraw(LineEditor *e) {
+    static OutBuf out;
+    char prompt[sizeof(e->query) + 64];
+    if (e->searching) {
+        snprintf(prompt, sizeof(prompt), "(%s '%s'): ", e->match == -1 && e->query[0] ? "нет совпадений" : "поиск",
+                 e->query);
+    } else {
+        snprintf(prompt, sizeof(prompt), "%s", EDITOR_PROMPT);
+    }
+    size_t prompt_cols = utf8_chars(prompt, strlen(prompt));
+    size_t width = terminal_width();
+    size_t avail = width > prompt_cols + 1 ? width - prompt_cols - 1 : 1;
+    size_t cursor = utf8_chars(e->buf, e->pos);
+    if (cursor < e->scroll) e->scroll = cursor;
+    if (cursor > e->scroll + avail) e->scroll = cursor - avail;
+    size_t start = utf8_advance(e->buf, e->len, 0, e->scroll);
+    size_t end = utf8_advance(e->buf, e->len, start, avail);
+
+    out.len = 0;
+    out_put(&out, "\r", 1);
+    out_put(&out, prompt, strlen(prompt));
+    out_put(&out, e->buf + start, end - start);
+    out_put(&out, "\x1b[K\r", 4);
+    if (prompt_cols + cursor - e->scroll) out_printf(&out, "\x1b[%zuC", prompt_cols + cursor - e->scroll);
+    out_flush(&out);
+    fflush(stdout);
+}
+
+static void editor_raw(LineEditor *e, int on) {
+    struct termios t = e->cooked;
+    if (on) {
+        // OPOST остаётся: сообщения фоновых заданий печатаются обычным "\n"
+        t.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK | ISTRIP);
+        t.c_lflag &= ~(ICANON | ECHO | IEXTEN | ISIG);
+        t.c_cc[VMIN] = 1;
+        t.c_cc[VTIME] = 0;
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &t);
+}
+
+static void editor_restore() {
+    if (editor.active) editor_raw(&editor, 0);
+}
+
+// Редактор включается, только если и ввод, и вывод — терминал
+void editor_init(LineEditor *e) {
+    const char *term = getenv("TERM");
+    e->enabled = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && !(term && strcmp(term, "dumb") == 0) &&
+                 tcgetattr(STDIN_FILENO, &e->cooked) == 0;
+    if (e->enabled) atexit(editor_restore);
+}
+
+// Новая строка: приглашение и raw-режим
+void editor_start(LineEditor *e) {
+    e->len = e->pos = e->scroll = 0;
+    editor_reserve(e, 0);
+    e->buf[0] = '\0';
+    e->hist_pos = history_count;
+    e->searching = 0;
+    e->last_tab = 0;
+    free(e->stash);
+    e->stash = NULL;
+    fflush(stdout);
+    editor_raw(e, 1);
+    e->active = 1;
+    editor_redraw(e);
+}
+
+static void editor_stop(LineEditor *e) {
+    editor_raw(e, 0);
+    e->active = 0;
+}
+
+// Перед выводом посторонних сообщений строка стирается, после — рисуется заново
+void editor_hide(LineEditor *e) {
+    if (!e->active) return;
+    fflush(stdout);
+    (void)!write(STDOUT_FILENO, "\r\x1b[K", 4);
+}
+
+void editor_show(LineEditor *e) {
+    if (e->active) editor_redraw(e);
+}
+
+void editor_free(LineEditor *e) {
+    free(e->buf);
+    free(e->stash);
+    e->buf = e->stash = NULL;
+    e->cap = 0;
+}
+
+// Следующая клавиша из буфера ввода. Управляющие последовательности ESC [ ... и
+// ESC O ... разбираются целиком; неполная в конце буфера ждёт продолжения.
+static int editor_next_key(LineReader *r) {
+    if (r->pos >= r->len) return KEY_NONE;
+    const unsigned char *s = (const unsigned char *)r->buf + r->pos;
+    size_t n = r->len - r->pos;
+    if (s[0] != 27) {
+        r->pos++;
+        return s[0];
+    }
+    if (n == 1) {
+        r->pos++;
+        return KEY_ESC;
+    }
+    if (s[1] == 'b' || s[1] == 'f') {
+        r->pos += 2;
+        return s[1] == 'b' ? KEY_WORD_LEFT : KEY_WORD_RIGHT;
+    }
+    if (s[1] != '[' && s[1] != 'O') {
+        r->pos++;
+        return KEY_ESC;
+    }
+    size_t i = 2;
+    while (i < n && ((s[i] >= '0' && s[i] <= '9') || s[i] == ';')) i++;
+    if (i == n) {
+        if (!r->eof) return KEY_INCOMPLETE;
+        r->pos = r->len;
+        return KEY_ESC;
+    }
+    r->pos += i + 1;
+    int param = atoi((const char *)s + 2);
+    int ctrl = memchr(s + 2, ';', i - 2) && s[i - 1] == '5';
+    switch (s[i]) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return ctrl ? KEY_WORD_RIGHT : KEY_RIGHT;
+    case 'D': return ctrl ? KEY_WORD_LEFT : KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    case '~':
+        if (param == 1 || param == 7) return KEY_HOME;
+        if (param == 4 || param == 8) return KEY_END;
+        if (param == 3) return KEY_DELETE;
+        return KEY_NONE;
+    }
+    return KEY_NONE;
+}
+
+static void editor_history(LineEditor *e, int older) {
+    if (older ? e->hist_pos == 0 : e->hist_pos >= history_count) return;
+    if (e->hist_pos >= history_count) {
+        free(e->stash);
+        e->stash = strdup(e->buf);
+    }
+    e->hist_pos += older ? -1 : 1;
+    editor_set(e, e->hist_pos < history_count ? history_at(e->hist_pos) : e->stash ? e->stash : "");
+}
+
+// Поиск от команды before (не включая) к началу истории
+static void editor_search(LineEditor *e, size_t before) {
+    long found = e->query[0] ? history_search(e->query, before) : -1;
+    if (found == -1) {
+        if (!e->query[0]) e->match = -1;
+        else if (e->match != -1 && before > (size_t)e->match) e->match = -1;
+        return;
+    }
+    e->match = found;
+    const char *line = history_at(found);
+    editor_set(e, line);
+    e->pos = strstr(line, e->query) - line;
+}
+
+// Двойной Tab: кандидаты столбцами под строкой
+static void editor_list(LineEditor *e, const NameList *names) {
+    size_t widest = 0;
+    for (size_t i = 0; i < names->count; i++) {
+        size_t w = utf8_chars(names->items[i], strlen(names->items[i]));
+        if (w > widest) widest = w;
+    }
+    size_t shown = names->count < EDITOR_MAX_LISTED ? names->count : EDITOR_MAX_LISTED;
+    size_t columns = terminal_width() / (widest + 2);
+    if (columns == 0) columns = 1;
+    size_t rows = (shown + columns - 1) / columns;
+
+    editor_hide(e);
+    for (size_t r = 0; r < rows; r++) {
+        for (size_t c = 0; c < columns; c++) {
+            size_t i = c * rows + r;
+            if (i >= shown) break;
+            size_t w = utf8_chars(names->items[i], strlen(names->items[i]));
+            printf("%s%*s", names->items[i], c + 1 < columns ? (int)(widest + 2 - w) : 0, "");
+        }
+        printf("\n");
+    }
+    if (shown < names->count) printf("... и ещё %zu\n", names->count - shown);
+    editor_show(e);
+}
+
+static void editor_complete(LineEditor *e) {
+    size_t start = e->pos;
+    while (start > 0 && !strchr(" \t|<>", e->buf[start - 1])) start--;
+    // Слово — команда, если до него в стадии конвейера ничего нет
+    size_t stage = start;
+    while (stage > 0 && e->buf[stage - 1] != '|') stage--;
+    while (stage < start && (e->buf[stage] == ' ' || e->buf[stage] == '\t')) stage++;
+    char *cmd = NULL;
+    if (stage < start) cmd = strndup(e->buf + stage, strcspn(e->buf + stage, " \t|<>"));
+    char *word = strndup(e->buf + start, e->pos - start);
+
+    NameList names = {0};
+    if (word && (stage == start || cmd)) complete_word(cmd, word, &names);
+    size_t wlen = word ? strlen(word) : 0;
+    if (names.count == 0) {
+        (void)!write(STDOUT_FILENO, "\a", 1);
+    } else {
+        // Общее начало всех кандидатов (список отсортирован: достаточно первого и последнего)
+        const char *first = names.items[0], *last = names.items[names.count - 1];
+        size_t common = 0;
+        while (first[common] && first[common] == last[common]) common++;
+        if (common > wlen) {
+            editor_insert(e, first + wlen, common - wlen);
+        }
+        if (names.count == 1) {
+            if (e->pos == e->len || e->buf[e->pos] != ' ') editor_insert(e, " ", 1);
+        } else if (common <= wlen) {
+            if (e->last_tab) editor_list(e, &names);
+            else (void)!write(STDOUT_FILENO, "\a", 1);
+        }
+    }
+    name_list_free(&names);
+    free(word);
+    free(cmd);
+}
+
+// Обработка клавиши; 1 — строка готова, -1 — конец ввода (Ctrl-D на пустой строке)
+static int editor_key(LineEditor *e, int key) {
+    if (e->searching) {
+        if (key == 18) {                           // Ctrl-R — дальше к началу
+            editor_search(e, e->match == -1 ? history_count : (size_t)e->match);
+            return 0;
+        }
+        if (key == 127 || key == 8) {
+            size_t n = strlen(e->query);
+            e->query[utf8_prev(e->query, n)] = '\0';
+            e->match = -1;
+            editor_search(e, history_count);
+            return 0;
+        }
+        if (key == 7 || key == 3) {                // Ctrl-G, Ctrl-C — отмена поиска
+            e->searching = 0;
+            editor_set(e, e->stash ? e->stash : "");
+            return 0;
+        }
+        if (key >= 32 && key < 256) {
+            size_t n = strlen(e->query);
+            if (n + 1 < sizeof(e->query)) {
+                e->query[n] = key;
+                e->query[n + 1] = '\0';
+            }
+            editor_search(e, e->match == -1 ? history_count : (size_t)e->match + 1);
+            return 0;
+        }
+        // Любая другая клавиша принимает найденное и действует как обычно
+        e->searching = 0;
+        if (e->match != -1) e->hist_pos = e->match;
+        if (key == KEY_ESC) return 0;
+    }
+
+    switch (key) {
+    case '\r': case '\n':
+        return 1;
+    case 1: case KEY_HOME:
+        e->pos = 0;
+        break;
+    case 5: case KEY_END:
+        e->pos = e->len;
+        break;
+    case 2: case KEY_LEFT:
+        e->pos = utf8_prev(e->buf, e->pos);
+        break;
+    case 6: case KEY_RIGHT:
+        e->pos = utf8_advance(e->buf, e->len, e->pos, 1);
+        break;
+    case KEY_WORD_LEFT:
+        while (e->pos > 0 && e->buf[e->pos - 1] == ' ') e->pos--;
+        while (e->pos > 0 && e->buf[e->pos - 1] != ' ') e->pos--;
+        break;
+    case KEY_WORD_RIGHT:
+        while (e->pos < e->len && e->buf[e->pos] == ' ') e->pos++;
+        while (e->pos < e->len && e->buf[e->pos] != ' ') e->pos++;
+        break;
+    case 127: case 8:
+        if (e->pos > 0) editor_erase(e, utf8_prev(e->buf, e->pos), e->pos);
+        break;
+    case 4:
+        if (e->len == 0) return -1;
+        /* fallthrough */
+    case KEY_DELETE:
+        if (e->pos < e->len) editor_erase(e, e->pos, utf8_advance(e->buf, e->len, e->pos, 1));
+        break;
+    case 11:
+        editor_erase(e, e->pos, e->len);
+        break;
+    case 21:
+        editor_erase(e, 0, e->pos);
+        break;
+    case 23: {
+        size_t from = e->pos;
+        while (from > 0 && e->buf[from - 1] == ' ') from--;
+        while (from > 0 && e->buf[from - 1] != ' ') from--;
+        editor_erase(e, from, e->pos);
+        break;
+    }
+    case 12:
+        (void)!write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+        break;
+    case 3:
+        // Ctrl-C: строка сбрасывается, как в sh
+        (void)!write(STDOUT_FILENO, "^C\n", 3);
+        e->len = e->pos = e->scroll = 0;
+        e->buf[0] = '\0';
+        e->hist_pos = history_count;
+        last_status = 130;
+        break;
+    case 16: case KEY_UP:
+        editor_history(e, 1);
+        break;
+    case 14: case KEY_DOWN:
+        editor_history(e, 0);
+        break;
+    case 9:
+        editor_complete(e);
+        break;
+    case 18:
+        free(e->stash);
+        e->stash = strdup(e->buf);
+        e->searching = 1;
+        e->query[0] = '\0';
+        e->match = -1;
+        break;
+    default:
+        if (key >= 32 && key < 256) {
+            char c = key;
+            editor_insert(e, &c, 1);
+        }
+        break;
+    }
+    return 0;
+}
+
+// Готовая строка или NULL, если нужно ещё ввода. Указатель действителен до
+// следующего editor_start(). Конец ввода (Ctrl-D, закрытый терминал) — r->eof.
+char *editor_take(LineEditor *e, LineReader *r) {
+    if (!e->active) return NULL;
+    int key, done = 0, changed = 0;
+    while (!done && (key = editor_next_key(r)) != KEY_NONE && key != KEY_INCOMPLETE) {
+        done = editor_key(e, key);
+        e->last_tab = key == 9;
+        changed = 1;
+    }
+    // Разобранные байты больше не нужны LineReader
+    if (r->pos == r->len) r->pos = r->len = 0;
+    if (!done && r->eof && r->pos >= r->len) done = e->len ? 1 : -1;
+    if (!done) {
+        if (changed) editor_redraw(e);
+        return NULL;
+    }
+
+    if (done == -1) {
+        editor_stop(e);
+        r->eof = 1;
+        return NULL;
+    }
+    e->pos = e->len;
+    editor_redraw(e);
+    (void)!write(STDOUT_FILENO, "\n", 1);
+    editor_stop(e);
+    return e->buf;
+}
+
+// Выполнение одной строки ввода; возвращает 0, если нужно выйти (\q)
+int handle_line(char *input) {
+    size_t len = strlen(input);
+    if (len && input[len-1] == '\r') input[--len] = '\0';
+    if (len == 0) return 1;
+    if (strcmp(input, "\\q") == 0) return 0;
+
+    count_event(CNT_COMMAND);
+    if (!batch_mode) add_to_history(input);
+    command_mutated_users = process_command(input);
+    return 1;
+}
+
+// Пакетный режим (kubsh -c '...', kubsh script.ksh): без приглашения, истории и
+// наблюдения за VFS, вывод полностью буферизован. VFS синхронизируется один раз в
+// конце — если команды меняли пользователей, /etc/passwd или корень VFS.
+int run_batch(LineReader *r) {
+    static char stdout_buf[65536];
+    setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+
+    struct stat passwd_before = {0}, vfs_before = {0};
+    k_stat(config.passwd_file, &passwd_before);
+    k_stat(get_users_dir_path(), &vfs_before);
+
+    char *line;
+    while ((line = line_reader_next(r)) != NULL) {
+        config_reload_pending();
+        if (!handle_line(line)) break;
+        // Как sh без терминала: фоновые команды подбираются молча и не ожидаются
+        if (shell_jobs) shell_jobs_reap(0);
+    }
+    // Фоновые задания пула должны закончиться до выхода
+    jobs_wait_all();
+    shell_jobs_hangup();
+
+    struct stat passwd_after = {0}, vfs_after = {0};
+    k_stat(config.passwd_file, &passwd_after);
+    k_stat(get_users_dir_path(), &vfs_after);
+    if (vfs_sync_pending || !passwd_stamp_equal(&passwd_after, &passwd_before) ||
+        vfs_after.st_mtim.tv_sec != vfs_before.st_mtim.tv_sec ||
+        vfs_after.st_mtim.tv_nsec != vfs_before.st_mtim.tv_nsec) {
         sync_vfs_with_system();
-        
-        printf("kubsh> ");
+    }
+    fflush(stdout);
+    return last_status;
+}
+
+// --- Режим сервера (kubsh --daemon) ---
+// Сервер держит в памяти индекс пользователей, снимок VFS и историю и выполняет
+// сценарии клиентов: kubsh -c сначала пробует подключиться к нему и только если
+// сервера нет, запускается целиком сам. Запрос — одно сообщение SOCK_SEQPACKET:
+// заголовок, текст сценария и окружение клиента, а в SCM_RIGHTS — его stdin,
+// stdout, stderr и текущий каталог. Команды выполняются прямо на этих дескрипторах,
+// в ответ уходит код завершения. Соединения обслуживает epoll, сценарии —
+// по одному: все они работают с общим состоянием VFS.
+
+#define DAEMON_MAGIC 0x4b534831u        // "KSH1"
+#define DAEMON_MAX_REQUEST (192 * 1024) // не больше буфера сокета по умолчанию
+#define DAEMON_MAX_CLIENTS 256
+
+typedef struct {
+    uint32_t magic;
+    int32_t format;          // output_format клиента
+    uint32_t script_len;
+    uint32_t env_len;        // строки NAME=value, каждая с '\0'
+    uint32_t nfds;           // 3 или 4 (с текущим каталогом)
+} DaemonRequest;
+
+// Сокет сервера: $KUBSH_SOCKET, /run/kubsh.sock под root,
+// иначе $XDG_RUNTIME_DIR/kubsh.sock или ~/.kubsh.sock
+char *get_socket_path() {
+    static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    const char *env = getenv("KUBSH_SOCKET");
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (env && *env) snprintf(path, sizeof(path), "%s", env);
+    else if (geteuid() == 0) snprintf(path, sizeof(path), "/run/kubsh.sock");
+    else if (runtime && *runtime) snprintf(path, sizeof(path), "%s/kubsh.sock", runtime);
+    else snprintf(path, sizeof(path), "%s/.kubsh.sock", get_home_path());
+    return path;
+}
+
+static int daemon_connect() {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", get_socket_path());
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// kubsh -c через сервер. Код завершения сценария или -1, если сервера нет
+// (или запрос не отправился) и выполнять нужно самим.
+int daemon_client_run(const char *script) {
+    int fd = daemon_connect();
+    if (fd == -1) return -1;
+
+    DaemonRequest req = { DAEMON_MAGIC, output_format, strlen(script), 0, 3 };
+    for (char **env = environ; env && *env; env++) req.env_len += strlen(*env) + 1;
+    size_t size = sizeof(req) + req.script_len + req.env_len;
+    char *msg = size <= DAEMON_MAX_REQUEST ? malloc(size) : NULL;
+    if (!msg) {
+        close(fd);
+        return -1;
+    }
+    char *p = msg + sizeof(req);
+    memcpy(p, script, req.script_len);
+    p += req.script_len;
+    for (char **env = environ; env && *env; env++) p = stpcpy(p, *env) + 1;
+
+    int fds[4] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1 };
+    fds[3] = k_open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fds[3] != -1) req.nfds = 4;
+    memcpy(msg, &req, sizeof(req));
+
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = { msg, size };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = ctl.buf, .msg_controllen = CMSG_SPACE(req.nfds * sizeof(int)) };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(req.nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, req.nfds * sizeof(int));
+
+    ssize_t sent = sendmsg(fd, &mh, MSG_NOSIGNAL);
+    free(msg);
+    if (fds[3] != -1) close(fds[3]);
+    if (sent != (ssize_t)size) {
+        // Сервер ничего не выполнил: сценарий целиком выполним сами
+        close(fd);
+        return -1;
+    }
+
+    int32_t status;
+    ssize_t n;
+    do {
+        n = recv(fd, &status, sizeof(status), 0);
+    } while (n == -1 && errno == EINTR);
+    close(fd);
+    if (n != sizeof(status)) {
+        fprintf(stderr, "kubsh: сервер %s оборвал соединение\n", get_socket_path());
+        return 255;
+    }
+    return status;
+}
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_stop_handler(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+// Выполнение одного запроса на дескрипторах клиента. -1 — соединение закрыть.
+static int daemon_serve(int cfd) {
+    char *msg = malloc(DAEMON_MAX_REQUEST);
+    if (!msg) return -1;
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } ctl;
+    struct iovec iov = { msg, DAEMON_MAX_REQUEST };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+    ssize_t n = recvmsg(cfd, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        free(msg);
+        return 0;
+    }
+
+    int fds[4], nfds = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); n > 0 && c; c = CMSG_NXTHDR(&mh, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int cnt = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < cnt; i++) {
+            int f;
+            memcpy(&f, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (nfds < 4) fds[nfds++] = f;
+            else close(f);
+        }
+    }
+
+    DaemonRequest req;
+    int ok = n >= (ssize_t)sizeof(req) && !(mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+    if (ok) {
+        memcpy(&req, msg, sizeof(req));
+        ok = req.magic == DAEMON_MAGIC && req.format >= FMT_TEXT && req.format <= FMT_TSV &&
+             (req.nfds == 3 || req.nfds == 4) && req.nfds == (uint32_t)nfds &&
+             (uint64_t)sizeof(req) + req.script_len + req.env_len == (uint64_t)n &&
+             (req.env_len == 0 || msg[n - 1] == '\0');
+    }
+    if (!ok) {
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        free(msg);
+        return -1;
+    }
+
+    // Окружение клиента: массив указателей прямо в буфер запроса
+    char *env_data = msg + sizeof(req) + req.script_len;
+    size_t nenv = 0;
+    for (size_t i = 0; i < req.env_len; i++) nenv += env_data[i] == '\0';
+    char **env = malloc((nenv + 1) * sizeof(char *));
+    LineReader in = { .fd = -1, .buf = malloc(req.script_len + 1), .eof = 1 };
+    int32_t status = 1;
+    if (env && in.buf) {
+        for (size_t i = 0, pos = 0; i < nenv; i++) {
+            env[i] = env_data + pos;
+            pos += strlen(env[i]) + 1;
+        }
+        env[nenv] = NULL;
+        memcpy(in.buf, msg + sizeof(req), req.script_len);
+        in.len = in.cap = req.script_len;
+
+        fflush(stdout);
+        fflush(stderr);
+        int saved[3], cwd = -1;
+        for (int i = 0; i < 3; i++) {
+            saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+            dup2(fds[i], i);
+        }
+        if (nfds == 4) {
+            cwd = k_open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fchdir(fds[3]) == -1) perror("kubsh: fchdir");
+        }
+        char **own_env = environ;
+        int own_format = output_format;
+        environ = env;
+        output_format = req.format;
+        batch_mode = 1;
+        last_status = 0;
+        daemon_client_fd = cfd;
+        daemon_client_gone = 0;
+
+        char *line;
+        while (!daemon_client_gone && (line = line_reader_next(&in)) != NULL) {
+            if (!handle_line(line)) break;
+        }
+        daemon_client_fd = -1;
+        // Как у kubsh -c: к ответу фоновые задания закончены, VFS синхронизирован
+        jobs_wait_all();
+        if (vfs_sync_pending) sync_vfs_with_system();
+        vfs_sync_pending = 0;
+        status = last_status;
+
         fflush(stdout);
+        fflush(stderr);
+        batch_mode = 0;
+        output_format = own_format;
+        environ = own_env;
+        if (cwd != -1) {
+            if (fchdir(cwd) == -1) perror("kubsh: fchdir");
+            close(cwd);
+        }
+        for (int i = 0; i < 3; i++) {
+            if (saved[i] != -1) {
+                dup2(saved[i], i);
+                close(saved[i]);
+            }
+        }
+    }
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+    free(in.buf);
+    free(env);
+    free(msg);
+    return send(cfd, &status, sizeof(status), MSG_NOSIGNAL) == sizeof(status) ? 0 : -1;
+}
 
-        // Пока ждём ввод, периодически синхронизируем VFS
-        while (1) {
-            sync_vfs_with_system();
+static int daemon_listen() {
+    const char *path = get_socket_path();
+    int fd = daemon_connect();
+    if (fd != -1) {
+        close(fd);
+        fprintf(stderr, "kubsh: сервер уже запущен (%s)\n", path);
+        return -1;
+    }
+    // Сокет остался от упавшего сервера
+    unlink(path);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("kubsh: socket");
+        return -1;
+    }
+    mode_t old = umask(0177);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old);
+    if (rc == -1 || listen(fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "kubsh: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
+int run_daemon(int watching) {
+    int lfd = daemon_listen();
+    if (lfd == -1) return 1;
+
+    struct sigaction sa = { .sa_handler = daemon_stop_handler };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = lfd };
+    epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+    if (reload_pipe[0] != -1) {
+        ev.data.fd = reload_pipe[0];
+        epoll_ctl(ep, EPOLL_CTL_ADD, reload_pipe[0], &ev);
+    }
+    if (sigchld_fd != -1) {
+        ev.data.fd = sigchld_fd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, sigchld_fd, &ev);
+    }
+    int watched_fd = -1, watched_jobs = -1;
+    int clients = 0;
+    printf("kubsh: сервер слушает %s\n", get_socket_path());
+    fflush(stdout);
+
+    while (!daemon_stop) {
+        // Канал заданий появляется при первом задании, inotify может пересоздаваться
+        if (vfs_watch_fd != watched_fd) {
+            if (vfs_watch_fd != -1) {
+                ev = (struct epoll_event){ .events = EPOLLIN, .data.fd = vfs_watch_fd };
+                epoll_ctl(ep, EPOLL_CTL_ADD, vfs_watch_fd, &ev);
+            }
+            watched_fd = vfs_watch_fd;
+        }
+        if (job_notify_fd != watched_jobs) {
+            ev = (struct epoll_event){ .events = EPOLLIN, .data.fd = job_notify_fd };
+            epoll_ctl(ep, EPOLL_CTL_ADD, job_notify_fd, &ev);
+            watched_jobs = job_notify_fd;
+        }
+
+        struct epoll_event events[64];
+        long timeout = watching ? -1 : config.sync_interval_ms;
+        long export_ms = stats_export_tick(0);
+        if (export_ms >= 0 && (timeout < 0 || export_ms < timeout)) timeout = export_ms;
+        int n = epoll_wait(ep, events, 64, timeout);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("kubsh: epoll_wait");
+            break;
+        }
+        if (n == 0 && !watching) sync_vfs_with_system();
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == lfd) {
+                int cfd;
+                while ((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+                    // Команды выполняются с правами сервера: только его же пользователь
+                    struct ucred cred;
+                    socklen_t len = sizeof(cred);
+                    if (clients >= DAEMON_MAX_CLIENTS ||
+                        getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+                        cred.uid != geteuid()) {
+                        close(cfd);
+                        continue;
+                    }
+                    ev = (struct epoll_event){ .events = EPOLLIN, .data.fd = cfd };
+                    epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &ev);
+                    clients++;
+                }
+            } else if (fd == reload_pipe[0]) {
+                config_reload_pending();
+                watching = fuse_mode || vfs_watch_fd != -1;
+                watched_fd = -2;
+            } else if (fd == vfs_watch_fd) {
+                vfs_watch_handle();
+                watching = vfs_watch_fd != -1 || fuse_mode;
+                watched_fd = -2;   // inotify мог открыться заново под тем же номером
+            } else if (fd == job_notify_fd) {
+                jobs_report();
+                fflush(stdout);
+            } else if (fd == sigchld_fd) {
+                sigchld_drain();
+                shell_jobs_reap(1);
+                fflush(stdout);
+            } else if ((events[i].events & (EPOLLHUP | EPOLLERR)) && !(events[i].events & EPOLLIN)) {
+                close(fd);
+                clients--;
+            } else if (daemon_serve(fd) == -1) {
+                close(fd);
+                clients--;
+            }
+        }
+    }
+
+    close(ep);
+    close(lfd);
+    unlink(get_socket_path());
+    return 0;
+}
+
+void usage() {
+    printf("Использование: kubsh [--format=text|json|csv|tsv] [--fuse] [--daemon | -c команды | сценарий]\n"
+           "  --daemon — сервер команд на %s; kubsh -c выполняется через него, если он запущен\n"
+           "Настройки: " SYSTEM_CONFIG_FILE ", ~/" USER_CONFIG_FILE " (перечитываются по SIGHUP)\n",
+           get_socket_path());
+}
+
+// Главная функция
+int main(int argc, char *argv[]) {
+    Config loaded;
+    if (config_load(&loaded) == 0) config = loaded;
+    output_format = config.format;
+    if (pipe2(reload_pipe, O_NONBLOCK | O_CLOEXEC) == -1) reload_pipe[0] = reload_pipe[1] = -1;
+    signal(SIGHUP, sighup_handler);
+    // Запись в закрытый канал конвейера не должна убивать сам kubsh
+    signal(SIGPIPE, SIG_IGN);
+
+    LineReader in = { .fd = STDIN_FILENO };
+    while (argc > 1 && strncmp(argv[1], "--format", 8) == 0) {
+        const char *name = argv[1][8] == '=' ? argv[1] + 9 : argv[1][8] == '\0' && argc > 2 ? argv[2] : "";
+        if (argv[1][8] == '\0' && argc > 2) { argc--; argv++; }
+        output_format = parse_format(name);
+        if (output_format == -1) {
+            fprintf(stderr, "kubsh: неизвестный формат '%s' (text, json, csv, tsv)\n", name);
+            return 2;
+        }
+        argc--;
+        argv++;
+    }
+    if (argc > 1 && strcmp(argv[1], "--fuse") == 0) {
+#ifdef KUBSH_FUSE
+        fuse_mode = 1;
+        argc--;
+        argv++;
+#else
+        fprintf(stderr, "kubsh: собран без поддержки FUSE (make FUSE=1)\n");
+        return 2;
+#endif
+    }
+    int daemon = argc > 1 && strcmp(argv[1], "--daemon") == 0;
+    if (argc > 1 && !daemon) {
+        batch_mode = 1;
+        interactive = 0;
+        if (strcmp(argv[1], "-c") == 0) {
+            if (argc < 3) { usage(); return 2; }
+            // Запущен сервер — сценарий выполнит он, без полного старта kubsh
+            int status = daemon_client_run(argv[2]);
+            if (status != -1) return status;
+            in.buf = strdup(argv[2]);
+            in.len = in.cap = strlen(argv[2]);
+            in.eof = 1;
+        } else if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+            usage();
+            return 0;
+        } else {
+            in.fd = k_open(argv[1], O_RDONLY | O_CLOEXEC);
+            if (in.fd == -1) {
+                fprintf(stderr, "kubsh: %s: %s\n", argv[1], strerror(errno));
+                return 127;
+            }
+        }
+        int status = run_batch(&in);
+        free(in.buf);
+        return status;
+    }
+
+    // Фоновые задания сообщают о себе через SIGCHLD в главном цикле
+    sigchld_init();
+
+    // stdin не терминал (echo ... | kubsh): без баннера и приглашения, вывод
+    // сбрасывается только перед ожиданием ввода, а не после каждой строки.
+    // Генерация VFS ленивая: неизменившиеся пользователи не стоят ни одного syscall'а.
+    interactive = !daemon && isatty(STDIN_FILENO);
+    int watching = 0;
+#ifdef KUBSH_FUSE
+    if (fuse_mode) {
+        if (vfs_fuse_start() != 0) {
+            fprintf(stderr, "kubsh: не удалось смонтировать VFS в %s\n", get_users_dir_path());
+            return 1;
+        }
+        // Файлы на диске не ведутся: ни генерации, ни наблюдения за каталогом
+        watching = 1;
+    }
+#endif
+    if (!fuse_mode) create_users_vfs();
+    load_history();
+
+    if (!fuse_mode) {
+        // Наблюдение ставим до первой синхронизации, чтобы не пропустить изменения между ними
+        watching = !config.sync_poll && vfs_watch_init() == 0;
+        // Синхронизируем VFS при запуске (для тестов)
+        sync_vfs_with_system();
+        if (!watching && !config.sync_poll) watching = vfs_watch_init() == 0;
+    }
+
+    if (daemon) {
+        int status = run_daemon(watching);
+        jobs_wait_all();
+        shell_jobs_hangup();
+        stats_export_tick(1);
+        vfs_watch_close();
+#ifdef KUBSH_FUSE
+        vfs_fuse_stop();
+#endif
+        free_history();
+        return status;
+    }
+
+    if (interactive) {
+        printf("KubShell с VFS\nVFS: %s\nВведите 'help' для справки\n\n", get_users_dir_path());
+        job_control_init();
+        editor_init(&editor);
+    }
+
+    while (1) {
+        if (editor.enabled) editor_start(&editor);
+        else if (interactive) printf("kubsh> ");
+
+        char *input;
+        while (!(input = editor.enabled ? editor_take(&editor, &in) : line_reader_take(&in)) && !in.eof) {
+            fflush(stdout);
+
+            // Ждём ввод. Изменения в VFS и /etc/passwd приходят событиями inotify,
+            // поэтому select() блокируется без таймаута; без inotify — опрос.
             fd_set rfds;
             FD_ZERO(&rfds);
             FD_SET(STDIN_FILENO, &rfds);
+            int maxfd = STDIN_FILENO;
+            if (vfs_watch_fd != -1) {
+                FD_SET(vfs_watch_fd, &rfds);
+                if (vfs_watch_fd > maxfd) maxfd = vfs_watch_fd;
+            }
+            if (job_notify_fd != -1) {
+                FD_SET(job_notify_fd, &rfds);
+                if (job_notify_fd > maxfd) maxfd = job_notify_fd;
+            }
+            if (reload_pipe[0] != -1) {
+                FD_SET(reload_pipe[0], &rfds);
+                if (reload_pipe[0] > maxfd) maxfd = reload_pipe[0];
+            }
+            if (sigchld_fd != -1) {
+                FD_SET(sigchld_fd, &rfds);
+                if (sigchld_fd > maxfd) maxfd = sigchld_fd;
+            }
+            // Выгрузка статистики тоже будит цикл, если накопилось невыгруженное
+            long wait_ms = watching ? -1 : config.sync_interval_ms;
+            long export_ms = stats_export_tick(0);
+            if (export_ms >= 0 && (wait_ms < 0 || export_ms < wait_ms)) wait_ms = export_ms;
             struct timeval tv;
-            tv.tv_sec = 0;
-            tv.tv_usec = 200000; // 200ms
+            tv.tv_sec = wait_ms / 1000;
+            tv.tv_usec = wait_ms % 1000 * 1000;
 
-            int rv = select(STDIN_FILENO + 1, &rfds, NULL, NULL, &tv);
+            int rv = select(maxfd + 1, &rfds, NULL, NULL, wait_ms < 0 ? NULL : &tv);
             if (rv == -1) {
                 if (errno == EINTR) continue;
+                in.eof = 1;
                 break;
             }
             if (rv == 0) {
-                // таймаут — продолжаем ждать, но синхронизацию уже сделали
+                // таймаут — опрашиваем систему и продолжаем ждать
+                if (!watching) {
+                    editor_hide(&editor);
+                    sync_vfs_with_system();
+                    editor_show(&editor);
+                }
+                continue;
+            }
+            // SIGHUP: новая конфигурация могла сменить корень VFS и способ синхронизации
+            if (reload_pipe[0] != -1 && FD_ISSET(reload_pipe[0], &rfds)) {
+                editor_hide(&editor);
+                if (config_reload_pending() && interactive && !editor.enabled) printf("kubsh> ");
+                editor_show(&editor);
+                watching = fuse_mode || vfs_watch_fd != -1;
                 continue;
             }
-            break; // stdin готов для чтения
+            // События обрабатываем раньше ввода: команда должна видеть актуальный VFS.
+            // Набираемая строка на это время убирается с экрана, чтобы не смешаться с сообщениями
+            if (vfs_watch_fd != -1 && FD_ISSET(vfs_watch_fd, &rfds)) {
+                editor_hide(&editor);
+                vfs_watch_handle();
+                editor_show(&editor);
+                watching = vfs_watch_fd != -1;
+            }
+            // Завершившиеся фоновые задания: сообщение и заново приглашение
+            if (job_notify_fd != -1 && FD_ISSET(job_notify_fd, &rfds)) {
+                if (editor.enabled) {
+                    editor_hide(&editor);
+                    jobs_report();
+                    editor_show(&editor);
+                } else {
+                    if (interactive) printf("\n");
+                    if (jobs_report() && interactive) printf("kubsh> ");
+                }
+            }
+            if (sigchld_fd != -1 && FD_ISSET(sigchld_fd, &rfds)) {
+                sigchld_drain();
+                editor_hide(&editor);
+                int reported = shell_jobs_reap(1);
+                editor_show(&editor);
+                if (reported && interactive && !editor.enabled) printf("kubsh> ");
+            }
+            if (FD_ISSET(STDIN_FILENO, &rfds)) line_reader_fill(&in);
         }
 
-        if (!fgets(input, sizeof(input), stdin)) {
+        if (!input) {
             // перед выходом ещё раз синхронизируем
-            sync_vfs_with_system();
+            if (vfs_watch_fd != -1) vfs_watch_handle();
+            else sync_vfs_with_system();
             break;
         }
 
-        input[strcspn(input, "\n")] = 0;
-        if (strlen(input) == 0) continue;
+        if (!handle_line(input)) break;
 
-        if (strcmp(input, "\\q") == 0) break;
-
-        add_to_history(input);
-        process_command(input);
-        
-        // Синхронизируем VFS после обработки команды (для тестов)
-        // Это гарантирует, что новые директории будут обнаружены после команд
-        sync_vfs_with_system();
+        // Без inotify синхронизируем после команд, которые могли изменить пользователей
+        if (!watching && command_mutated_users) sync_vfs_with_system();
     }
 
-    printf("\nВыход из shell\n");
-    save_history();
+    jobs_wait_all();
+    shell_jobs_hangup();
+    stats_export_tick(1);
+    vfs_watch_close();
+#ifdef KUBSH_FUSE
+    vfs_fuse_stop();
+#endif
+    if (interactive) printf("\nВыход из shell\n");
+    editor_free(&editor);
+    completion_free();
     free_history();
+    free(in.buf);
     return 0;
 }
@@ -0,0 +1,143 @@
+#!/bin/bash
+# Проверка разбора таблиц разделов в \l (make check-partitions)
+# Образы собираются побайтно (dd, gzip для CRC32), без sfdisk и root:
+#   mbr.img     — MBR с тремя основными разделами и цепочкой EBR из двух логических
+#   gpt.img     — защитный MBR и GPT с двумя разделами
+#   gpt_bad.img — то же с испорченным основным заголовком: читается резервная копия
+#
+# Переменные окружения:
+#   KUBSH — проверяемый бинарник (по умолчанию ./kubsh)
+
+set -euo pipefail
+
+KUBSH=$(realpath "${KUBSH:-./kubsh}")
+SECTORS=131072   # 64 МиБ по 512 байт
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/kubsh-parts.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+# kubsh без чужого конфига, истории и демона
+export HOME="$WORK/home"
+export KUBSH_SOCKET="$WORK/no-daemon.sock"
+mkdir -p "$HOME"
+
+# Число value в n байтах little-endian, шестнадцатерично
+le() {
+    local value=$1 n=$2 out="" i
+    for ((i = 0; i < n; i++)); do
+        out+=$(printf '%02x' $(( (value >> (8 * i)) & 255 )))
+    done
+    echo "$out"
+}
+
+# Шестнадцатеричные байты hex в файл по смещению offset
+put() {
+    local file=$1 offset=$2 hex=$3
+    printf "$(sed 's/../\\x&/g' <<< "$hex")" |
+        dd of="$file" bs=64K seek="$offset" oflag=seek_bytes conv=notrunc status=none
+}
+
+# CRC32 файла байтами little-endian: его хранит хвост формата gzip
+crc32() {
+    gzip -c < "$1" | tail -c8 | head -c4 | od -An -tx1 | tr -d ' \n'
+}
+
+# GUID в порядке байтов GPT: первые три группы — little-endian
+guid() {
+    local g=${1//-/}
+    echo "${g:6:2}${g:4:2}${g:2:2}${g:0:2}${g:10:2}${g:8:2}${g:14:2}${g:12:2}${g:16:16}"
+}
+
+# Запись раздела MBR/EBR: активный, тип, первый сектор, число секторов
+mbr_entry() {
+    printf '%02x000000%02x000000%s%s' $(( $1 ? 0x80 : 0 )) "$2" "$(le "$3" 4)" "$(le "$4" 4)"
+}
+
+# Сектор с таблицей MBR: номер сектора, записи, подпись 55aa
+put_table() {
+    local file=$1 sector=$2 entries=$3
+    put "$file" $(( sector * 512 + 446 )) "$entries"
+    put "$file" $(( sector * 512 + 510 )) 55aa
+}
+
+make_mbr() {
+    local img=$1
+    truncate -s $(( SECTORS * 512 )) "$img"
+    put "$img" 440 "$(le $((0xdeadbeef)) 4)"
+    put_table "$img" 0 "$(mbr_entry 1 0x83 2048 20480)$(mbr_entry 0 0x82 22528 8192)$(mbr_entry 0 0x05 30720 40960)"
+    # EBR: логический раздел относительно своего EBR, ссылка — относительно начала расширенного
+    put_table "$img" 30720 "$(mbr_entry 0 0x83 2048 10000)$(mbr_entry 0 0x05 14336 20000)"
+    put_table "$img" $(( 30720 + 14336 )) "$(mbr_entry 0 0x8e 2048 8000)"
+}
+
+# Заголовок GPT в сектор lba: my, alternate, LBA массива записей
+gpt_header() {
+    local img=$1 lba=$2 alt=$3 entries_lba=$4 entries_crc=$5 hdr="$WORK/hdr.bin"
+    rm -f "$hdr"
+    truncate -s 92 "$hdr"
+    put "$hdr" 0 "4546492050415254000001005c00000000000000"
+    put "$hdr" 24 "$(le "$lba" 8)$(le "$alt" 8)$(le 34 8)$(le $(( SECTORS - 34 )) 8)"
+    put "$hdr" 56 "$(guid 11111111-2222-3333-4444-555555555555)"
+    put "$hdr" 72 "$(le "$entries_lba" 8)$(le 128 4)$(le 128 4)$entries_crc"
+    put "$hdr" 16 "$(crc32 "$hdr")"
+    dd if="$hdr" of="$img" bs=512 seek="$lba" conv=notrunc status=none
+}
+
+# Запись GPT: номер, тип, первый и последний сектор, имя (ASCII → UTF-16LE)
+gpt_entry() {
+    local file=$1 i=$2 type=$3 first=$4 last=$5 name=$6 utf16="" c
+    for ((c = 0; c < ${#name}; c++)); do
+        utf16+=$(printf '%02x00' "'${name:c:1}")
+    done
+    put "$file" $(( i * 128 )) "$(guid "$type")$(guid 00000000-0000-0000-0000-00000000000$((i + 1)))$(le "$first" 8)$(le "$last" 8)0000000000000000$utf16"
+}
+
+make_gpt() {
+    local img=$1 entries="$WORK/entries.bin"
+    truncate -s $(( SECTORS * 512 )) "$img"
+    put_table "$img" 0 "$(mbr_entry 0 0xee 1 $(( SECTORS - 1 )))"
+    rm -f "$entries"
+    truncate -s $(( 128 * 128 )) "$entries"
+    gpt_entry "$entries" 0 C12A7328-F81F-11D2-BA4B-00A0C93EC93B 2048 4095 efi
+    gpt_entry "$entries" 1 0FC63DAF-8483-4772-8E79-3D69D8477DE4 4096 $(( SECTORS - 34 )) root
+    local crc
+    crc=$(crc32 "$entries")
+    dd if="$entries" of="$img" bs=512 seek=2 conv=notrunc status=none
+    dd if="$entries" of="$img" bs=512 seek=$(( SECTORS - 33 )) conv=notrunc status=none
+    gpt_header "$img" 1 $(( SECTORS - 1 )) 2 "$crc"
+    gpt_header "$img" $(( SECTORS - 1 )) 1 $(( SECTORS - 33 )) "$crc"
+}
+
+failed=0
+
+# Разделы из \l -m: тип, номер, начало, конец, секторов — через пробел
+check() {
+    local name=$1 img=$2 expected=$3 actual
+    actual=$("$KUBSH" -c "\\l -m $img" | awk -F'\t' '$1 == "part" { print $4, $5, $6, $7, $8 }')
+    if [[ "$actual" == "$expected" ]]; then
+        echo "OK   $name"
+    else
+        echo "FAIL $name"
+        diff <(echo "$expected") <(echo "$actual") || true
+        failed=1
+    fi
+}
+
+make_mbr "$WORK/mbr.img"
+check "MBR и цепочка EBR" "$WORK/mbr.img" "Linux 1 2048 22527 20480
+Linux swap / Solaris 2 22528 30719 8192
+Extended 3 30720 71679 40960
+Linux 5 32768 42767 10000
+Linux LVM 6 47104 55103 8000"
+
+gpt_parts="EFI System 1 2048 4095 2048
+Linux filesystem 2 4096 131038 126943"
+make_gpt "$WORK/gpt.img"
+check "GPT" "$WORK/gpt.img" "$gpt_parts"
+
+# Портим зарезервированное поле основного заголовка — его CRC больше не сходится
+cp "$WORK/gpt.img" "$WORK/gpt_bad.img"
+put "$WORK/gpt_bad.img" $(( 512 + 20 )) ff
+check "GPT с испорченным основным заголовком" "$WORK/gpt_bad.img" "$gpt_parts"
+
+exit $failed